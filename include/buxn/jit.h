@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 struct buxn_vm_s;
 
@@ -10,34 +11,202 @@ typedef struct buxn_jit_s buxn_jit_t;
 typedef struct buxn_jit_hook_ctx_s buxn_jit_hook_ctx_t;
 typedef struct buxn_jit_addr_mark_s buxn_jit_addr_mark_t;
 
+// Size of the table of opcode sequences which are compiled as a whole
+#define BUXN_JIT_NUM_IDIOMS 5
+// Number of kinds of rewrites made to adjacent instructions before code
+// generation
+#define BUXN_JIT_NUM_REWRITES 4
+
 typedef struct {
 	size_t code_size;
 	int num_blocks;
+	// Copies of blocks specialized on the stack values passed in registers
+	// by the jumps into them
+	int num_variants;
+	// Backward jumps compiled as native loops within a block
+	int num_loops;
+	// Always 0 now that the zero page is compiled, kept for compatibility
 	int num_bounces;
+	int num_evictions;
+	int num_invalidations;
+	int num_interpreted;
+	// Cached stack values written to the VM stack early because the stack
+	// cache was full
+	int num_spills;
+	// Cached stack values moved to a native stack slot to free a register
+	int num_slot_spills;
+	// Loads from constant addresses served from a register
+	int num_forwarded_loads;
+	// Zero page stores overwritten before they were written to memory
+	int num_dead_stores;
+	// Total time spent compiling blocks
+	uint64_t compile_time_ns;
+	// Number of times each idiom was compiled, see buxn_jit_idiom_name
+	int idiom_hits[BUXN_JIT_NUM_IDIOMS];
+	// Number of times each kind of rewrite was made, see
+	// buxn_jit_rewrite_name
+	int rewrite_hits[BUXN_JIT_NUM_REWRITES];
+
+	// Size of the address space reserved for code
+	size_t code_arena_capacity;
+	// Bytes handed out from the arena so far, including freed ones
+	size_t code_arena_used;
+	// Freed bytes waiting to be reused
+	size_t code_arena_free;
+	// Allocations which did not fit into the arena
+	int num_arena_overflows;
 } buxn_jit_stats_t;
 
 typedef struct buxn_jit_hook_s {
 	void* userdata;
 
 	void (*begin_block)(void* userdata, buxn_jit_hook_ctx_t* ctx);
+	// Called for every opcode as it is compiled.
+	// Opcodes which were folded into a constant or removed are not reported.
 	void (*jit_opcode)(void* userdata, buxn_jit_hook_ctx_t* ctx, uint16_t pc, uint8_t opcode);
 	void (*end_block)(void* userdata, buxn_jit_hook_ctx_t* ctx, uintptr_t start, size_t size);
 } buxn_jit_hook_t;
 
+typedef enum {
+	// DEI/DEO go through buxn_vm_dei/buxn_vm_deo with the VM state written
+	// back first
+	BUXN_JIT_PORT_FULL = 0,
+	// Reads and writes only go to vm->device
+	BUXN_JIT_PORT_PASSIVE,
+	// The callbacks of the port are called directly.
+	// They must not access the stacks or memory.
+	BUXN_JIT_PORT_CALLBACK,
+} buxn_jit_port_kind_t;
+
+typedef struct {
+	buxn_jit_port_kind_t kind;
+	// Called instead of buxn_vm_dei, NULL reads vm->device
+	uint8_t (*dei)(struct buxn_vm_s* vm, uint8_t address);
+	// Called after vm->device was written, NULL does nothing else
+	void (*deo)(struct buxn_vm_s* vm, uint8_t address);
+	// For BUXN_JIT_PORT_FULL: buxn_vm_dei/buxn_vm_deo do not access
+	// vm->ws, vm->rs, vm->wsp or vm->rsp for this port.
+	// Cached stack values then stay out of memory across the call.
+	bool no_stack_access;
+} buxn_jit_port_t;
+
 typedef struct {
 	void* mem_ctx;
 	buxn_jit_hook_t* hook;
+	// Soft limit for the total size of generated code in bytes.
+	// When it is exceeded, cold blocks are evicted before the next execution.
+	// 0 means no limit.
+	size_t max_code_size;
+	// Compile in a worker thread.
+	// Code which is not compiled yet runs in the interpreter meanwhile and code
+	// which is ready keeps running while the worker compiles.
+	// New code only becomes reachable at the next call into the JIT.
+	// mem_ctx and hook are called from the worker while it holds the JIT lock.
+	bool background_compile;
+	// Interpret a block this many times before compiling it.
+	// 0 compiles everything on first use.
+	uint32_t hot_threshold;
+	// Address space to reserve for code.
+	// Pages are only committed when they are used.
+	// 0 means a default of 64 MiB.
+	size_t code_arena_size;
+	// Number of stack values kept out of memory within a block, for each of
+	// the two stacks.
+	// Values which do not fit into registers are kept in native stack slots.
+	// 0 means a default of 4, the maximum is 32.
+	uint8_t stack_cache_size;
+	// Compile literals as constants instead of loading them from memory.
+	// Compiled code is invalidated when its literals are overwritten and
+	// literals which were overwritten once are loaded from memory again.
+	bool const_literals;
+	// How each of the 256 device ports is compiled, indexed by address.
+	// Ports are only specialized when their address is a literal.
+	// The table is copied, NULL makes every port BUXN_JIT_PORT_FULL.
+	const buxn_jit_port_t* ports;
 } buxn_jit_config_t;
 
+// A vector which is executed repeatedly, e.g: a device vector.
+// Initialize it with only the address set.
+typedef struct {
+	uint16_t addr;
+	// Looked up on first execution
+	struct buxn_jit_block_s* block;
+} buxn_jit_vector_t;
+
+// Prepare the VM for the event at `index`, e.g: by writing it into device
+// memory.
+// Returning false stops the batch before the event is handled.
+typedef bool (*buxn_jit_event_fn_t)(struct buxn_vm_s* vm, void* events, size_t index);
+
 buxn_jit_t*
 buxn_jit_init(struct buxn_vm_s* vm, const buxn_jit_config_t* config);
 
 buxn_jit_stats_t*
 buxn_jit_stats(buxn_jit_t* jit);
 
+// The opcode sequence of an entry in buxn_jit_stats_t.idiom_hits
+const char*
+buxn_jit_idiom_name(int idiom);
+
+// What an entry in buxn_jit_stats_t.rewrite_hits counts
+const char*
+buxn_jit_rewrite_name(int rewrite);
+
 void
 buxn_jit_execute(buxn_jit_t* jit, uint16_t pc);
 
+// Same as buxn_jit_execute but without looking up the code of the vector
+void
+buxn_jit_execute_vector(buxn_jit_t* jit, buxn_jit_vector_t* vector);
+
+// Execute a vector once for every event.
+// Freeing and evicting code is only done once for the whole batch, the
+// code budget may be exceeded until it returns.
+// Returns the number of events which were handled.
+size_t
+buxn_jit_execute_batch(
+	buxn_jit_t* jit,
+	buxn_jit_vector_t* vector,
+	void* events,
+	size_t num_events,
+	buxn_jit_event_fn_t setup
+);
+
+// Discard compiled code which was read from the given inclusive address range.
+// Stores made by JIT'ed code and by the interpreter are tracked automatically.
+// This must be called when the host writes code into memory.
+void
+buxn_jit_invalidate_range(buxn_jit_t* jit, uint16_t lo, uint16_t hi);
+
+// Compile everything reachable through constant jumps from the reset vector
+// and the given entry points (e.g: device vectors) ahead of time.
+// Tiering is bypassed for these blocks.
+void
+buxn_jit_precompile(buxn_jit_t* jit, const uint16_t* entry_pcs, size_t num_entries);
+
+// Write compiled code to a file so that a later process can skip compilation.
+// Only code compiled from unmodified ROM bytes is saved.
+// `rom` must be the ROM as it was loaded at the reset vector.
+bool
+buxn_jit_save_image(
+	buxn_jit_t* jit,
+	const char* path,
+	const void* rom,
+	size_t rom_size
+);
+
+// Load code saved by buxn_jit_save_image.
+// Returns false if the file is missing or it was saved for a different ROM,
+// platform or JIT version.
+// Hooks are not called for loaded code.
+bool
+buxn_jit_load_image(
+	buxn_jit_t* jit,
+	const char* path,
+	const void* rom,
+	size_t rom_size
+);
+
 void
 buxn_jit_cleanup(buxn_jit_t* jit);
 
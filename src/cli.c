@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -25,11 +26,281 @@
 #	define BUXN_CLI_WITH_PERF_HOOK 1
 #endif
 
+#if !defined(_WIN32) && !defined(__STDC_NO_THREADS__)
+#	define BUXN_CLI_WITH_WRITER_THREAD 1
+#endif
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#	include <io.h>
+#	include <process.h>
+#	define read _read
+#	define write _write
+#	define isatty _isatty
+#else
+#	include <unistd.h>
+#	include <errno.h>
+#	include <sys/stat.h>
+#endif
+
+#if BUXN_CLI_WITH_WRITER_THREAD
+#	include <threads.h>
+#	include <stdatomic.h>
+#endif
+
+// Must be a power of 2
+#define BUXN_CLI_OUTPUT_BUF_SIZE (64 * 1024)
+#define BUXN_CLI_INPUT_BUF_SIZE (64 * 1024)
+
+// Console output is buffered and only written out before the CLI waits for
+// more input or when the buffer is full.
+// When stdout is a pipe, a writer thread does the writing so that execution
+// does not wait for the reader.
+#if BUXN_CLI_WITH_WRITER_THREAD
+// Only the VM thread moves the tail and only the writer moves the head so
+// bytes are appended without taking the lock
+typedef atomic_size_t output_index_t;
+#else
+typedef size_t output_index_t;
+#endif
+
+typedef struct {
+	int fd;
+	bool line_buffered;
+	// Both are free running and wrapped when indexing
+	output_index_t head;
+	output_index_t tail;
+#if BUXN_CLI_WITH_WRITER_THREAD
+	bool has_writer;
+	bool writer_shutdown;
+	mtx_t lock;
+	cnd_t data_available;
+	cnd_t space_available;
+	thrd_t writer;
+#endif
+	uint8_t data[BUXN_CLI_OUTPUT_BUF_SIZE];
+} output_t;
+
 typedef struct {
 	buxn_console_t console;
 	buxn_jit_t* jit;
+	output_t* stdout_buf;
+	output_t* stderr_buf;
 } vm_data_t;
 
+static void
+output_write_all(int fd, const uint8_t* data, size_t size) {
+	while (size > 0) {
+		int num_bytes = (int)write(fd, data, (unsigned)size);
+		if (num_bytes < 0) {
+#ifndef _WIN32
+			if (errno == EINTR) { continue; }
+#endif
+			// Nowhere to report this, the output is dropped
+			return;
+		}
+
+		data += num_bytes;
+		size -= (size_t)num_bytes;
+	}
+}
+
+// The contiguous part of the pending data
+static inline size_t
+output_pending_span(const output_t* output) {
+	size_t start = output->head % BUXN_CLI_OUTPUT_BUF_SIZE;
+	size_t len = output->tail - output->head;
+	return len < BUXN_CLI_OUTPUT_BUF_SIZE - start ? len : BUXN_CLI_OUTPUT_BUF_SIZE - start;
+}
+
+static void
+output_drain(output_t* output) {
+	while (output->head != output->tail) {
+		size_t span = output_pending_span(output);
+		output_write_all(
+			output->fd,
+			&output->data[output->head % BUXN_CLI_OUTPUT_BUF_SIZE],
+			span
+		);
+		output->head += span;
+	}
+}
+
+#if BUXN_CLI_WITH_WRITER_THREAD
+
+static int
+output_writer(void* userdata) {
+	output_t* output = userdata;
+
+	mtx_lock(&output->lock);
+	while (true) {
+		if (output->head != output->tail) {
+			// The producer only appends after the tail so the pending data can
+			// be written without holding the lock
+			size_t span = output_pending_span(output);
+			const uint8_t* data = &output->data[output->head % BUXN_CLI_OUTPUT_BUF_SIZE];
+			mtx_unlock(&output->lock);
+			output_write_all(output->fd, data, span);
+			mtx_lock(&output->lock);
+
+			output->head += span;
+			cnd_signal(&output->space_available);
+		} else if (output->writer_shutdown) {
+			break;
+		} else {
+			cnd_wait(&output->data_available, &output->lock);
+		}
+	}
+	mtx_unlock(&output->lock);
+
+	return 0;
+}
+
+static void
+output_start_writer(output_t* output) {
+	if (mtx_init(&output->lock, mtx_plain) != thrd_success) {
+		return;
+	}
+
+	if (cnd_init(&output->data_available) != thrd_success) {
+		mtx_destroy(&output->lock);
+		return;
+	}
+
+	if (cnd_init(&output->space_available) != thrd_success) {
+		cnd_destroy(&output->data_available);
+		mtx_destroy(&output->lock);
+		return;
+	}
+
+	if (thrd_create(&output->writer, output_writer, output) != thrd_success) {
+		cnd_destroy(&output->space_available);
+		cnd_destroy(&output->data_available);
+		mtx_destroy(&output->lock);
+		return;
+	}
+
+	output->has_writer = true;
+}
+
+#endif
+
+static void
+output_init(output_t* output, int fd) {
+	output->fd = fd;
+	output->head = output->tail = 0;
+	// Someone is watching
+	output->line_buffered = isatty(fd);
+
+#if BUXN_CLI_WITH_WRITER_THREAD
+	output->has_writer = false;
+	output->writer_shutdown = false;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode)) {
+		output_start_writer(output);
+	}
+#endif
+}
+
+// Write out everything buffered so far.
+// With a writer thread, this only wakes it up unless `wait` is set.
+// Waiting is needed before writing to the file descriptor by other means.
+static void
+output_flush(output_t* output, bool wait) {
+#if BUXN_CLI_WITH_WRITER_THREAD
+	if (output->has_writer) {
+		mtx_lock(&output->lock);
+		if (output->head != output->tail) {
+			cnd_signal(&output->data_available);
+		}
+		while (wait && output->head != output->tail) {
+			cnd_wait(&output->space_available, &output->lock);
+		}
+		mtx_unlock(&output->lock);
+		return;
+	}
+#else
+	(void)wait;
+#endif
+
+	output_drain(output);
+}
+
+// Make room for at least one byte
+static void
+output_reserve(output_t* output) {
+	if (output->tail - output->head < BUXN_CLI_OUTPUT_BUF_SIZE) { return; }
+
+#if BUXN_CLI_WITH_WRITER_THREAD
+	if (output->has_writer) {
+		mtx_lock(&output->lock);
+		while (output->tail - output->head == BUXN_CLI_OUTPUT_BUF_SIZE) {
+			cnd_signal(&output->data_available);
+			cnd_wait(&output->space_available, &output->lock);
+		}
+		mtx_unlock(&output->lock);
+		return;
+	}
+#endif
+
+	output_drain(output);
+}
+
+static void
+output_write(output_t* output, const uint8_t* data, size_t size) {
+	while (size > 0) {
+		output_reserve(output);
+
+		// Copy as much as fits before the free space wraps around
+		size_t tail = output->tail;
+		size_t start = tail % BUXN_CLI_OUTPUT_BUF_SIZE;
+		size_t space = BUXN_CLI_OUTPUT_BUF_SIZE - (tail - output->head);
+		if (space > BUXN_CLI_OUTPUT_BUF_SIZE - start) {
+			space = BUXN_CLI_OUTPUT_BUF_SIZE - start;
+		}
+		size_t span = size < space ? size : space;
+		memcpy(&output->data[start], data, span);
+		output->tail = tail + span;
+
+		data += span;
+		size -= span;
+	}
+}
+
+static void
+output_putc(output_t* output, char c) {
+	output_reserve(output);
+	output->data[output->tail % BUXN_CLI_OUTPUT_BUF_SIZE] = (uint8_t)c;
+	output->tail += 1;
+
+	if (c == '\n' && output->line_buffered) {
+		output_flush(output, false);
+	}
+}
+
+// Write out everything and stop the writer thread
+static void
+output_cleanup(output_t* output) {
+#if BUXN_CLI_WITH_WRITER_THREAD
+	if (output->has_writer) {
+		mtx_lock(&output->lock);
+		output->writer_shutdown = true;
+		cnd_signal(&output->data_available);
+		mtx_unlock(&output->lock);
+
+		thrd_join(output->writer, NULL);
+		cnd_destroy(&output->space_available);
+		cnd_destroy(&output->data_available);
+		mtx_destroy(&output->lock);
+		output->has_writer = false;
+		return;
+	}
+#endif
+
+	output_drain(output);
+}
+
 static inline void
 buxn_console_send_data_jit(
 	buxn_vm_t* vm,
@@ -45,9 +316,75 @@ buxn_console_send_data_jit(
 	buxn_jit_execute(vm_data->jit, vector_addr);
 }
 
+static uint8_t
+buxn_console_dei_jit(struct buxn_vm_s* vm, uint8_t address) {
+	vm_data_t* vm_data = vm->config.userdata;
+	return buxn_console_dei(vm, &vm_data->console, address);
+}
+
 static void
-buxn_console_send_input_jit(struct buxn_vm_s* vm, buxn_console_t* device, char c) {
-	buxn_console_send_data_jit(vm, device, BUXN_CONSOLE_STDIN, c);
+buxn_console_deo_jit(struct buxn_vm_s* vm, uint8_t address) {
+	vm_data_t* vm_data = vm->config.userdata;
+	buxn_console_deo(vm, &vm_data->console, address);
+}
+
+static uint8_t
+buxn_datetime_dei_jit(struct buxn_vm_s* vm, uint8_t address) {
+	return buxn_datetime_dei(vm, address);
+}
+
+// Mirrors buxn_vm_dei and buxn_vm_deo below
+static void
+init_jit_ports(buxn_jit_port_t* ports) {
+	for (int i = 0; i < 256; ++i) {
+		uint8_t device_id = buxn_device_id((uint8_t)i);
+		if (device_id == BUXN_DEVICE_DATETIME) {
+			ports[i] = (buxn_jit_port_t){
+				.kind = BUXN_JIT_PORT_CALLBACK,
+				.dei = buxn_datetime_dei_jit,
+			};
+		} else if (device_id == BUXN_DEVICE_CONSOLE && (i == 0x18 || i == 0x19)) {
+			// Write and error only print
+			ports[i] = (buxn_jit_port_t){
+				.kind = BUXN_JIT_PORT_CALLBACK,
+				.dei = buxn_console_dei_jit,
+				.deo = buxn_console_deo_jit,
+			};
+		} else if (device_id == BUXN_DEVICE_SYSTEM || device_id == BUXN_DEVICE_CONSOLE) {
+			ports[i] = (buxn_jit_port_t){
+				.kind = BUXN_JIT_PORT_FULL,
+				// Stack pointers, debug and state are the only ports
+				// looking at the stacks
+				.no_stack_access = device_id == BUXN_DEVICE_CONSOLE
+					|| (i != 0x04 && i != 0x05 && i != 0x0e && i != 0x0f),
+			};
+		} else {
+			ports[i] = (buxn_jit_port_t){ .kind = BUXN_JIT_PORT_PASSIVE };
+		}
+	}
+}
+
+typedef struct {
+	const uint8_t* bytes;
+	uint16_t vector_addr;
+} input_chunk_t;
+
+static bool
+buxn_console_setup_input_jit(struct buxn_vm_s* vm, void* events, size_t index) {
+	const input_chunk_t* chunk = events;
+	if (
+		buxn_system_exit_code(vm) >= 0
+		|| !buxn_console_should_send_input(vm)
+		// The previous input changed the vector
+		|| buxn_vm_dev_load2(vm, 0x10) != chunk->vector_addr
+	) {
+		return false;
+	}
+
+	vm_data_t* vm_data = vm->config.userdata;
+	vm_data->console.type = BUXN_CONSOLE_STDIN;
+	vm_data->console.value = chunk->bytes[index];
+	return true;
 }
 
 static void
@@ -82,6 +419,61 @@ buxn_console_send_args_jit(struct buxn_vm_s* vm, buxn_console_t* device) {
 	}
 }
 
+static bool
+expansion_target(buxn_vm_t* vm, uint16_t* lo, uint16_t* hi) {
+	const uint8_t* cmd = &vm->memory[buxn_vm_dev_load2(vm, 0x02)];
+	uint16_t length = (uint16_t)cmd[1] << 8 | (uint16_t)cmd[2];
+	uint16_t bank;
+	uint16_t addr;
+	switch (cmd[0]) {
+		case 0x00:  // fill
+			bank = (uint16_t)cmd[3] << 8 | (uint16_t)cmd[4];
+			addr = (uint16_t)cmd[5] << 8 | (uint16_t)cmd[6];
+			break;
+		case 0x01:  // cpyl
+		case 0x02:  // cpyr
+			bank = (uint16_t)cmd[7] << 8 | (uint16_t)cmd[8];
+			addr = (uint16_t)cmd[9] << 8 | (uint16_t)cmd[10];
+			break;
+		default:
+			return false;
+	}
+
+	// Only the first bank is executable
+	if (bank != 0 || length == 0) { return false; }
+
+	*lo = addr;
+	*hi = (uint32_t)addr + length - 1 > 0xffff ? 0xffff : (uint16_t)(addr + length - 1);
+	return true;
+}
+
+// A file next to the image which no other run writes to
+static char*
+image_tmp_path(barena_t* arena, const char* image_path) {
+	size_t size = strlen(image_path) + 32;
+	char* tmp_path = barena_memalign(arena, size, _Alignof(char));
+#ifdef _WIN32
+	snprintf(tmp_path, size, "%s.%d.tmp", image_path, _getpid());
+	return tmp_path;
+#else
+	snprintf(tmp_path, size, "%s.XXXXXX", image_path);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) { return NULL; }
+	close(fd);
+	return tmp_path;
+#endif
+}
+
+// The old file stays in place until it is replaced
+static bool
+replace_file(const char* from, const char* to) {
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
 static int
 boot(
 	int argc, const char* argv[],
@@ -199,14 +591,20 @@ end_read:
 		NULL,
 	});
 
+	buxn_jit_port_t ports[256];
+	init_jit_ports(ports);
 	buxn_jit_t* jit = buxn_jit_init(vm, &(buxn_jit_config_t){
 		.mem_ctx = &arena,
 		.hook = &jit_hook,
+		.ports = ports,
+		// Self-modifying ROMs invalidate the blocks whose literals they write
+		.const_literals = true,
 	});
 	buxn_jit_stats_t* stats = buxn_jit_stats(jit);
 	devices.jit = jit;
 
 	// Read rom
+	size_t rom_size;
 	{
 		uint8_t* read_pos = &vm->memory[BUXN_RESET_VECTOR];
 		while (read_pos < vm->memory + vm->config.memory_size) {
@@ -214,9 +612,31 @@ end_read:
 			if (num_bytes == 0) { break; }
 			read_pos += num_bytes;
 		}
+		rom_size = read_pos - &vm->memory[BUXN_RESET_VECTOR];
 	}
 	fclose(rom_file);
 
+	// Reuse code compiled by a previous run
+	char* image_path = NULL;
+	uint8_t* rom = NULL;
+	const char* cache_env = getenv("BUXN_JIT_CACHE");
+	if (cache_env != NULL && cache_env[0] != '\0') {
+		image_path = barena_memalign(&arena, strlen(rom_path) + 5, _Alignof(char));
+		snprintf(image_path, strlen(rom_path) + 5, "%s.jit", rom_path);
+
+		// Memory will be modified during execution
+		rom = barena_memalign(&arena, rom_size, _Alignof(uint8_t));
+		memcpy(rom, &vm->memory[BUXN_RESET_VECTOR], rom_size);
+		buxn_jit_load_image(jit, image_path, rom, rom_size);
+	}
+
+	output_t* stdout_buf = barena_memalign(&arena, sizeof(output_t), _Alignof(output_t));
+	output_t* stderr_buf = barena_memalign(&arena, sizeof(output_t), _Alignof(output_t));
+	output_init(stdout_buf, 1);
+	output_init(stderr_buf, 2);
+	devices.stdout_buf = stdout_buf;
+	devices.stderr_buf = stderr_buf;
+
 	buxn_console_init(vm, &devices.console, argc, argv);
 
 	buxn_jit_execute(jit, BUXN_RESET_VECTOR);
@@ -229,25 +649,98 @@ end_read:
 		goto end;
 	}
 
+	// Input is read in chunks, each one is handled in batches which stop
+	// early when the console vector changes.
+	// Output is flushed before waiting for the next chunk.
+	uint8_t* input_buf = barena_memalign(&arena, BUXN_CLI_INPUT_BUF_SIZE, _Alignof(uint8_t));
+	buxn_jit_vector_t console_vector = { .addr = buxn_vm_dev_load2(vm, 0x10) };
 	while (
 		buxn_system_exit_code(vm) < 0
 		&& buxn_console_should_send_input(vm)
 	) {
-		int ch = fgetc(stdin);
-		if (ch != EOF) {
-			buxn_console_send_input_jit(vm, &devices.console, ch);
-		} else {
+		output_flush(stdout_buf, false);
+		output_flush(stderr_buf, false);
+
+		int num_bytes = (int)read(0, input_buf, BUXN_CLI_INPUT_BUF_SIZE);
+		if (num_bytes < 0) {
+#ifndef _WIN32
+			if (errno == EINTR) { continue; }
+#endif
+			num_bytes = 0;
+		}
+
+		if (num_bytes == 0) {
 			buxn_console_send_input_end_jit(vm, &devices.console);
 			break;
 		}
+
+		int i = 0;
+		while (
+			i < num_bytes
+			&& buxn_system_exit_code(vm) < 0
+			&& buxn_console_should_send_input(vm)
+		) {
+			input_chunk_t chunk = {
+				.bytes = &input_buf[i],
+				.vector_addr = buxn_vm_dev_load2(vm, 0x10),
+			};
+			if (console_vector.addr != chunk.vector_addr) {
+				console_vector = (buxn_jit_vector_t){ .addr = chunk.vector_addr };
+			}
+
+			i += (int)buxn_jit_execute_batch(
+				jit,
+				&console_vector,
+				&chunk,
+				(size_t)(num_bytes - i),
+				buxn_console_setup_input_jit
+			);
+		}
 	}
 
 	exit_code = buxn_system_exit_code(vm);
 	if (exit_code < 0) { exit_code = 0; }
 end:
-	fprintf(stderr, "Num blocks: %d\n", stats->num_blocks);
-	fprintf(stderr, "Num bounces: %d\n", stats->num_bounces);
+	output_cleanup(stdout_buf);
+	output_cleanup(stderr_buf);
+	fprintf(stderr, "Num blocks: %d (%d variants)\n", stats->num_blocks, stats->num_variants);
+	fprintf(stderr, "Num loops: %d\n", stats->num_loops);
+	fprintf(stderr, "Num evictions: %d\n", stats->num_evictions);
+	fprintf(stderr, "Num invalidations: %d\n", stats->num_invalidations);
+	fprintf(stderr, "Num spills: %d (%d to slots)\n", stats->num_spills, stats->num_slot_spills);
+	fprintf(stderr, "Num forwarded loads: %d (%d dead stores)\n", stats->num_forwarded_loads, stats->num_dead_stores);
+	for (int i = 0; i < BUXN_JIT_NUM_IDIOMS; ++i) {
+		if (stats->idiom_hits[i] > 0) {
+			fprintf(stderr, "Idiom %s: %d\n", buxn_jit_idiom_name(i), stats->idiom_hits[i]);
+		}
+	}
+	for (int i = 0; i < BUXN_JIT_NUM_REWRITES; ++i) {
+		if (stats->rewrite_hits[i] > 0) {
+			fprintf(stderr, "Rewrite %s: %d\n", buxn_jit_rewrite_name(i), stats->rewrite_hits[i]);
+		}
+	}
+	fprintf(stderr, "Compile time: %.3fms\n", (double)stats->compile_time_ns / 1e6);
 	fprintf(stderr, "Code size: %zu\n", stats->code_size);
+	fprintf(
+		stderr, "Code arena: %zu/%zu used, %zu free\n",
+		stats->code_arena_used,
+		stats->code_arena_capacity,
+		stats->code_arena_free
+	);
+
+	if (image_path != NULL) {
+		// Concurrent runs must never see a partially written image.
+		// Each run writes its own file and moves it into place.
+		char* tmp_path = image_tmp_path(&arena, image_path);
+		if (tmp_path != NULL) {
+			if (
+				!buxn_jit_save_image(jit, tmp_path, rom, rom_size)
+				|| !replace_file(tmp_path, image_path)
+			) {
+				remove(tmp_path);
+			}
+		}
+	}
 
 	barray_free(NULL, str_buf);
 	barray_free(NULL, label_map_entries);
@@ -310,9 +803,16 @@ buxn_vm_deo(buxn_vm_t* vm, uint8_t address) {
 	vm_data_t* devices = vm->config.userdata;
 	uint8_t device_id = buxn_device_id(address);
 	switch (device_id) {
-		case BUXN_DEVICE_SYSTEM:
+		case BUXN_DEVICE_SYSTEM: {
+			// The expansion port can copy code into memory
+			uint16_t lo = 0;
+			uint16_t hi = 0;
+			bool writes_memory = address == 0x03 && expansion_target(vm, &lo, &hi);
 			buxn_system_deo(vm, address);
-			break;
+			if (writes_memory) {
+				buxn_jit_invalidate_range(devices->jit, lo, hi);
+			}
+		} break;
 		case BUXN_DEVICE_CONSOLE:
 			buxn_console_deo(vm, &devices->console, address);
 			break;
@@ -323,17 +823,25 @@ void
 buxn_system_debug(buxn_vm_t* vm, uint8_t value) {
 	if (value == 0) { return; }
 
-	fprintf(stderr, "WST");
+	// Goes through the buffer so that it stays in order with console output
+	char line[4 + 3 * 256 + 1];
+	vm_data_t* devices = vm->config.userdata;
+	int len = snprintf(line, sizeof(line), "WST");
 	for (uint8_t i = 0; i < vm->wsp; ++i) {
-		fprintf(stderr, " %02hhX", vm->ws[i]);
+		len += snprintf(line + len, sizeof(line) - len, " %02hhX", vm->ws[i]);
 	}
-	fprintf(stderr, "\n");
+	len += snprintf(line + len, sizeof(line) - len, "\n");
+	output_write(devices->stderr_buf, (const uint8_t*)line, (size_t)len);
 
-	fprintf(stderr, "RST");
+	len = snprintf(line, sizeof(line), "RST");
 	for (uint8_t i = 0; i < vm->rsp; ++i) {
-		fprintf(stderr, " %02hhX", vm->rs[i]);
+		len += snprintf(line + len, sizeof(line) - len, " %02hhX", vm->rs[i]);
 	}
-	fprintf(stderr, "\n");
+	len += snprintf(line + len, sizeof(line) - len, "\n");
+	output_write(devices->stderr_buf, (const uint8_t*)line, (size_t)len);
+
+	// The debugger expects the state to be printed right away
+	output_flush(devices->stderr_buf, true);
 }
 
 void
@@ -349,18 +857,16 @@ buxn_system_theme_changed(buxn_vm_t* vm) {
 
 void
 buxn_console_handle_write(struct buxn_vm_s* vm, buxn_console_t* device, char c) {
-	(void)vm;
 	(void)device;
-	fputc(c, stdout);
-	fflush(stdout);
+	vm_data_t* devices = vm->config.userdata;
+	output_putc(devices->stdout_buf, c);
 }
 
 void
 buxn_console_handle_error(struct buxn_vm_s* vm, buxn_console_t* device, char c) {
-	(void)vm;
 	(void)device;
-	fputc(c, stderr);
-	fflush(stdout);
+	vm_data_t* devices = vm->config.userdata;
+	output_putc(devices->stderr_buf, c);
 }
 
 void*
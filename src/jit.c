@@ -1,4 +1,5 @@
 // vim: set foldmethod=marker foldlevel=0:
+#define _GNU_SOURCE
 #include <buxn/jit.h>
 #include <buxn/vm/vm.h>
 #include <buxn/vm/opcodes.h>
@@ -6,8 +7,8 @@
 #include <stdbool.h>
 #include <string.h>
 #include <limits.h>
-#define BHAMT_HASH_TYPE uint32_t
-#include "hamt.h"
+#include <stdio.h>
+#include <time.h>
 
 #ifndef BUXN_JIT_ASSERT
 #	include <assert.h>
@@ -18,13 +19,65 @@
 #	define BUXN_JIT_VERBOSE 0
 #endif
 
-#if BUXN_JIT_VERBOSE
-#	include <stdio.h>
+#ifndef BUXN_JIT_THREADS
+#	ifdef __STDC_NO_THREADS__
+#		define BUXN_JIT_THREADS 0
+#	else
+#		define BUXN_JIT_THREADS 1
+#	endif
+#endif
+
+#if BUXN_JIT_THREADS
+#	include <threads.h>
+#	include <stdatomic.h>
+#endif
+
+// Enabled by the build when sljit is configured to use the code arena
+#ifndef BUXN_JIT_CODE_ARENA
+#	define BUXN_JIT_CODE_ARENA 0
+#endif
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
 #endif
 
 #define BUXN_JIT_CACHE_SIZE 4
+#define BUXN_JIT_MAX_CACHE_SIZE 32
+// Number of targets remembered at each indirect jump
+#define BUXN_JIT_IC_SIZE 2
+// An inline cache site is identified by its index, the shape and the key of
+// its block packed into 32 bits
+#define BUXN_JIT_MAX_IC_SITES (1 << 11)
+// Number of cached working stack values a jump can pass in registers
+#define BUXN_JIT_MAX_HANDOFF 3
+// Number of instructions decoded ahead of code generation
+#define BUXN_JIT_MAX_INSNS 256
+// Bytes copied from the start of a block for the worker.
+// It covers a full instruction list, longer blocks are cut.
+#define BUXN_JIT_CODE_COPY_SIZE 1024
+#define BUXN_JIT_MAX_IDIOM_LENGTH 5
+// Number of memory locations at constant addresses kept in registers
+#define BUXN_JIT_MAX_MEM_VALUES 2
+
+#define BUXN_JIT_CODE_ALIGNMENT 16
+#define BUXN_JIT_CODE_SMALL_CHUNK_MAX 4096
+#define BUXN_JIT_CODE_NUM_SMALL_CLASSES (BUXN_JIT_CODE_SMALL_CHUNK_MAX / BUXN_JIT_CODE_ALIGNMENT)
+#define BUXN_JIT_DEFAULT_CODE_ARENA_SIZE ((size_t)64 * 1024 * 1024)
+
+// Returned to buxn_jit_execute when the target is not compiled yet
+#define BUXN_JIT_INTERPRET 0x20000
+
+// Must be bumped whenever code generation changes so that old images are
+// rejected
+#define BUXN_JIT_IMAGE_VERSION 17
+#define BUXN_JIT_IMAGE_MAGIC "BUXNJIT"
+
+#define BUXN_JIT_FNV_OFFSET 0xcbf29ce484222325ULL
+#define BUXN_JIT_FNV_PRIME 0x100000001b3ULL
 
-#define BUXN_JIT_ADDR_EQ(LHS, RHS) (LHS == RHS)
 #define BUXN_JIT_MEM() SLJIT_MEM2(SLJIT_R(BUXN_JIT_R_MEM_BASE), SLJIT_R(BUXN_JIT_R_MEM_OFFSET))
 #define BUXN_JIT_MEM_OFFSET() SLJIT_R(BUXN_JIT_R_MEM_OFFSET)
 #define BUXN_JIT_TMP() SLJIT_R(BUXN_JIT_R_TMP)
@@ -85,20 +138,60 @@ enum {
 typedef sljit_u32 (*buxn_jit_fn_t)(sljit_up vm);
 
 typedef struct buxn_jit_block_s buxn_jit_block_t;
+typedef struct buxn_jit_link_s buxn_jit_link_t;
+typedef struct buxn_jit_reloc_s buxn_jit_reloc_t;
+
 struct buxn_jit_block_s {
 	uint16_t key;
-	buxn_jit_block_t* children[BHAMT_NUM_CHILDREN];
+	// Shape of the working stack cache that the body expects in registers.
+	// 0 is the generic block found through the block table, the others are
+	// variants which are only entered from linked jumps.
+	uint8_t shape;
 
 	buxn_jit_fn_t fn;
 	sljit_uw head_addr;
 	sljit_uw body_addr;
 	sljit_sw executable_offset;
-
+	size_t code_size;
+	// Last address read by the compiler
+	uint16_t last_pc;
+
+	// Reference bit for clock eviction
+	bool referenced;
+	bool queued;
+	// Number of times the block was interpreted before it was compiled
+	uint32_t hotness;
+
+	// Links from other blocks into this block
+	buxn_jit_link_t* incoming;
+	// Links from this block into other blocks
+	buxn_jit_link_t* outgoing;
+	// Process-specific addresses baked into the code
+	buxn_jit_reloc_t* relocs;
+	// The code lives in a loaded image instead of the sljit allocator
+	bool from_image;
+
+	// A generic block lists its variants, a variant points to its sibling
+	buxn_jit_block_t* variants;
 	buxn_jit_block_t* next;
 };
 
+#if BUXN_JIT_THREADS
+// Read without the lock by the VM thread, see buxn_jit_load_block
+typedef _Atomic(buxn_jit_block_t*) buxn_jit_block_slot_t;
+#else
+typedef buxn_jit_block_t* buxn_jit_block_slot_t;
+#endif
+
+// Generated code reads it as an array of pointers
+_Static_assert(
+	sizeof(buxn_jit_block_slot_t) == sizeof(buxn_jit_block_t*),
+	"Block table slots must be plain pointers"
+);
+
 typedef struct {
-	buxn_jit_block_t* root;
+	// Indexed by pc so that it can be read from generated code
+	buxn_jit_block_slot_t table[0x10000];
 	buxn_jit_block_t* first;
 } buxn_jit_block_map_t;
 
@@ -106,6 +199,22 @@ enum {
 	BUXN_JIT_SEM_CONST   = 1 << 0,
 	BUXN_JIT_SEM_BOOLEAN = 1 << 1,
 	BUXN_JIT_SEM_IMM_JMP = 1 << 2,
+	// A literal baked into the code, it never has to be rechecked
+	BUXN_JIT_SEM_IMM     = 1 << 3,
+};
+
+enum {
+	BUXN_JIT_CODE_OPCODE  = 1 << 0,
+	BUXN_JIT_CODE_LITERAL = 1 << 1,
+};
+
+enum {
+	// Set the bits of the bytes in the code map
+	BUXN_JIT_SCAN_MARK   = 1 << 0,
+	// Also record their values.
+	// This is only done for a block which was just compiled, a stale byte must
+	// stay stale when the code map is rebuilt.
+	BUXN_JIT_SCAN_RECORD = 1 << 1,
 };
 
 typedef struct buxn_jit_value_s buxn_jit_value_t;
@@ -126,21 +235,125 @@ typedef struct {
 typedef enum {
 	BUXN_JIT_LINK_TO_HEAD,
 	BUXN_JIT_LINK_TO_BODY,
+	// A jump which continues execution after a helper call.
+	// It has no target and is only reverted to leave the block when the block
+	// is invalidated while it is still on the native stack.
+	BUXN_JIT_LINK_RESUME,
+	// An entry in the inline cache of an indirect jump.
+	// It jumps to the body of its target when the jump address matches its
+	// key.
+	// It has no target when it is empty.
+	BUXN_JIT_LINK_IC,
 } buxn_jit_link_type_t;
 
+// A patched jump from one block into another.
+// It is kept for as long as the source block lives so that the jump can be
+// reverted to its fallback when the target is evicted and patched again when
+// the target is recompiled.
+struct buxn_jit_link_s {
+	buxn_jit_link_t* next_in;
+	buxn_jit_link_t* next_out;
+
+	buxn_jit_link_type_t type;
+	buxn_jit_block_t* source;
+	buxn_jit_block_t* target;
+	sljit_uw jump_addr;
+	sljit_uw fallback_addr;
+	// Where a resume jump goes when the block is still valid
+	sljit_uw resume_addr;
+	// The address compared against by an inline cache entry
+	sljit_uw key_addr;
+	uint16_t ic_site;
+	uint8_t ic_slot;
+};
+
+typedef enum {
+	BUXN_JIT_RELOC_JIT,
+	BUXN_JIT_RELOC_CODE_MAP,
+	BUXN_JIT_RELOC_BLOCK_TABLE,
+	BUXN_JIT_RELOC_TRANSLATE_JUMP_ADDR,
+	BUXN_JIT_RELOC_IC_MISS,
+	BUXN_JIT_RELOC_DEI,
+	BUXN_JIT_RELOC_DEI2,
+	BUXN_JIT_RELOC_DEO,
+	BUXN_JIT_RELOC_DEO2,
+	BUXN_JIT_RELOC_CODE_WRITE,
+
+	BUXN_JIT_RELOC_COUNT,
+} buxn_jit_reloc_type_t;
+
+// An address constant which has to be patched when the code is loaded into
+// another process
+struct buxn_jit_reloc_s {
+	buxn_jit_reloc_t* next;
+
+	buxn_jit_reloc_type_t type;
+	union {
+		// Until the code is generated
+		struct sljit_const* value;
+		sljit_uw addr;
+	};
+};
+
+typedef union buxn_jit_code_copy_u buxn_jit_code_copy_t;
+union buxn_jit_code_copy_u {
+	// Only valid while it is in the pool
+	buxn_jit_code_copy_t* next;
+	uint8_t bytes[BUXN_JIT_CODE_COPY_SIZE];
+};
+
 typedef struct buxn_jit_entry_s buxn_jit_entry_t;
 struct buxn_jit_entry_s {
 	buxn_jit_entry_t* next;
 
 	buxn_jit_link_type_t link_type;
 	buxn_jit_block_t* block;
+	buxn_jit_block_t* source;
 	struct sljit_compiler* compiler;
+	struct sljit_label* fallback;
+	struct sljit_label* resume;
+	struct sljit_const* key;
+	uint16_t ic_site;
+	uint8_t ic_slot;
+	// A compiled block which is not reachable yet
+	sljit_uw head_addr;
+	// Of the bytes the block was compiled from, see buxn_jit_scan_code
+	uint64_t checksum;
+	// What the worker compiles the block from, it never reads memory
+	buxn_jit_code_copy_t* code_copy;
 	union {
 		struct sljit_jump* jump;
 		uint16_t pc;
+		void* code;
 	};
 };
 
+#if BUXN_JIT_CODE_ARENA
+typedef struct buxn_jit_code_chunk_s buxn_jit_code_chunk_t;
+struct buxn_jit_code_chunk_s {
+	size_t size;
+	// Only valid while the chunk is free
+	buxn_jit_code_chunk_t* next;
+};
+
+// One large reservation for all code so that hot code is packed into as few
+// pages as possible.
+// Chunks are bump allocated and binned by size when they are freed.
+typedef struct {
+	buxn_jit_exec_allocator_t allocator;
+	buxn_jit_stats_t* stats;
+	uint8_t* base;
+	size_t capacity;
+	size_t top;
+	buxn_jit_code_chunk_t* small_chunks[BUXN_JIT_CODE_NUM_SMALL_CLASSES];
+	buxn_jit_code_chunk_t* large_chunks;
+} buxn_jit_code_arena_t;
+
+#	define BUXN_JIT_EXEC_ALLOCATOR(jit) (&(jit)->code_arena.allocator)
+#else
+#	define BUXN_JIT_EXEC_ALLOCATOR(jit) NULL
+#endif
+
 struct buxn_jit_s {
 	buxn_vm_t* vm;
 	buxn_jit_config_t config;
@@ -150,17 +363,119 @@ struct buxn_jit_s {
 
 	buxn_jit_entry_t* compile_queue;
 	buxn_jit_entry_t* link_queue;
-	buxn_jit_entry_t* cleanup_queue;
+	// Compiled blocks waiting to be published by the VM thread
+	buxn_jit_entry_t* ready_queue;
+	buxn_jit_entry_t* retire_queue;
 	buxn_jit_entry_t* entry_pool;
+
+	buxn_jit_link_t* link_pool;
+	buxn_jit_reloc_t* reloc_pool;
+	buxn_jit_block_t* clock_hand;
+	// Only touched by the VM thread
+	int depth;
+	// Bookkeeping of interpreted runs which is left for when the lock is free.
+	// Also only touched by the VM thread.
+	int num_pending_interpreted;
+	bool stores_unchecked;
+
+	// Code loaded from a file, it is only released at cleanup
+	void* image;
+	size_t image_size;
+
+#if BUXN_JIT_CODE_ARENA
+	buxn_jit_code_arena_t code_arena;
+#endif
+
+#if BUXN_JIT_THREADS
+	// Guards everything above.
+	// It is held by the worker while it compiles a block and by the VM thread
+	// while it looks up, publishes or discards code.
+	// Native code runs without it.
+	mtx_t lock;
+	cnd_t work_available;
+	// The worker hands the lock over to the VM thread between blocks when it
+	// is blocked in buxn_jit_lock
+	cnd_t lock_handoff;
+	atomic_int num_waiting;
+	thrd_t worker;
+	bool has_worker;
+	bool worker_shutdown;
+	buxn_jit_code_copy_t* code_copy_pool;
+#endif
+
+	// Read by generated code to call port callbacks
+	buxn_jit_port_t ports[256];
+
+	// Non-zero for every byte that was baked into compiled code
+	uint8_t code_map[0x10000];
+	// A copy of every page in code_pages.
+	// Bytes in code_map hold their value when they were compiled, the others
+	// are brought up to date when the page is checked.
+	// Stores made by the interpreter are found by comparing against it.
+	uint8_t code_bytes[0x10000];
+	// Pages of 256 bytes which ever had a byte in code_map
+	bool code_pages[256];
+	// Literal bytes which were overwritten after being baked into code.
+	// They are read from memory from then on.
+	bool volatile_literals[0x10000];
 };
 
+typedef enum {
+	BUXN_JIT_INSN_OPCODE,
+	// Pushes a value computed at compile time
+	BUXN_JIT_INSN_CONST,
+	// Removed, compilation continues at next_pc
+	BUXN_JIT_INSN_NOP,
+	// The start of an opcode sequence which is compiled as a whole
+	BUXN_JIT_INSN_IDIOM,
+	// A comparison which is compiled into the conditional jump after it
+	BUXN_JIT_INSN_BRANCH,
+} buxn_jit_insn_type_t;
+
+// An instruction of the block being compiled.
+// A rewritten instruction covers all the instructions up to next_pc.
+typedef struct {
+	buxn_jit_insn_type_t type;
+	uint16_t pc;
+	uint16_t next_pc;
+	uint8_t opcode;
+	// The literal will be compiled as a constant
+	bool exact;
+	uint16_t value;
+	uint8_t idiom;
+	// The fused jump of a branch and where its target is read from
+	uint8_t jump_opcode;
+	uint16_t target_pc;
+	// Follows a byte jump which may skip it at runtime
+	bool pinned;
+	// The target of a backward jump within the block
+	bool loop_header;
+	// Where the loop starts and the working stack cache shape it expects
+	struct sljit_label* label;
+	uint8_t shape;
+} buxn_jit_insn_t;
+
 typedef struct {
 	buxn_jit_operand_t value;
 	bool need_flush;
+	// The value was moved out of its register into a local stack slot
+	bool in_slot;
 } buxn_jit_stack_cache_cell_t;
 
+// A memory location at a constant address whose value is in a register owned
+// by it
+typedef struct {
+	uint16_t addr;
+	bool is_short;
+	// Only zero page stores are deferred
+	bool dirty;
+	buxn_jit_reg_t reg;
+} buxn_jit_mem_value_t;
+
+// A ring buffer, the bottom cell is at head
 typedef struct {
-	buxn_jit_stack_cache_cell_t cells[BUXN_JIT_CACHE_SIZE];
+	buxn_jit_stack_cache_cell_t cells[BUXN_JIT_MAX_CACHE_SIZE];
+	uint8_t head;
 	uint8_t len;
 } buxn_jit_stack_cache_t;
 
@@ -170,10 +485,16 @@ typedef struct {
 	struct sljit_compiler* compiler;
 	struct sljit_label* head_label;
 	struct sljit_label* body_label;
-	struct sljit_label* call_fallback;
+	// What the block is compiled from, memory[0] is the byte at memory_base.
+	// Nothing after memory_end is read.
+	const uint8_t* memory;
+	uint16_t memory_base;
+	uint16_t memory_end;
 	uint16_t entry_pc;
 	uint16_t pc;
+	uint16_t num_ic_sites;
 	uint8_t current_opcode;
+	uint8_t cache_size;
 	sljit_sw mem_base;
 	buxn_jit_value_t wst[256];
 	buxn_jit_value_t rst[256];
@@ -187,1391 +508,4843 @@ typedef struct {
 
 	buxn_jit_stack_cache_t wst_cache;
 	buxn_jit_stack_cache_t rst_cache;
+
+	buxn_jit_mem_value_t mem_values[BUXN_JIT_MAX_MEM_VALUES];
+	uint8_t num_mem_values;
+
+	buxn_jit_insn_t insns[BUXN_JIT_MAX_INSNS];
+	uint16_t num_insns;
+	uint16_t insn_index;
 #if BUXN_JIT_VERBOSE
 	int label_id;
 #endif
 } buxn_jit_ctx_t;
 
+// The compile-time state which a side exit must not disturb
+typedef struct {
+	buxn_jit_stack_cache_t wst_cache;
+	buxn_jit_stack_cache_t rst_cache;
+	buxn_jit_mem_value_t mem_values[BUXN_JIT_MAX_MEM_VALUES];
+	uint8_t num_mem_values;
+	uint8_t reg_ref_counts[BUXN_JIT_R_OP_MAX - BUXN_JIT_R_OP_MIN + 1];
+	sljit_sw mem_base;
+} buxn_jit_snapshot_t;
+
 struct buxn_jit_hook_ctx_s {
 	buxn_jit_ctx_t* jit_ctx;
 	struct sljit_label* current_label;
 };
 
-// https://nullprogram.com/blog/2018/07/31/
-static inline uint32_t
-buxn_jit_prospector32(uint32_t x) {
-	x ^= x >> 15;
-	x *= 0x2c1b3c6dU;
-	x ^= x >> 12;
-	x *= 0x297a2d39U;
-	x ^= x >> 15;
-	return x;
-}
-
 static buxn_jit_block_t*
 buxn_jit(buxn_jit_t* jit, uint16_t pc);
 
-buxn_jit_t*
-buxn_jit_init(buxn_vm_t* vm, const buxn_jit_config_t* config) {
-	buxn_jit_config_t default_config = { 0 };
-	if (config == NULL) {
-		config = &default_config;
+static void
+buxn_jit_enforce_code_budget(buxn_jit_t* jit);
+
+static void
+buxn_jit_discard_block(buxn_jit_t* jit, buxn_jit_block_t* block);
+
+static void
+buxn_jit_queue_compile(buxn_jit_t* jit, buxn_jit_block_t* block);
+
+static buxn_jit_block_t*
+buxn_jit_find_block(buxn_jit_t* jit, uint16_t pc);
+
+static buxn_jit_entry_t*
+buxn_jit_dequeue(buxn_jit_entry_t** queue);
+
+static uint64_t
+buxn_jit_scan_code(
+	buxn_jit_t* jit,
+	const uint8_t* memory,
+	uint16_t base,
+	const buxn_jit_block_t* block,
+	int flags
+);
+
+static void
+buxn_jit_free_retired_code(buxn_jit_t* jit);
+
+static void
+buxn_jit_publish(buxn_jit_t* jit);
+
+static void
+buxn_jit_process_queues(buxn_jit_t* jit);
+
+static sljit_sw
+buxn_jit_reloc_value(buxn_jit_t* jit, buxn_jit_reloc_type_t type);
+
+// Threading {{{
+
+#if BUXN_JIT_THREADS
+
+static void
+buxn_jit_process_entry(buxn_jit_t* jit, buxn_jit_entry_t* entry);
+
+// Entries queued by the worker itself wait until the VM thread copies
+// their bytes
+static buxn_jit_entry_t*
+buxn_jit_dequeue_captured(buxn_jit_entry_t** queue) {
+	for (buxn_jit_entry_t** itr = queue; *itr != NULL; itr = &(*itr)->next) {
+		if ((*itr)->code_copy != NULL) {
+			buxn_jit_entry_t* entry = *itr;
+			*itr = entry->next;
+			return entry;
+		}
 	}
 
-	buxn_jit_t* jit = buxn_jit_alloc(
-		config->mem_ctx,
-		sizeof(buxn_jit_t),
-		_Alignof(buxn_jit_t)
-	);
-	*jit = (buxn_jit_t){
-		.vm = vm,
-		.config = *config,
-	};
-	return jit;
+	return NULL;
 }
 
-buxn_jit_stats_t*
-buxn_jit_stats(buxn_jit_t* jit) {
-	return &jit->stats;
+static int
+buxn_jit_worker(void* userdata) {
+	buxn_jit_t* jit = userdata;
+
+	mtx_lock(&jit->lock);
+	while (!jit->worker_shutdown) {
+		buxn_jit_entry_t* entry = buxn_jit_dequeue_captured(&jit->compile_queue);
+		if (entry != NULL) {
+			// A byte written after it was copied makes the checksum mismatch
+			// when the block is published
+			buxn_jit_process_entry(jit, entry);
+
+			// Let the VM thread in between blocks
+			while (
+				atomic_load_explicit(&jit->num_waiting, memory_order_relaxed) > 0
+				&& !jit->worker_shutdown
+			) {
+				cnd_wait(&jit->lock_handoff, &jit->lock);
+			}
+		} else {
+			cnd_wait(&jit->work_available, &jit->lock);
+		}
+	}
+	mtx_unlock(&jit->lock);
+
+	return 0;
 }
 
-void
-buxn_jit_execute(buxn_jit_t* jit, uint16_t pc) {
-	buxn_jit_block_t* block = buxn_jit(jit, pc);
-	sljit_u32 next = block->fn((uintptr_t)jit->vm);
-	if (next > 0xffff) { return; }
+static void
+buxn_jit_start_worker(buxn_jit_t* jit) {
+	if (mtx_init(&jit->lock, mtx_plain | mtx_recursive) != thrd_success) {
+		return;
+	}
 
-	pc = (uint16_t)next;
-	jit->stats.num_bounces += 1;
-	BUXN_JIT_ASSERT(pc <= 0xff, "Trampoline failed");
+	if (cnd_init(&jit->work_available) != thrd_success) {
+		mtx_destroy(&jit->lock);
+		return;
+	}
 
-	// The zero page is considered volatile and we will only interpret
-	// instead of compile
-	buxn_vm_execute(jit->vm, pc);
+	if (cnd_init(&jit->lock_handoff) != thrd_success) {
+		cnd_destroy(&jit->work_available);
+		mtx_destroy(&jit->lock);
+		return;
+	}
+
+	atomic_init(&jit->num_waiting, 0);
+	if (thrd_create(&jit->worker, buxn_jit_worker, jit) != thrd_success) {
+		cnd_destroy(&jit->lock_handoff);
+		cnd_destroy(&jit->work_available);
+		mtx_destroy(&jit->lock);
+		return;
+	}
+
+	jit->has_worker = true;
 }
 
-void
-buxn_jit_cleanup(buxn_jit_t* jit) {
-	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
-		if (itr->fn != NULL) {
-			sljit_free_code((void*)itr->fn, NULL);
-		}
+static void
+buxn_jit_stop_worker(buxn_jit_t* jit) {
+	if (!jit->has_worker) { return; }
+
+	mtx_lock(&jit->lock);
+	jit->worker_shutdown = true;
+	cnd_signal(&jit->work_available);
+	mtx_unlock(&jit->lock);
+
+	thrd_join(jit->worker, NULL);
+	cnd_destroy(&jit->lock_handoff);
+	cnd_destroy(&jit->work_available);
+	mtx_destroy(&jit->lock);
+	jit->has_worker = false;
+}
+
+#endif
+
+static inline bool
+buxn_jit_try_lock(buxn_jit_t* jit) {
+#if BUXN_JIT_THREADS
+	if (jit->has_worker) {
+		return mtx_trylock(&jit->lock) == thrd_success;
 	}
+#endif
+
+	return true;
 }
 
-uint16_t
-buxn_jit_hook_get_entry_addr(buxn_jit_hook_ctx_t* ctx) {
-	return ctx->jit_ctx->entry_pc;
+static inline void
+buxn_jit_lock(buxn_jit_t* jit) {
+#if BUXN_JIT_THREADS
+	if (jit->has_worker) {
+		atomic_fetch_add_explicit(&jit->num_waiting, 1, memory_order_relaxed);
+		mtx_lock(&jit->lock);
+		atomic_fetch_sub_explicit(&jit->num_waiting, 1, memory_order_relaxed);
+	}
+#endif
 }
 
-buxn_jit_addr_mark_t*
-buxn_jit_hook_mark_addr(buxn_jit_hook_ctx_t* ctx) {
-	if (ctx->current_label == NULL) {
-		ctx->current_label = sljit_emit_label(ctx->jit_ctx->compiler);
+static inline void
+buxn_jit_unlock(buxn_jit_t* jit) {
+#if BUXN_JIT_THREADS
+	if (jit->has_worker) {
+		// Wake the worker if it handed the lock over
+		cnd_signal(&jit->lock_handoff);
+		mtx_unlock(&jit->lock);
 	}
+#endif
+}
 
-	return (buxn_jit_addr_mark_t*)ctx->current_label;
+// The block table is read without the lock, by generated code and by the VM
+// thread when the worker is busy.
+// A block must be fully initialized before it is put into the table.
+static inline buxn_jit_block_t*
+buxn_jit_load_block(buxn_jit_t* jit, uint16_t pc) {
+#if BUXN_JIT_THREADS
+	return atomic_load_explicit(&jit->blocks.table[pc], memory_order_acquire);
+#else
+	return jit->blocks.table[pc];
+#endif
 }
 
-uintptr_t
-buxn_jit_hook_resolve_addr(buxn_jit_hook_ctx_t* ctx, buxn_jit_addr_mark_t* mark) {
-	return sljit_get_label_addr((struct sljit_label*)mark);
+static inline void
+buxn_jit_store_block(buxn_jit_t* jit, uint16_t pc, buxn_jit_block_t* block) {
+#if BUXN_JIT_THREADS
+	atomic_store_explicit(&jit->blocks.table[pc], block, memory_order_release);
+#else
+	jit->blocks.table[pc] = block;
+#endif
 }
 
+// Copy the bytes which queued blocks are compiled from.
+// Only the VM thread reads memory, the worker compiles from the copies.
 static void
-buxn_jit_finalize(buxn_jit_ctx_t* ctx);
+buxn_jit_capture(buxn_jit_t* jit) {
+#if BUXN_JIT_THREADS
+	if (!jit->has_worker) { return; }
 
-static void
-buxn_jit_next_opcode(buxn_jit_ctx_t* ctx);
+	bool captured = false;
+	for (buxn_jit_entry_t* itr = jit->compile_queue; itr != NULL; itr = itr->next) {
+		if (itr->code_copy != NULL) { continue; }
 
-// JIT queue {{{
+		buxn_jit_code_copy_t* code_copy = jit->code_copy_pool;
+		if (code_copy != NULL) {
+			jit->code_copy_pool = code_copy->next;
+		} else {
+			code_copy = buxn_jit_alloc(
+				jit->config.mem_ctx,
+				sizeof(buxn_jit_code_copy_t),
+				_Alignof(buxn_jit_code_copy_t)
+			);
+		}
 
-static buxn_jit_entry_t*
-buxn_jit_dequeue(buxn_jit_entry_t** queue) {
-	buxn_jit_entry_t* entry = *queue;
-	if (entry != NULL) {
-		*queue = entry->next;
+		size_t size = 0x10000 - (size_t)itr->pc;
+		if (size > BUXN_JIT_CODE_COPY_SIZE) { size = BUXN_JIT_CODE_COPY_SIZE; }
+		memcpy(code_copy->bytes, &jit->vm->memory[itr->pc], size);
+		itr->code_copy = code_copy;
+		captured = true;
 	}
 
-	return entry;
+	if (captured) {
+		cnd_signal(&jit->work_available);
+	}
+#else
+	(void)jit;
+#endif
 }
 
+// }}}
+
+// Code arena {{{
+
+// Also used for images
 static void
-buxn_jit_enqueue(buxn_jit_entry_t** queue, buxn_jit_entry_t* entry) {
-	entry->next = *queue;
-	*queue = entry;
+buxn_jit_release_exec(void* mem, size_t size) {
+#ifdef _WIN32
+	(void)size;
+	VirtualFree(mem, 0, MEM_RELEASE);
+#else
+	munmap(mem, size);
+#endif
 }
 
-static buxn_jit_entry_t*
-buxn_jit_alloc_entry(buxn_jit_t* jit) {
-	buxn_jit_entry_t* entry = buxn_jit_dequeue(&jit->entry_pool);
-	if (entry == NULL) {
-		entry = buxn_jit_alloc(
-			jit->config.mem_ctx,
-			sizeof(buxn_jit_entry_t),
-			_Alignof(buxn_jit_entry_t)
-		);
-	}
+#if BUXN_JIT_CODE_ARENA
 
-	return entry;
+#ifndef MAP_NORESERVE
+#	define MAP_NORESERVE 0
+#endif
+
+static uint8_t*
+buxn_jit_reserve_exec(size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void* mem = mmap(
+		NULL, size,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0
+	);
+	if (mem == MAP_FAILED) { return NULL; }
+
+#	ifdef MADV_HUGEPAGE
+	// Hot code should be covered by as few iTLB entries as possible
+	madvise(mem, size, MADV_HUGEPAGE);
+#	endif
+	return mem;
+#endif
 }
 
-static buxn_jit_block_t*
-buxn_jit_queue_block(buxn_jit_t* jit, uint16_t pc) {
-	uint32_t hash = buxn_jit_prospector32(pc);
-	buxn_jit_block_t** itr;
-	buxn_jit_block_t* block;
-	BHAMT_SEARCH(jit->blocks.root, itr, block, hash, pc, BUXN_JIT_ADDR_EQ);
-	if (block == NULL) {
-		block = *itr = buxn_jit_alloc(
-			jit->config.mem_ctx,
-			sizeof(buxn_jit_block_t),
-			_Alignof(buxn_jit_block_t)
-		);
-		*block = (buxn_jit_block_t){
-			.key = pc,
-		};
-		block->next = jit->blocks.first;
-		jit->blocks.first = block;
-		++jit->stats.num_blocks;
+static bool
+buxn_jit_commit_exec(uint8_t* mem, size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(mem, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE) != NULL;
+#else
+	// Pages are committed on first touch
+	(void)mem;
+	(void)size;
+	return true;
+#endif
+}
 
-		struct sljit_compiler* compiler = sljit_create_compiler(NULL);
+static void*
+buxn_jit_code_arena_alloc(buxn_jit_exec_allocator_t* allocator, size_t size) {
+	buxn_jit_code_arena_t* arena = (buxn_jit_code_arena_t*)allocator;
+	// The header takes a whole alignment unit
+	size_t chunk_size = (size + BUXN_JIT_CODE_ALIGNMENT * 2 - 1)
+		& ~(size_t)(BUXN_JIT_CODE_ALIGNMENT - 1);
+
+	buxn_jit_code_chunk_t* chunk = NULL;
+	if (chunk_size <= BUXN_JIT_CODE_SMALL_CHUNK_MAX) {
+		buxn_jit_code_chunk_t** bin = &arena->small_chunks[chunk_size / BUXN_JIT_CODE_ALIGNMENT - 1];
+		if ((chunk = *bin) != NULL) {
+			*bin = chunk->next;
+		}
+	} else {
+		// First fit
+		for (
+			buxn_jit_code_chunk_t** itr = &arena->large_chunks;
+			*itr != NULL;
+			itr = &(*itr)->next
+		) {
+			if ((*itr)->size >= chunk_size) {
+				chunk = *itr;
+				*itr = chunk->next;
+				break;
+			}
+		}
+	}
 
-		buxn_jit_entry_t* compile_entry = buxn_jit_alloc_entry(jit);
-		compile_entry->block = block;
-		compile_entry->compiler = compiler;
-		compile_entry->pc = pc;
-		buxn_jit_enqueue(&jit->compile_queue, compile_entry);
+	if (chunk != NULL) {
+		arena->stats->code_arena_free -= chunk->size;
+	} else if (
+		arena->capacity - arena->top >= chunk_size
+		&& buxn_jit_commit_exec(arena->base + arena->top, chunk_size)
+	) {
+		chunk = (buxn_jit_code_chunk_t*)(arena->base + arena->top);
+		chunk->size = chunk_size;
+		arena->top += chunk_size;
+		arena->stats->code_arena_used = arena->top;
+	} else {
+		// The arena is full, the code gets its own pages
+		uint8_t* mem = buxn_jit_reserve_exec(chunk_size);
+		if (mem == NULL) { return NULL; }
+		if (!buxn_jit_commit_exec(mem, chunk_size)) {
+			buxn_jit_release_exec(mem, chunk_size);
+			return NULL;
+		}
 
-		buxn_jit_entry_t* cleanup_entry = buxn_jit_alloc_entry(jit);
-		cleanup_entry->compiler = compiler;
-		buxn_jit_enqueue(&jit->cleanup_queue, cleanup_entry);
+		chunk = (buxn_jit_code_chunk_t*)mem;
+		chunk->size = chunk_size;
+		arena->stats->num_arena_overflows += 1;
 	}
 
-	return block;
+	return (uint8_t*)chunk + BUXN_JIT_CODE_ALIGNMENT;
 }
 
-// }}}/
+static void
+buxn_jit_code_arena_free(buxn_jit_exec_allocator_t* allocator, void* ptr) {
+	buxn_jit_code_arena_t* arena = (buxn_jit_code_arena_t*)allocator;
+	uint8_t* mem = (uint8_t*)ptr - BUXN_JIT_CODE_ALIGNMENT;
+	buxn_jit_code_chunk_t* chunk = (buxn_jit_code_chunk_t*)mem;
+
+	uintptr_t offset = (uintptr_t)mem - (uintptr_t)arena->base;
+	if (arena->base == NULL || offset >= arena->capacity) {
+		buxn_jit_release_exec(mem, chunk->size);
+		return;
+	}
 
-// Utils {{{
+	buxn_jit_code_chunk_t** bin = chunk->size <= BUXN_JIT_CODE_SMALL_CHUNK_MAX
+		? &arena->small_chunks[chunk->size / BUXN_JIT_CODE_ALIGNMENT - 1]
+		: &arena->large_chunks;
+	chunk->next = *bin;
+	*bin = chunk;
+	arena->stats->code_arena_free += chunk->size;
+}
 
-static bool
-buxn_jit_stack_cache_spill(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t* cache
-);
+static void
+buxn_jit_init_code_arena(buxn_jit_t* jit) {
+	buxn_jit_code_arena_t* arena = &jit->code_arena;
+	*arena = (buxn_jit_code_arena_t){
+		.allocator = {
+			.alloc = buxn_jit_code_arena_alloc,
+			.free = buxn_jit_code_arena_free,
+		},
+		.stats = &jit->stats,
+	};
 
-static inline bool
-buxn_jit_op_flag_2(buxn_jit_ctx_t* ctx) {
-	return ctx->current_opcode & BUXN_JIT_OP_2
-		&&
-		ctx->current_opcode != 0x20  // JCI
-		&&
-		ctx->current_opcode != 0x40  // JMI
-		&&
-		ctx->current_opcode != 0x60  // JSI
-		;
+	size_t capacity = jit->config.code_arena_size > 0
+		? jit->config.code_arena_size
+		: BUXN_JIT_DEFAULT_CODE_ARENA_SIZE;
+	// Without a reservation, every block overflows into its own pages
+	arena->base = buxn_jit_reserve_exec(capacity);
+	if (arena->base != NULL) {
+		arena->capacity = capacity;
+	}
+	jit->stats.code_arena_capacity = arena->capacity;
 }
 
-static inline bool
-buxn_jit_op_flag_k(buxn_jit_ctx_t* ctx) {
-	return ctx->current_opcode & BUXN_JIT_OP_K
-		&&
-		ctx->current_opcode != 0x20  // JCI
-		&&
-		ctx->current_opcode != 0x40  // JMI
-		&&
-		ctx->current_opcode != 0x60  // JSI
-		&&
-		ctx->current_opcode != 0x80  // LIT
-		&&
-		ctx->current_opcode != 0xa0  // LIT2
-		&&
-		ctx->current_opcode != 0xc0  // LITr
-		&&
-		ctx->current_opcode != 0xe0  // LIT2r
-		;
+#endif
+
+// }}}
+
+buxn_jit_t*
+buxn_jit_init(buxn_vm_t* vm, const buxn_jit_config_t* config) {
+	buxn_jit_config_t default_config = { 0 };
+	if (config == NULL) {
+		config = &default_config;
+	}
+
+	buxn_jit_t* jit = buxn_jit_alloc(
+		config->mem_ctx,
+		sizeof(buxn_jit_t),
+		_Alignof(buxn_jit_t)
+	);
+	*jit = (buxn_jit_t){
+		.vm = vm,
+		.config = *config,
+	};
+	if (jit->config.stack_cache_size == 0) {
+		jit->config.stack_cache_size = BUXN_JIT_CACHE_SIZE;
+	} else if (jit->config.stack_cache_size > BUXN_JIT_MAX_CACHE_SIZE) {
+		jit->config.stack_cache_size = BUXN_JIT_MAX_CACHE_SIZE;
+	}
+	if (config->ports != NULL) {
+		memcpy(jit->ports, config->ports, sizeof(jit->ports));
+	}
+	jit->config.ports = NULL;
+
+#if BUXN_JIT_CODE_ARENA
+	buxn_jit_init_code_arena(jit);
+#endif
+
+#if BUXN_JIT_THREADS
+	if (config->background_compile) {
+		buxn_jit_start_worker(jit);
+	}
+#endif
+
+	return jit;
 }
 
-static inline bool
-buxn_jit_op_flag_r(buxn_jit_ctx_t* ctx) {
-	return ctx->current_opcode & BUXN_JIT_OP_R
-		&&
-		ctx->current_opcode != 0x20  // JCI
-		&&
-		ctx->current_opcode != 0x40  // JMI
-		&&
-		ctx->current_opcode != 0x60  // JSI
-		;
+buxn_jit_stats_t*
+buxn_jit_stats(buxn_jit_t* jit) {
+	return &jit->stats;
 }
 
-static buxn_jit_reg_t
-buxn_jit_find_free_reg(buxn_jit_ctx_t* ctx) {
-	for (int i = 0; i < (BUXN_JIT_R_OP_MAX - BUXN_JIT_R_OP_MIN + 1); ++i) {
-		if (ctx->reg_ref_counts[i] == 0) {
-			return SLJIT_R(BUXN_JIT_R_OP_MIN + i);
+// Stores made by the interpreter do not go through a write guard.
+// Instead, every page with code is compared against its copy once the
+// interpreter returns.
+// Pages without code are never looked at and unchanged pages only cost a
+// memcmp.
+// Everything it reads is only written by the VM thread so it can run without
+// the lock, but overwritten code can only be invalidated with it.
+// Returns false if some of it was left.
+static bool
+buxn_jit_check_interpreted_stores(buxn_jit_t* jit, bool locked) {
+	bool complete = true;
+	const uint8_t* memory = jit->vm->memory;
+	for (uint32_t page = 0; page < 0x10000; page += 256) {
+		if (!jit->code_pages[page >> 8]) { continue; }
+		if (memcmp(&memory[page], &jit->code_bytes[page], 256) == 0) { continue; }
+
+		for (uint32_t pc = page; pc < page + 256; ++pc) {
+			if (memory[pc] == jit->code_bytes[pc]) { continue; }
+
+			if (jit->code_map[pc] != 0) {
+				if (!locked) {
+					complete = false;
+					continue;
+				}
+				buxn_jit_invalidate_range(jit, (uint16_t)pc, (uint16_t)pc);
+			}
+			// Data, or code which is gone now
+			if (jit->code_map[pc] == 0) {
+				jit->code_bytes[pc] = memory[pc];
+			}
 		}
 	}
 
-	return 0;
+	return complete;
 }
 
+// Catch up on the bookkeeping of interpreted runs, with the lock held
 static void
-buxn_jit_retain_reg(buxn_jit_ctx_t* ctx, buxn_jit_reg_t reg) {
-	BUXN_JIT_ASSERT(
-		BUXN_JIT_R_OP_MIN <= reg - SLJIT_R0 && reg - SLJIT_R0 <= BUXN_JIT_R_OP_MAX,
-		"Invalid register"
-	);
-	ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] += 1;
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; retain_reg(r%d) => %d\n",
-		reg - SLJIT_R0,
-		ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)]
-	);
-#endif
+buxn_jit_settle(buxn_jit_t* jit) {
+	jit->stats.num_interpreted += jit->num_pending_interpreted;
+	jit->num_pending_interpreted = 0;
+
+	if (jit->stores_unchecked) {
+		buxn_jit_check_interpreted_stores(jit, true);
+		jit->stores_unchecked = false;
+	}
 }
 
 static void
-buxn_jit_release_reg(buxn_jit_ctx_t* ctx, buxn_jit_reg_t reg) {
-	BUXN_JIT_ASSERT(
-		SLJIT_R(BUXN_JIT_R_OP_MIN) <= reg && reg <= SLJIT_R(BUXN_JIT_R_OP_MAX),
-		"Invalid register"
-	);
-	BUXN_JIT_ASSERT(
-		ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] > 0,
-		"Releasing unused register"
-	);
-	ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] -= 1;
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; release_reg(r%d) => %d\n",
-		reg - SLJIT_R0,
-		ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)]
-	);
-	if (ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] == 0) {
-		fprintf(stderr, "  ; free_reg(r%d)\n", reg - SLJIT_R0);
+buxn_jit_interpret(buxn_jit_t* jit, uint16_t pc) {
+	buxn_vm_execute(jit->vm, pc);
+
+	// The interpreter does not wait for the worker either.
+	// Until the stores are checked, compiled code is not entered.
+	jit->num_pending_interpreted += 1;
+	jit->stores_unchecked = true;
+	if (buxn_jit_try_lock(jit)) {
+		buxn_jit_settle(jit);
+		buxn_jit_unlock(jit);
+	} else if (buxn_jit_check_interpreted_stores(jit, false)) {
+		jit->stores_unchecked = false;
 	}
-#endif
 }
 
-static buxn_jit_reg_t
-buxn_jit_alloc_reg(buxn_jit_ctx_t* ctx) {
-	buxn_jit_reg_t reg;
-	while (
-		(reg  = buxn_jit_find_free_reg(ctx)) == 0
-		&&
-		ctx->wst_cache.len + ctx->rst_cache.len > 0
-	) {
-		// Try to spill from current cache first then opposing cache
-		if (buxn_jit_op_flag_r(ctx)) {
-			if (!buxn_jit_stack_cache_spill(ctx, &ctx->rst_cache)) {
-				buxn_jit_stack_cache_spill(ctx, &ctx->wst_cache);
-			}
+// Bookkeeping before an execution and the lookup of its code.
+// A block cached by the caller skips the lookup in the block table.
+static buxn_jit_block_t*
+buxn_jit_prepare(buxn_jit_t* jit, uint16_t pc, buxn_jit_block_t** cached_block) {
+	buxn_jit_block_t* block = cached_block != NULL ? *cached_block : NULL;
+	if (buxn_jit_try_lock(jit)) {
+		// Code can only be freed when no native frame is on the stack.
+		// A device handler may call back into the JIT while a block is running.
+		if (jit->depth == 0) {
+			buxn_jit_free_retired_code(jit);
+			buxn_jit_enforce_code_budget(jit);
+		}
+		buxn_jit_settle(jit);
+		buxn_jit_publish(jit);
+		// Blocks queued by the worker
+		buxn_jit_capture(jit);
+
+		if (block != NULL && block->fn != NULL) {
+			block->referenced = true;
 		} else {
-			if (!buxn_jit_stack_cache_spill(ctx, &ctx->wst_cache)) {
-				buxn_jit_stack_cache_spill(ctx, &ctx->rst_cache);
-			}
+			block = buxn_jit(jit, pc);
 		}
+		buxn_jit_unlock(jit);
+	} else if (jit->stores_unchecked) {
+		// The interpreter may have overwritten code
+		return NULL;
+	} else if (block == NULL) {
+		// The worker is busy compiling, code which is ready still runs
+		block = buxn_jit_load_block(jit, pc);
 	}
-	BUXN_JIT_ASSERT(reg != 0, "Out of registers");
-#if BUXN_JIT_VERBOSE
-	fprintf(stderr, "  ; alloc_reg() => r%d\n", reg - SLJIT_R0);
-#endif
-	buxn_jit_retain_reg(ctx, reg);
+	if (cached_block != NULL) { *cached_block = block; }
 
-	return reg;
+	return block;
 }
 
-// }}}
+static void
+buxn_jit_call(buxn_jit_t* jit, buxn_jit_block_t* block, uint16_t pc) {
+	if (block == NULL || block->fn == NULL) {
+		buxn_jit_interpret(jit, pc);
+		return;
+	}
 
-// Stack cache {{{
+	// The lock is not held so that the worker can compile meanwhile.
+	// Helpers called by the code take it when they need to.
+	jit->depth += 1;
+	sljit_u32 next = block->fn((uintptr_t)jit->vm);
+	jit->depth -= 1;
 
-static void
-buxn_jit_set_mem_base(buxn_jit_ctx_t* ctx, sljit_sw base);
+	if (next & BUXN_JIT_INTERPRET) {
+		// Continue in the interpreter until the code is ready
+		buxn_jit_interpret(jit, (uint16_t)next);
+	}
+}
 
-static void
-buxn_jit_stack_cache_push(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t*  cache,
-	buxn_jit_operand_t value
+void
+buxn_jit_execute(buxn_jit_t* jit, uint16_t pc) {
+	buxn_jit_call(jit, buxn_jit_prepare(jit, pc, NULL), pc);
+}
+
+void
+buxn_jit_execute_vector(buxn_jit_t* jit, buxn_jit_vector_t* vector) {
+	buxn_jit_block_t* block = buxn_jit_prepare(jit, vector->addr, &vector->block);
+	buxn_jit_call(jit, block, vector->addr);
+}
+
+size_t
+buxn_jit_execute_batch(
+	buxn_jit_t* jit,
+	buxn_jit_vector_t* vector,
+	void* events,
+	size_t num_events,
+	buxn_jit_event_fn_t setup
 ) {
-	if (cache->len >= BUXN_JIT_CACHE_SIZE) {
-		buxn_jit_stack_cache_spill(ctx, cache);
+	// The events are handled back to back.
+	// Bookkeeping is only done again when there is no code to call, e.g: the
+	// vector is not hot yet or an event modified it, or when the interpreter
+	// left some of it.
+	buxn_jit_block_t* block = NULL;
+	size_t i = 0;
+	for (; i < num_events; ++i) {
+		if (!setup(jit->vm, events, i)) { break; }
+
+		if (block == NULL || block->fn == NULL || jit->stores_unchecked) {
+			block = buxn_jit_prepare(jit, vector->addr, &vector->block);
+		}
+		buxn_jit_call(jit, block, vector->addr);
 	}
 
-	buxn_jit_stack_cache_cell_t* cell = &cache->cells[cache->len++];
-	cell->value = value;
-	cell->need_flush = true;
-	buxn_jit_retain_reg(ctx, value.reg);
+	return i;
 }
 
-static buxn_jit_reg_t
-buxn_jit_pop_from_mem(buxn_jit_ctx_t* ctx, bool flag_2, bool flag_r) {
-	sljit_sw mem_base = flag_r ? SLJIT_OFFSETOF(buxn_vm_t, rs) : SLJIT_OFFSETOF(buxn_vm_t, ws);
-	buxn_jit_set_mem_base(ctx, mem_base);
+void
+buxn_jit_invalidate_range(buxn_jit_t* jit, uint16_t lo, uint16_t hi) {
+	BUXN_JIT_ASSERT(lo <= hi, "Invalid range");
+	buxn_jit_lock(jit);
+
+	// Baked literals which are overwritten are likely variables, stop baking
+	// them
+	for (uint32_t pc = lo; pc <= hi; ++pc) {
+		if (jit->code_map[pc] & BUXN_JIT_CODE_LITERAL) {
+			jit->volatile_literals[pc] = true;
+		}
+	}
 
-	buxn_jit_reg_t stack_ptr_reg = flag_r ? ctx->rsp_reg : ctx->wsp_reg;
-	buxn_jit_reg_t reg = buxn_jit_alloc_reg(ctx);
+	// Discard all blocks which overlap the range
+	uint16_t span_lo = lo;
+	uint16_t span_hi = hi;
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (itr->fn == NULL || itr->key > hi || itr->last_pc < lo) { continue; }
 
-	if (flag_2) {
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_SUB,
-			stack_ptr_reg, 0,
-			stack_ptr_reg, 0,
-			SLJIT_IMM, 1
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			stack_ptr_reg, 0
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			reg, 0,
-			BUXN_JIT_MEM(), 0
-		);
+		if (itr->key < span_lo) { span_lo = itr->key; }
+		if (itr->last_pc > span_hi) { span_hi = itr->last_pc; }
+		buxn_jit_discard_block(jit, itr);
+		jit->stats.num_invalidations += 1;
+	}
 
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_SUB,
-			stack_ptr_reg, 0,
-			stack_ptr_reg, 0,
-			SLJIT_IMM, 1
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			stack_ptr_reg, 0
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_TMP(), 0,
-			BUXN_JIT_MEM(), 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_SHL,
-			BUXN_JIT_TMP(), 0,
-			BUXN_JIT_TMP(), 0,
-			SLJIT_IMM, 8
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_OR,
-			reg, 0,
-			reg, 0,
-			BUXN_JIT_TMP(), 0
-		);
-	} else {
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_SUB,
-			stack_ptr_reg, 0,
-			stack_ptr_reg, 0,
-			SLJIT_IMM, 1
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			stack_ptr_reg, 0
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			reg, 0,
-			BUXN_JIT_MEM(), 0
-		);
+	// Rebuild the code map for the affected span from the remaining blocks.
+	// Bits left behind by evicted blocks are also cleared this way.
+	memset(&jit->code_map[span_lo], 0, (size_t)span_hi - (size_t)span_lo + 1);
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (itr->fn == NULL || itr->key > span_hi || itr->last_pc < span_lo) { continue; }
+
+		buxn_jit_scan_code(jit, jit->vm->memory, 0, itr, BUXN_JIT_SCAN_MARK);
 	}
 
-	return reg;
+	buxn_jit_unlock(jit);
 }
 
-static buxn_jit_reg_t
-buxn_jit_stack_cache_pop(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t*  cache,
-	bool flag_2
-) {
-	bool flag_r = cache == &ctx->rst_cache;
-	if (flag_2) {
-		if (cache->len == 0) {
-			// There is nothing in the cache, pop from memory
-			return buxn_jit_pop_from_mem(ctx, flag_2, flag_r);
-		} else {
-			buxn_jit_stack_cache_cell_t* top = &cache->cells[--cache->len];
-			if (top->value.is_short) {
-				// The top value is the right size, just return it
-				return top->value.reg;
-			} else {
-				// The top value is a byte, pop the high byte from the stack
-				buxn_jit_reg_t hi = buxn_jit_stack_cache_pop(ctx, cache, false);
-				sljit_emit_op2(
-					ctx->compiler,
-					SLJIT_SHL,
-					hi, 0,
-					hi, 0,
-					SLJIT_IMM, 8
-				);
-				sljit_emit_op2(
-					ctx->compiler,
-					SLJIT_OR,
-					hi, 0,
-					hi, 0,
-					top->value.reg, 0
-				);
-				buxn_jit_release_reg(ctx, top->value.reg);
-				return hi;
-			}
-		}
-	} else {
-		if (cache->len == 0) {
-			// There is nothing in the cache, pop from memory
-			return buxn_jit_pop_from_mem(ctx, flag_2, flag_r);
-		} else {
-			buxn_jit_stack_cache_cell_t* top = &cache->cells[cache->len - 1];
+void
+buxn_jit_precompile(buxn_jit_t* jit, const uint16_t* entry_pcs, size_t num_entries) {
+	buxn_jit_lock(jit);
 
-			if (top->value.is_short) {
-				// The top value is a short, try to split it
-				// Alloc a register to hold the low byte
-				buxn_jit_reg_t reg = buxn_jit_alloc_reg(ctx);
+	buxn_jit_queue_compile(jit, buxn_jit_find_block(jit, BUXN_RESET_VECTOR));
+	for (size_t i = 0; i < num_entries; ++i) {
+		// Code in the zero page is usually generated at runtime
+		if (entry_pcs[i] < BUXN_RESET_VECTOR) { continue; }
 
-				// Allocating a register could force a spill
-				if (cache->len == 0) {
-					// Try to pop from memory instead
-					buxn_jit_release_reg(ctx, reg);
-					return buxn_jit_pop_from_mem(ctx, flag_2, flag_r);
-				} else {
-					// Actually try to split the top value
-					sljit_emit_op1(
-						ctx->compiler,
-						SLJIT_MOV_U8,
-						reg, 0,
-						top->value.reg, 0
-					);
-					sljit_emit_op2(
-						ctx->compiler,
-						SLJIT_LSHR,
-						top->value.reg, 0,
-						top->value.reg, 0,
-						SLJIT_IMM, 8
-					);
-					top->value.is_short = false;
-					return reg;
+		buxn_jit_queue_compile(jit, buxn_jit_find_block(jit, entry_pcs[i]));
+	}
+
+	// Compiling a block queues the constant targets of its jumps.
+	// With tiering, they are only found and have to be queued here.
+	while (jit->compile_queue != NULL) {
+		buxn_jit_process_queues(jit);
+		buxn_jit_publish(jit);
+
+		for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+			for (buxn_jit_link_t* link = itr->outgoing; link != NULL; link = link->next_out) {
+				if (link->target == NULL || link->target->key < BUXN_RESET_VECTOR) {
+					continue;
 				}
-			} else {
-				// The top value is the right size, just return it
-				cache->len -= 1;
-				return top->value.reg;
+
+				buxn_jit_queue_compile(jit, link->target);
 			}
 		}
 	}
-}
 
-static void
-buxn_jit_discard_from_mem(buxn_jit_ctx_t* ctx, bool flag_2, bool flag_r) {
-	buxn_jit_reg_t stack_ptr_reg = flag_r ? ctx->rsp_reg : ctx->wsp_reg;
-	sljit_emit_op2(
-		ctx->compiler,
-		SLJIT_SUB,
-		stack_ptr_reg, 0,
-		stack_ptr_reg, 0,
-		SLJIT_IMM, flag_2 ? 2 : 1
-	);
+	buxn_jit_unlock(jit);
 }
 
-static void
-buxn_jit_stack_cache_discard(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t*  cache,
-	bool flag_2
-) {
-	bool flag_r = cache == &ctx->rst_cache;
-	if (flag_2) {
-		if (cache->len == 0) {
-			// There is nothing in the cache, discard from memory
-			buxn_jit_discard_from_mem(ctx, flag_2, flag_r);
-		} else {
-			// Discard the top value
-			buxn_jit_stack_cache_cell_t* top = &cache->cells[--cache->len];
-			buxn_jit_release_reg(ctx, top->value.reg);
-			if (!top->value.is_short) {
-				// The top value is a byte, discard the next byte
-				buxn_jit_stack_cache_discard(ctx, cache, false);
-			}
-		}
-	} else {
-		if (cache->len == 0) {
-			// There is nothing in the cache, discard from memory
-			buxn_jit_discard_from_mem(ctx, flag_2, flag_r);
-		} else {
-			buxn_jit_stack_cache_cell_t* top = &cache->cells[cache->len - 1];
+void
+buxn_jit_cleanup(buxn_jit_t* jit) {
+#if BUXN_JIT_THREADS
+	buxn_jit_stop_worker(jit);
+#endif
 
-			if (top->value.is_short) {
-				// The top value is a short, reduce it
-				sljit_emit_op2(
-					ctx->compiler,
-					SLJIT_LSHR,
-					top->value.reg, 0,
-					top->value.reg, 0,
-					SLJIT_IMM, 8
-				);
-				top->value.is_short = false;
-			} else {
-				// The top value is the right size, just discard it
-				cache->len -= 1;
-				buxn_jit_release_reg(ctx, top->value.reg);
-			}
-		}
+	// Blocks which were never picked up by the worker
+	for (buxn_jit_entry_t* itr = jit->compile_queue; itr != NULL; itr = itr->next) {
+		sljit_free_compiler(itr->compiler);
 	}
-}
 
-static void
-buxn_jit_do_push(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_operand_t operand,
-	bool flag_r
-) {
-	buxn_jit_set_mem_base(
-		ctx,
-		flag_r ? SLJIT_OFFSETOF(buxn_vm_t, rs) : SLJIT_OFFSETOF(buxn_vm_t, ws)
-	);
-	buxn_jit_reg_t stack_ptr_reg = flag_r
-		? SLJIT_S(BUXN_JIT_S_RSP)
-		: SLJIT_S(BUXN_JIT_S_WSP);
+	// Blocks which were never published
+	for (buxn_jit_entry_t* itr = jit->ready_queue; itr != NULL; itr = itr->next) {
+		sljit_free_code(itr->code, BUXN_JIT_EXEC_ALLOCATOR(jit));
+	}
 
-	if (operand.is_short) {
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			stack_ptr_reg, 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_LSHR,
-			BUXN_JIT_TMP(), 0,
-			operand.reg, 0,
-			SLJIT_IMM, 8
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
-			BUXN_JIT_TMP(), 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_ADD,
-			stack_ptr_reg, 0,
-			stack_ptr_reg, 0,
-			SLJIT_IMM, 1
-		);
+	buxn_jit_free_retired_code(jit);
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (itr->fn != NULL && !itr->from_image) {
+			sljit_free_code((void*)itr->fn, BUXN_JIT_EXEC_ALLOCATOR(jit));
+		}
+	}
 
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			stack_ptr_reg, 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_AND,
-			BUXN_JIT_TMP(), 0,
-			operand.reg, 0,
-			SLJIT_IMM, 0xff
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
-			BUXN_JIT_TMP(), 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_ADD,
-			stack_ptr_reg, 0,
-			stack_ptr_reg, 0,
-			SLJIT_IMM, 1
-		);
-	} else {
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			stack_ptr_reg, 0
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
-			operand.reg, 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_ADD,
-			stack_ptr_reg, 0,
-			stack_ptr_reg, 0,
-			SLJIT_IMM, 1
-		);
+	if (jit->image != NULL) {
+		buxn_jit_release_exec(jit->image, jit->image_size);
 	}
-}
 
-static void
-buxn_jit_flush_cell(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_cell_t* cell,
-	bool flag_r
-) {
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; flush(reg=r%d, flag_2=%d, flag_r=%d) {{{\n",
-		cell->value.reg - SLJIT_R0,
-		cell->value.is_short,
-		flag_r
-	);
-#endif
-	buxn_jit_do_push(ctx, cell->value, flag_r);
-#if BUXN_JIT_VERBOSE
-	fprintf(stderr, "  ; }}}\n");
+#if BUXN_JIT_CODE_ARENA
+	if (jit->code_arena.base != NULL) {
+		buxn_jit_release_exec(jit->code_arena.base, jit->code_arena.capacity);
+	}
 #endif
-	cell->need_flush = false;
 }
 
-static bool
-buxn_jit_stack_cache_spill(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t* cache
-) {
-	if (cache->len == 0) { return false; }
-
-	bool flag_r = cache == &ctx->rst_cache;
+uint16_t
+buxn_jit_hook_get_entry_addr(buxn_jit_hook_ctx_t* ctx) {
+	return ctx->jit_ctx->entry_pc;
+}
 
-	buxn_jit_stack_cache_cell_t* cell = &cache->cells[0];
-	if (cell->need_flush) {
-		buxn_jit_flush_cell(ctx, cell, flag_r);
+buxn_jit_addr_mark_t*
+buxn_jit_hook_mark_addr(buxn_jit_hook_ctx_t* ctx) {
+	if (ctx->current_label == NULL) {
+		ctx->current_label = sljit_emit_label(ctx->jit_ctx->compiler);
 	}
-	buxn_jit_release_reg(ctx, cell->value.reg);
-
-	cache->len -= 1;
-	memmove(
-		&cache->cells[0],
-		&cache->cells[1],
-		cache->len * sizeof(cache->cells[0])
-	);
 
-	return true;
+	return (buxn_jit_addr_mark_t*)ctx->current_label;
 }
 
-static void
-buxn_jit_stack_cache_flush(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t* cache
-) {
-	bool flag_r = cache == &ctx->rst_cache;
-	for (uint8_t i = 0; i < cache->len; ++i) {
-		buxn_jit_stack_cache_cell_t* cell = &cache->cells[i];
-		if (cell->need_flush) {
-			buxn_jit_flush_cell(ctx, cell, flag_r);
-		}
-	}
+uintptr_t
+buxn_jit_hook_resolve_addr(buxn_jit_hook_ctx_t* ctx, buxn_jit_addr_mark_t* mark) {
+	return sljit_get_label_addr((struct sljit_label*)mark);
 }
 
 static void
-buxn_jit_stack_cache_clear(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_stack_cache_t* cache
-) {
-	while (buxn_jit_stack_cache_spill(ctx, cache)) { }
-}
+buxn_jit_finalize(buxn_jit_ctx_t* ctx);
 
 static void
-buxn_jit_clear_stack_caches(buxn_jit_ctx_t* ctx) {
-	buxn_jit_stack_cache_clear(ctx, &ctx->wst_cache);
-	buxn_jit_stack_cache_clear(ctx, &ctx->rst_cache);
-}
+buxn_jit_next_opcode(buxn_jit_ctx_t* ctx);
 
-static void
-buxn_jit_stack_cache_retain(buxn_jit_ctx_t* ctx, buxn_jit_stack_cache_t* cache) {
-	// Remove flushed cells
-	uint8_t num_flushed = 0;
-	for (uint8_t i = 0; i < cache->len; ++i) {
-		buxn_jit_stack_cache_cell_t* cell = &cache->cells[i];
-		num_flushed += !cell->need_flush;
-	}
-	cache->len -= num_flushed;
-	memmove(
-		&cache->cells[0],
-		&cache->cells[num_flushed],
-		cache->len * sizeof(cache->cells[0])
-	);
+// JIT queue {{{
 
-	for (uint8_t i = 0; i < cache->len; ++i) {
-		buxn_jit_stack_cache_cell_t* cell = &cache->cells[i];
-		buxn_jit_retain_reg(ctx, cell->value.reg);
+static buxn_jit_entry_t*
+buxn_jit_dequeue(buxn_jit_entry_t** queue) {
+	buxn_jit_entry_t* entry = *queue;
+	if (entry != NULL) {
+		*queue = entry->next;
 	}
-}
 
-// }}}
+	return entry;
+}
 
-// Micro ops {{{
+static void
+buxn_jit_enqueue(buxn_jit_entry_t** queue, buxn_jit_entry_t* entry) {
+	entry->next = *queue;
+	*queue = entry;
+}
 
-static inline void
-buxn_jit_set_mem_base(buxn_jit_ctx_t* ctx, sljit_sw base) {
-	if (ctx->mem_base != base) {
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_ADD,
-			SLJIT_R(BUXN_JIT_R_MEM_BASE), 0,
-			SLJIT_S(BUXN_JIT_S_VM), 0,
-			SLJIT_IMM, base
+static buxn_jit_entry_t*
+buxn_jit_alloc_entry(buxn_jit_t* jit) {
+	buxn_jit_entry_t* entry = buxn_jit_dequeue(&jit->entry_pool);
+	if (entry == NULL) {
+		entry = buxn_jit_alloc(
+			jit->config.mem_ctx,
+			sizeof(buxn_jit_entry_t),
+			_Alignof(buxn_jit_entry_t)
 		);
-		ctx->mem_base = base;
 	}
+
+	return entry;
+}
+
+static buxn_jit_block_t*
+buxn_jit_find_block(buxn_jit_t* jit, uint16_t pc) {
+	buxn_jit_block_t* block = buxn_jit_load_block(jit, pc);
+	if (block == NULL) {
+		block = buxn_jit_alloc(
+			jit->config.mem_ctx,
+			sizeof(buxn_jit_block_t),
+			_Alignof(buxn_jit_block_t)
+		);
+		*block = (buxn_jit_block_t){
+			.key = pc,
+		};
+		block->next = jit->blocks.first;
+		jit->blocks.first = block;
+		++jit->stats.num_blocks;
+
+		buxn_jit_store_block(jit, pc, block);
+	}
+
+	return block;
 }
 
 static void
-buxn_jit_push_ex(buxn_jit_ctx_t* ctx, buxn_jit_operand_t operand, bool flag_r) {
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; push(reg=r%d, flag_2=%d, flag_r=%d)\n",
-		operand.reg - SLJIT_R0,
-		operand.is_short,
-		flag_r
-	);
-#endif
+buxn_jit_queue_compile(buxn_jit_t* jit, buxn_jit_block_t* block) {
+	// An evicted block keeps its entry in the map and is compiled again
+	if (block->fn != NULL || block->queued) { return; }
 
-	BUXN_JIT_ASSERT(
-		ctx->reg_ref_counts[operand.reg - SLJIT_R(BUXN_JIT_R_OP_MIN)],
-		"Pushing operand with unused register"
-	);
+	block->queued = true;
 
-	// Defer the entire push operation until it's actually needed
-	buxn_jit_stack_cache_t* cache = flag_r ? &ctx->rst_cache : &ctx->wst_cache;
-	buxn_jit_stack_cache_push(ctx, cache, operand);
+	struct sljit_compiler* compiler = sljit_create_compiler(NULL);
 
-	buxn_jit_value_t* stack = flag_r ? ctx->rst : ctx->wst;
-	uint8_t* stack_ptr = flag_r ? &ctx->rsp : &ctx->wsp;
+	buxn_jit_entry_t* compile_entry = buxn_jit_alloc_entry(jit);
+	compile_entry->block = block;
+	compile_entry->compiler = compiler;
+	compile_entry->pc = block->key;
+	compile_entry->code_copy = NULL;
+	buxn_jit_enqueue(&jit->compile_queue, compile_entry);
+}
 
-	if (operand.is_short) {
-		buxn_jit_value_t* hi = &stack[(*stack_ptr)++];
-		buxn_jit_value_t* lo = &stack[(*stack_ptr)++];
-		hi->semantics = lo->semantics = operand.semantics;
-		hi->const_value = operand.const_value >> 8;
-		lo->const_value = operand.const_value & 0xff;
+static buxn_jit_block_t*
+buxn_jit_queue_block(buxn_jit_t* jit, uint16_t pc) {
+	buxn_jit_block_t* block = buxn_jit_find_block(jit, pc);
+	buxn_jit_queue_compile(jit, block);
+	return block;
+}
+
+static buxn_jit_block_t*
+buxn_jit_find_variant(buxn_jit_t* jit, uint16_t pc, uint8_t shape) {
+	buxn_jit_block_t* generic = buxn_jit_find_block(jit, pc);
+	if (shape == 0) { return generic; }
+
+	buxn_jit_block_t** itr = &generic->variants;
+	for (; *itr != NULL; itr = &(*itr)->variants) {
+		if ((*itr)->shape == shape) { return *itr; }
+	}
+
+	buxn_jit_block_t* variant = *itr = buxn_jit_alloc(
+		jit->config.mem_ctx,
+		sizeof(buxn_jit_block_t),
+		_Alignof(buxn_jit_block_t)
+	);
+	*variant = (buxn_jit_block_t){
+		.key = pc,
+		.shape = shape,
+	};
+	variant->next = jit->blocks.first;
+	jit->blocks.first = variant;
+	++jit->stats.num_variants;
+
+	return variant;
+}
+
+static buxn_jit_block_t*
+buxn_jit_link_target(buxn_jit_t* jit, uint16_t pc) {
+	// With tiering, a target has to become hot on its own before it is
+	// compiled.
+	// The link is patched when that happens.
+	if (jit->config.hot_threshold > 0) {
+		return buxn_jit_find_block(jit, pc);
 	} else {
-		buxn_jit_value_t* value = &stack[(*stack_ptr)++];
-		value->semantics = operand.semantics;
-		value->const_value = (uint8_t)operand.const_value;
+		return buxn_jit_queue_block(jit, pc);
 	}
 }
 
-static buxn_jit_operand_t
-buxn_jit_pop_ex(buxn_jit_ctx_t* ctx, bool flag_2, bool flag_r) {
-#if BUXN_JIT_VERBOSE
-	fprintf(stderr, "  ; pop(flag_2=%d, flag_r=%d) {{{\n", flag_2, flag_r);
-#endif
+// Variants are only reachable through links so they are compiled right away
+static buxn_jit_block_t*
+buxn_jit_link_variant(buxn_jit_t* jit, uint16_t pc, uint8_t shape) {
+	if (shape == 0) { return buxn_jit_link_target(jit, pc); }
 
-	buxn_jit_value_t* stack = flag_r ? ctx->rst : ctx->wst;
-	uint8_t* stack_ptr = flag_r ? ctx->ersp : ctx->ewsp;
+	buxn_jit_block_t* variant = buxn_jit_find_variant(jit, pc, shape);
+	buxn_jit_queue_compile(jit, variant);
+	return variant;
+}
 
-	buxn_jit_operand_t operand = {
-		.is_short = flag_2,
-	};
+// }}}
 
-	if (flag_2) {
-		buxn_jit_value_t lo = stack[--(*stack_ptr)];
-		buxn_jit_value_t hi = stack[--(*stack_ptr)];
-		if (
-			(hi.semantics & BUXN_JIT_SEM_CONST)
-			&&
-			(lo.semantics & BUXN_JIT_SEM_CONST)
-		) {
-			operand.semantics = BUXN_JIT_SEM_CONST;
-			operand.const_value = (uint16_t)hi.const_value << 8 | (uint16_t)lo.const_value;
-		}
+// Code cache {{{
+
+static buxn_jit_link_t*
+buxn_jit_alloc_link(buxn_jit_t* jit) {
+	buxn_jit_link_t* link = jit->link_pool;
+	if (link != NULL) {
+		jit->link_pool = link->next_out;
 	} else {
-		buxn_jit_value_t value = stack[--(*stack_ptr)];
-		operand.const_value = value.const_value;
-		operand.semantics = value.semantics;
+		link = buxn_jit_alloc(
+			jit->config.mem_ctx,
+			sizeof(buxn_jit_link_t),
+			_Alignof(buxn_jit_link_t)
+		);
 	}
 
-	buxn_jit_stack_cache_t* cache = flag_r ? &ctx->rst_cache : &ctx->wst_cache;
-	operand.reg = buxn_jit_stack_cache_pop(ctx, cache, flag_2);
+	return link;
+}
 
-#if BUXN_JIT_VERBOSE
-	fprintf(stderr, "  ; }}} => r%d\n", operand.reg - SLJIT_R0);
-#endif
+static buxn_jit_reloc_t*
+buxn_jit_alloc_reloc(buxn_jit_t* jit) {
+	buxn_jit_reloc_t* reloc = jit->reloc_pool;
+	if (reloc != NULL) {
+		jit->reloc_pool = reloc->next;
+	} else {
+		reloc = buxn_jit_alloc(
+			jit->config.mem_ctx,
+			sizeof(buxn_jit_reloc_t),
+			_Alignof(buxn_jit_reloc_t)
+		);
+	}
 
-	return operand;
+	return reloc;
 }
 
 static void
-buxn_jit_push(buxn_jit_ctx_t* ctx, buxn_jit_operand_t operand) {
-	buxn_jit_push_ex(ctx, operand, buxn_jit_op_flag_r(ctx));
+buxn_jit_patch_link(buxn_jit_link_t* link) {
+	sljit_uw target = link->type == BUXN_JIT_LINK_TO_HEAD
+		? link->target->head_addr
+		: link->target->body_addr;
+	sljit_set_jump_addr(link->jump_addr, target, link->source->executable_offset);
+	link->target->referenced = true;
 }
 
-static buxn_jit_operand_t
-buxn_jit_pop(buxn_jit_ctx_t* ctx) {
-	return buxn_jit_pop_ex(ctx, buxn_jit_op_flag_2(ctx), buxn_jit_op_flag_r(ctx));
+static void
+buxn_jit_unpatch_link(buxn_jit_link_t* link) {
+	sljit_set_jump_addr(
+		link->jump_addr,
+		link->fallback_addr,
+		link->source->executable_offset
+	);
 }
 
-static buxn_jit_operand_t
-buxn_jit_load(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_reg_t reg,
-	buxn_jit_operand_t addr
-) {
-	buxn_jit_operand_t result = {
-		.is_short = buxn_jit_op_flag_2(ctx),
-		.reg = reg,
-	};
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; r%d = load(addr=r%d(0x%04x), flag_2=%d)\n",
-		result.reg - SLJIT_R0,
-		addr.reg - SLJIT_R0,
-		addr.const_value,
-		result.is_short
-	);
-#endif
+// Replace the target of an inline cache entry
+static void
+buxn_jit_fill_ic(buxn_jit_link_t* link, buxn_jit_block_t* target, uint16_t pc) {
+	if (link->target != NULL) {
+		buxn_jit_link_t** itr = &link->target->incoming;
+		while (*itr != link) { itr = &(*itr)->next_in; }
+		*itr = link->next_in;
+	}
 
-	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U16,
-		BUXN_JIT_MEM_OFFSET(), 0,
-		addr.reg, 0
-	);
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U8,
-		result.reg, 0,
-		BUXN_JIT_MEM(), 0
-	);
+	link->target = target;
+	link->next_in = target->incoming;
+	target->incoming = link;
 
-	if (result.is_short) {
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_SHL,
-			result.reg, 0,
-			result.reg, 0,
-			SLJIT_IMM, 8
-		);
+	sljit_set_const(link->key_addr, SLJIT_MOV, pc, link->source->executable_offset);
+	buxn_jit_patch_link(link);
+}
 
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_ADD,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			SLJIT_IMM, 1
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_AND,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			SLJIT_IMM, addr.is_short ? 0xffff : 0x00ff
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_TMP(), 0,
-			BUXN_JIT_MEM(), 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_OR,
-			result.reg, 0,
-			result.reg, 0,
-			BUXN_JIT_TMP(), 0
-		);
+static void
+buxn_jit_unlink_block(buxn_jit_t* jit, buxn_jit_block_t* block) {
+	// Callers go back through the trampoline.
+	// The links are kept so that they can be patched again upon recompilation.
+	for (buxn_jit_link_t* itr = block->incoming; itr != NULL; itr = itr->next_in) {
+		buxn_jit_unpatch_link(itr);
 	}
 
-	return result;
+	// The outgoing links die with the code
+	buxn_jit_link_t* link;
+	while ((link = block->outgoing) != NULL) {
+		block->outgoing = link->next_out;
+
+		if (link->type == BUXN_JIT_LINK_RESUME) {
+			// The code may still be running, make it leave as soon as possible
+			buxn_jit_unpatch_link(link);
+		} else if (link->target != NULL) {
+			buxn_jit_link_t** itr = &link->target->incoming;
+			while (*itr != link) { itr = &(*itr)->next_in; }
+			*itr = link->next_in;
+		}
+
+		link->next_out = jit->link_pool;
+		jit->link_pool = link;
+	}
 }
 
 static void
-buxn_jit_store(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_operand_t addr,
-	buxn_jit_operand_t value
-) {
+buxn_jit_free_retired_code(buxn_jit_t* jit) {
+	buxn_jit_entry_t* entry;
+	while ((entry = buxn_jit_dequeue(&jit->retire_queue)) != NULL) {
+		sljit_free_code(entry->code, BUXN_JIT_EXEC_ALLOCATOR(jit));
+		buxn_jit_enqueue(&jit->entry_pool, entry);
+	}
+}
+
+static void
+buxn_jit_discard_block(buxn_jit_t* jit, buxn_jit_block_t* block) {
 #if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; store(addr=r%d(0x%04x), value=r%d, flag_2=%d)\n",
-		addr.reg - SLJIT_R0,
-		addr.const_value,
-		value.reg - SLJIT_R0,
-		value.is_short
-	);
+	fprintf(stderr, "; discard(0x%04x)\n", block->key);
 #endif
+	buxn_jit_unlink_block(jit, block);
+	if (block->from_image) {
+		// Image code is released with the image
+	} else if (jit->depth == 0) {
+		sljit_free_code((void*)block->fn, BUXN_JIT_EXEC_ALLOCATOR(jit));
+	} else {
+		// The code might be on the native stack, free it later
+		buxn_jit_entry_t* entry = buxn_jit_alloc_entry(jit);
+		entry->code = (void*)block->fn;
+		buxn_jit_enqueue(&jit->retire_queue, entry);
+	}
 
-	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+	buxn_jit_reloc_t* reloc;
+	while ((reloc = block->relocs) != NULL) {
+		block->relocs = reloc->next;
+		reloc->next = jit->reloc_pool;
+		jit->reloc_pool = reloc;
+	}
 
-	if (value.is_short) {
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U16,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			addr.reg, 0
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_LSHR,
-			BUXN_JIT_TMP(), 0,
-			value.reg, 0,
-			SLJIT_IMM, 8
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
-			BUXN_JIT_TMP(), 0
-		);
+	jit->stats.code_size -= block->code_size;
 
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_ADD,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			SLJIT_IMM, 1
-		);
-		sljit_emit_op2(
-			ctx->compiler,
-			SLJIT_AND,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			SLJIT_IMM, addr.is_short ? 0xffff : 0x00ff
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
-			value.reg, 0
-		);
-	} else {
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U16,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			addr.reg, 0
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
-			value.reg, 0
-		);
-	}
-}
-
-static void
-buxn_jit_load_state(buxn_jit_ctx_t* ctx) {
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U8,
-		SLJIT_S(BUXN_JIT_S_WSP), 0,
-		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, wsp)
-	);
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U8,
-		SLJIT_S(BUXN_JIT_S_RSP), 0,
-		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, rsp)
-	);
+	block->fn = NULL;
+	block->from_image = false;
+	block->head_addr = 0;
+	block->body_addr = 0;
+	block->executable_offset = 0;
+	block->code_size = 0;
+	block->referenced = false;
 }
 
 static void
-buxn_jit_save_state(buxn_jit_ctx_t* ctx) {
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U8,
-		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, wsp),
-		SLJIT_S(BUXN_JIT_S_WSP), 0
-	);
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U8,
-		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, rsp),
-		SLJIT_S(BUXN_JIT_S_RSP), 0
-	);
+buxn_jit_evict_block(buxn_jit_t* jit, buxn_jit_block_t* block) {
+	buxn_jit_discard_block(jit, block);
+	jit->stats.num_evictions += 1;
 }
 
-static void
-buxn_jit_jump_abs(buxn_jit_ctx_t* ctx, buxn_jit_operand_t target, uint16_t return_addr) {
-	struct sljit_jump* exit = NULL;
-#if BUXN_JIT_VERBOSE
-	int exit_id = 0;
-#endif
-
-	if (target.semantics & BUXN_JIT_SEM_CONST) {
-		if (return_addr == 0) {
-			struct sljit_jump* jump;
+static inline uint64_t
+buxn_jit_scan_byte(
+	buxn_jit_t* jit,
+	const uint8_t* memory,
+	uint16_t base,
+	uint64_t hash,
+	uint16_t pc,
+	uint8_t kind,
+	int flags
+) {
+	uint8_t value = memory[(uint16_t)(pc - base)];
+	if (flags & BUXN_JIT_SCAN_MARK) {
+		jit->code_map[pc] |= kind;
+		jit->code_pages[pc >> 8] = true;
+	}
+	if (flags & BUXN_JIT_SCAN_RECORD) {
+		jit->code_bytes[pc] = value;
+	}
 
-			if (target.semantics & BUXN_JIT_SEM_IMM_JMP) {
-				jump = sljit_emit_jump(
-					ctx->compiler,
-					SLJIT_JUMP | SLJIT_REWRITABLE_JUMP
-				);
-			} else {
-				// Recheck assumed constant value before jumping
-				jump = sljit_emit_cmp(
-					ctx->compiler,
-					SLJIT_EQUAL | SLJIT_REWRITABLE_JUMP,
-					target.reg, 0,
-					SLJIT_IMM, target.const_value
-				);
-			}
-#if BUXN_JIT_VERBOSE
-			fprintf(stderr, "  ; jump => here\n");
-#endif
-			sljit_set_label(jump, sljit_emit_label(ctx->compiler));
+	hash ^= value;
+	hash *= BUXN_JIT_FNV_PRIME;
+	return hash;
+}
 
-			buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
-			entry->link_type = BUXN_JIT_LINK_TO_BODY;
-			entry->block = buxn_jit_queue_block(ctx->jit, target.const_value);
-			entry->compiler = ctx->compiler;
-			entry->jump = jump;
-			buxn_jit_enqueue(&ctx->jit->link_queue, entry);
-		} else {
-			struct sljit_jump* skip_call = NULL;
-#if BUXN_JIT_VERBOSE
-			int skip_id = 0;
-#endif
-			if ((target.semantics & BUXN_JIT_SEM_IMM_JMP) == 0) {
-				// Recheck assumed constant value before calling
-				skip_call = sljit_emit_cmp(
-					ctx->compiler,
-					SLJIT_NOT_EQUAL,
-					target.reg, 0,
-					SLJIT_IMM, target.const_value
-				);
-#if BUXN_JIT_VERBOSE
-				skip_id = ctx->label_id++;
-				fprintf(stderr, "  ; jump => label%d\n", skip_id);
-#endif
+// Returns a hash of the bytes which were baked into the code of the block
+static uint64_t
+buxn_jit_scan_code(
+	buxn_jit_t* jit,
+	const uint8_t* memory,
+	uint16_t base,
+	const buxn_jit_block_t* block,
+	int flags
+) {
+	// Walk the block the same way the compiler did.
+	// Only opcodes and immediate jump targets are baked into code.
+	// Literals are read from memory unless const_literals is set and they
+	// were never overwritten.
+	uint64_t hash = BUXN_JIT_FNV_OFFSET;
+	uint16_t pc = block->key;
+	uint16_t last_pc = block->last_pc;
+	while (pc <= last_pc && pc >= block->key) {
+		uint8_t opcode = memory[(uint16_t)(pc - base)];
+		hash = buxn_jit_scan_byte(jit, memory, base, hash, pc++, BUXN_JIT_CODE_OPCODE, flags);
+		if (opcode == 0x20 || opcode == 0x40 || opcode == 0x60) {
+			// JCI, JMI, JSI
+			hash = buxn_jit_scan_byte(jit, memory, base, hash, pc++, BUXN_JIT_CODE_OPCODE, flags);
+			hash = buxn_jit_scan_byte(jit, memory, base, hash, pc++, BUXN_JIT_CODE_OPCODE, flags);
+		} else if ((opcode & 0x9f) == 0x80) {
+			// LIT
+			int size = opcode & BUXN_JIT_OP_2 ? 2 : 1;
+			for (int i = 0; i < size; ++i, ++pc) {
+				if (jit->config.const_literals && !jit->volatile_literals[pc]) {
+					hash = buxn_jit_scan_byte(jit, memory, base, hash, pc, BUXN_JIT_CODE_LITERAL, flags);
+				}
 			}
+		}
+	}
 
-			// This is because we can return from this call and continue execution
-			// The target is compiled by a different buxn_jit_ctx_t so upon return,
-			// the cached states will be invalid.
-			//
-			// Other remote jumps do not have to care about cache invalidation
-			// since execution will never return to this function.
-			ctx->mem_base = 0;
-			struct sljit_jump* call = sljit_emit_call(
-				ctx->compiler,
-				SLJIT_CALL_REG_ARG | SLJIT_REWRITABLE_JUMP,
-				SLJIT_ARGS0(32)
-			);
-			sljit_set_label(call, ctx->call_fallback);
+	return hash;
+}
 
-			// If the return address is not as expected, trampoline
-			exit = sljit_emit_cmp(
-				ctx->compiler,
-				SLJIT_EQUAL,
-				SLJIT_R0, 0,
-				SLJIT_IMM, return_addr
+// Make compiled code reachable.
+// This only happens on the VM thread so that code which may be running is
+// never patched by the worker.
+static void
+buxn_jit_publish(buxn_jit_t* jit) {
+	buxn_jit_entry_t* entry;
+	while ((entry = buxn_jit_dequeue(&jit->ready_queue)) != NULL) {
+		buxn_jit_block_t* block = entry->block;
+		block->fn = (buxn_jit_fn_t)entry->code;
+		block->head_addr = entry->head_addr;
+		block->queued = false;
+		block->referenced = true;
+		jit->stats.code_size += block->code_size;
+
+		const uint8_t* memory = jit->vm->memory;
+		if (buxn_jit_scan_code(jit, memory, 0, block, 0) != entry->checksum) {
+			// The memory was written to after it was copied for the worker
+			buxn_jit_discard_block(jit, block);
+			jit->stats.num_invalidations += 1;
+		} else {
+			buxn_jit_scan_code(
+				jit, memory, 0, block,
+				BUXN_JIT_SCAN_MARK | BUXN_JIT_SCAN_RECORD
 			);
-#if BUXN_JIT_VERBOSE
-			exit_id = ctx->label_id++;
-			fprintf(stderr, "  ; jump => label%d\n", exit_id);
-#endif
-			sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_R0, 0);
 
-			if (skip_call != NULL) {
-#if BUXN_JIT_VERBOSE
-				fprintf(stderr, "  ; label%d:\n", skip_id);
-#endif
-				sljit_set_label(skip_call, sljit_emit_label(ctx->compiler));
+			// Relink callers which were compiled before this block was evicted
+			for (buxn_jit_link_t* itr = block->incoming; itr != NULL; itr = itr->next_in) {
+				buxn_jit_patch_link(itr);
 			}
-
-			buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
-			entry->link_type = BUXN_JIT_LINK_TO_HEAD;
-			entry->block = buxn_jit_queue_block(ctx->jit, target.const_value);
-			entry->compiler = ctx->compiler;
-			entry->jump = call;
-			buxn_jit_enqueue(&ctx->jit->link_queue, entry);
 		}
-	}
-
-	// Return to trampoline.
-	// This is always correct but slow.
-	sljit_emit_return(ctx->compiler, SLJIT_MOV32, target.reg, 0);
 
-	if (exit != NULL) {
-#if BUXN_JIT_VERBOSE
-		fprintf(stderr, "  ; label%d:\n", exit_id);
-#endif
-		sljit_set_label(exit, sljit_emit_label(ctx->compiler));
+		buxn_jit_enqueue(&jit->entry_pool, entry);
 	}
 }
 
 static void
-buxn_jit_jump(buxn_jit_ctx_t* ctx, buxn_jit_operand_t target, uint16_t return_addr) {
-	buxn_jit_clear_stack_caches(ctx);
+buxn_jit_enforce_code_budget(buxn_jit_t* jit) {
+	size_t budget = jit->config.max_code_size;
+	if (budget == 0) { return; }
+
+	// Clock (second chance) sweep through the block list.
+	// A block is referenced when it is looked up or linked to.
+	while (jit->stats.code_size > budget) {
+		buxn_jit_block_t* block = jit->clock_hand != NULL
+			? jit->clock_hand
+			: jit->blocks.first;
+		jit->clock_hand = block->next;
+
+		if (block->fn == NULL) { continue; }
+
+		if (block->referenced) {
+			block->referenced = false;
+		} else {
+			buxn_jit_evict_block(jit, block);
+		}
+	}
+}
 
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; jump(reg=r%d, addr=0x%04x, short=%d, return_addr=0x%04x)\n",
-		target.reg - SLJIT_R0,
-		target.const_value,
-		target.is_short,
-		return_addr
-	);
-#endif
+// }}}
 
-	if (target.is_short) {
-		buxn_jit_jump_abs(ctx, target, return_addr);
-	} else {
-		if (target.semantics & BUXN_JIT_SEM_BOOLEAN) {
-			// Save the compiler to ensure that finalization will not happen
-			// due to the next opcode
-			struct sljit_compiler* compiler = ctx->compiler;
-			struct sljit_jump* skip_next_opcode = sljit_emit_cmp(
-				ctx->compiler,
-				SLJIT_NOT_EQUAL,
-				target.reg, 0,
-				SLJIT_IMM, 0
-			);
-#if BUXN_JIT_VERBOSE
-	int label_id = ctx->label_id++;
-	fprintf(stderr, "  ; jump => label%d\n", label_id);
-#endif
+// Image {{{
 
-			buxn_jit_next_opcode(ctx);
+#define BUXN_JIT_IMAGE_CODE_ALIGNMENT 16
 
-#if BUXN_JIT_VERBOSE
-	fprintf(stderr, "  ; label%d:\n", label_id);
-#endif
-			// Continue, regardless of the opcode after this
-			ctx->compiler = compiler;
-			// In case the previous opcode was executed, clear the stack cache
-			// so that the next opcode starts in a consistent state for both
-			// true and false branches
-			buxn_jit_clear_stack_caches(ctx);
-			sljit_set_label(skip_next_opcode, sljit_emit_label(ctx->compiler));
-		} else {
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_MOV_S8,
-				target.reg, 0,
-				target.reg, 0
-			);
-			sljit_emit_op2(
-				ctx->compiler,
-				SLJIT_ADD,
-				target.reg, 0,
-				target.reg, 0,
-				SLJIT_IMM, ctx->pc
-			);
-			target.const_value = (uint16_t)((int32_t)ctx->pc + (int32_t)(int8_t)target.const_value);
+// All offsets are in bytes.
+// Links and relocations are stored in the same order as the blocks they
+// belong to.
+typedef struct {
+	char magic[8];
+	uint64_t fingerprint;
+	uint64_t rom_hash;
+	// Of everything after the header
+	uint64_t checksum;
+	uint32_t rom_size;
+	uint32_t num_blocks;
+	uint32_t num_links;
+	uint32_t num_relocs;
+} buxn_jit_image_header_t;
 
-			buxn_jit_jump_abs(ctx, target, return_addr);
-		}
+typedef struct {
+	// From the start of the image
+	uint64_t code_offset;
+	uint32_t code_size;
+	// From the start of the code
+	uint32_t head_offset;
+	uint32_t body_offset;
+	uint16_t pc;
+	uint16_t last_pc;
+	uint32_t num_links;
+	uint32_t num_relocs;
+	uint8_t shape;
+	uint8_t reserved[7];
+} buxn_jit_image_block_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t jump_offset;
+	uint32_t fallback_offset;
+	uint32_t resume_offset;
+	uint32_t key_offset;
+	uint16_t target;
+	uint16_t ic_site;
+	uint8_t ic_slot;
+	uint8_t target_shape;
+	uint8_t reserved[2];
+} buxn_jit_image_link_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t offset;
+} buxn_jit_image_reloc_t;
+
+static uint64_t
+buxn_jit_fnv1a(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= BUXN_JIT_FNV_PRIME;
 	}
+	return hash;
 }
 
-static void
-buxn_jit_conditional_jump(
-	buxn_jit_ctx_t* ctx,
-	buxn_jit_operand_t condition,
-	buxn_jit_operand_t target
+// Everything the generated code depends on besides the ROM
+static uint64_t
+buxn_jit_image_fingerprint(buxn_jit_t* jit) {
+	const char* platform = sljit_get_platform_name();
+	const uint64_t layout[] = {
+		BUXN_JIT_IMAGE_VERSION,
+		sizeof(sljit_sw),
+		jit->config.stack_cache_size,
+		jit->config.const_literals,
+		offsetof(buxn_vm_t, wsp),
+		offsetof(buxn_vm_t, rsp),
+		offsetof(buxn_vm_t, ws),
+		offsetof(buxn_vm_t, rs),
+		offsetof(buxn_vm_t, device),
+		offsetof(buxn_vm_t, memory),
+		offsetof(buxn_jit_block_t, head_addr),
+		offsetof(buxn_jit_block_t, referenced),
+		offsetof(buxn_jit_t, ports),
+		sizeof(buxn_jit_port_t),
+	};
+	uint64_t hash = buxn_jit_fnv1a(BUXN_JIT_FNV_OFFSET, platform, strlen(platform));
+	hash = buxn_jit_fnv1a(hash, layout, sizeof(layout));
+	// Callbacks are looked up at runtime, only the kinds are baked into code
+	for (int i = 0; i < 256; ++i) {
+		const buxn_jit_port_t* port = &jit->ports[i];
+		uint8_t kind[4] = {
+			port->kind,
+			port->dei != NULL,
+			port->deo != NULL,
+			port->no_stack_access,
+		};
+		hash = buxn_jit_fnv1a(hash, kind, sizeof(kind));
+	}
+	return hash;
+}
+
+static inline uint64_t
+buxn_jit_image_align(uint64_t offset) {
+	return (offset + BUXN_JIT_IMAGE_CODE_ALIGNMENT - 1)
+		& ~(uint64_t)(BUXN_JIT_IMAGE_CODE_ALIGNMENT - 1);
+}
+
+// Only code which was compiled from unmodified ROM bytes can be reused
+static bool
+buxn_jit_block_matches_rom(
+	buxn_jit_t* jit,
+	const buxn_jit_block_t* block,
+	const uint8_t* rom,
+	size_t rom_size
 ) {
-	buxn_jit_clear_stack_caches(ctx);
+	if (block->fn == NULL) { return false; }
+	if (block->key < BUXN_RESET_VECTOR || block->last_pc < block->key) { return false; }
+	if ((size_t)block->last_pc - BUXN_RESET_VECTOR >= rom_size) { return false; }
+
+	return memcmp(
+		&jit->vm->memory[block->key],
+		&rom[block->key - BUXN_RESET_VECTOR],
+		(size_t)block->last_pc - (size_t)block->key + 1
+	) == 0;
+}
 
-	sljit_emit_op2u(
-		ctx->compiler,
-		SLJIT_AND | SLJIT_SET_Z,
-		condition.reg, 0,
-		SLJIT_IMM, 0xff
+static void*
+buxn_jit_map_image(const char* path, size_t* size_out) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) { return NULL; }
+
+	void* image = NULL;
+	if (fseek(file, 0, SEEK_END) != 0) { goto end; }
+	long size = ftell(file);
+	if (size < (long)sizeof(buxn_jit_image_header_t)) { goto end; }
+
+	// It is only made executable once it is validated
+#ifdef _WIN32
+	image = VirtualAlloc(
+		NULL, (size_t)size,
+		MEM_COMMIT | MEM_RESERVE,
+		PAGE_READWRITE
 	);
+	if (image == NULL) { goto end; }
 
-	struct sljit_jump* skip_jump = sljit_emit_jump(ctx->compiler, SLJIT_ZERO);
-#if BUXN_JIT_VERBOSE
-	int label_id = ctx->label_id++;
-	fprintf(stderr, "  ; jump => label%d\n", label_id);
+	rewind(file);
+	if (fread(image, 1, (size_t)size, file) != (size_t)size) {
+		VirtualFree(image, 0, MEM_RELEASE);
+		image = NULL;
+		goto end;
+	}
+#else
+	// Private so that patching jumps does not write back to the file
+	image = mmap(
+		NULL, (size_t)size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE,
+		fileno(file), 0
+	);
+	if (image == MAP_FAILED) {
+		image = NULL;
+		goto end;
+	}
 #endif
 
-	buxn_jit_jump(ctx, target, 0);
+	*size_out = (size_t)size;
+end:
+	fclose(file);
+	return image;
+}
+
+static bool
+buxn_jit_protect_image(void* image, size_t size) {
+#ifdef _WIN32
+	DWORD old_protect;
+	return VirtualProtect(image, size, PAGE_EXECUTE_READWRITE, &old_protect) != 0;
+#else
+	return mprotect(image, size, PROT_READ | PROT_WRITE | PROT_EXEC) == 0;
+#endif
+}
+
+static inline bool
+buxn_jit_image_valid_shape(uint8_t shape) {
+	uint8_t len = shape & 0x3;
+	return shape >> (2 + len) == 0;
+}
+
+static bool
+buxn_jit_validate_image(
+	buxn_jit_t* jit,
+	const void* image,
+	size_t size,
+	const uint8_t* rom,
+	size_t rom_size
+) {
+	const buxn_jit_image_header_t* header = image;
+	if (memcmp(header->magic, BUXN_JIT_IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+		return false;
+	}
+	if (header->fingerprint != buxn_jit_image_fingerprint(jit)) { return false; }
+	if (header->rom_size != rom_size) { return false; }
+	if (header->rom_hash != buxn_jit_fnv1a(BUXN_JIT_FNV_OFFSET, rom, rom_size)) {
+		return false;
+	}
+	// The offsets are only checked for bounds, a corrupted file must not get
+	// to run
+	uint64_t checksum = buxn_jit_fnv1a(
+		BUXN_JIT_FNV_OFFSET,
+		header + 1,
+		size - sizeof(buxn_jit_image_header_t)
+	);
+	if (header->checksum != checksum) { return false; }
+
+	uint64_t tables_size = sizeof(buxn_jit_image_header_t)
+		+ (uint64_t)header->num_blocks * sizeof(buxn_jit_image_block_t)
+		+ (uint64_t)header->num_links * sizeof(buxn_jit_image_link_t)
+		+ (uint64_t)header->num_relocs * sizeof(buxn_jit_image_reloc_t);
+	if (tables_size > size) { return false; }
+
+	const buxn_jit_image_block_t* blocks = (const void*)(header + 1);
+	const buxn_jit_image_link_t* links = (const void*)(blocks + header->num_blocks);
+	const buxn_jit_image_reloc_t* relocs = (const void*)(links + header->num_links);
+	uint64_t num_links = 0;
+	uint64_t num_relocs = 0;
+	for (uint32_t i = 0; i < header->num_blocks; ++i) {
+		const buxn_jit_image_block_t* block = &blocks[i];
+		if (
+			block->code_offset < tables_size
+			|| block->code_offset % BUXN_JIT_IMAGE_CODE_ALIGNMENT != 0
+			|| block->code_offset + block->code_size > size
+			|| block->head_offset >= block->code_size
+			|| block->body_offset >= block->code_size
+			|| !buxn_jit_image_valid_shape(block->shape)
+		) {
+			return false;
+		}
+
+		if (num_links + block->num_links > header->num_links) { return false; }
+		for (uint32_t j = 0; j < block->num_links; ++j) {
+			const buxn_jit_image_link_t* link = &links[num_links + j];
+			if (
+				link->type > BUXN_JIT_LINK_IC
+				|| link->jump_offset >= block->code_size
+				|| link->fallback_offset >= block->code_size
+				|| link->resume_offset >= block->code_size
+				|| link->key_offset >= block->code_size
+				|| !buxn_jit_image_valid_shape(link->target_shape)
+			) {
+				return false;
+			}
+		}
+		num_links += block->num_links;
+
+		if (num_relocs + block->num_relocs > header->num_relocs) { return false; }
+		for (uint32_t j = 0; j < block->num_relocs; ++j) {
+			const buxn_jit_image_reloc_t* reloc = &relocs[num_relocs + j];
+			if (
+				reloc->type >= BUXN_JIT_RELOC_COUNT
+				|| reloc->offset >= block->code_size
+			) {
+				return false;
+			}
+		}
+		num_relocs += block->num_relocs;
+	}
+
+	return num_links == header->num_links && num_relocs == header->num_relocs;
+}
+
+static bool
+buxn_jit_image_write(FILE* file, const void* data, size_t size, uint64_t* checksum) {
+	*checksum = buxn_jit_fnv1a(*checksum, data, size);
+	return fwrite(data, 1, size, file) == size;
+}
+
+bool
+buxn_jit_save_image(
+	buxn_jit_t* jit,
+	const char* path,
+	const void* rom,
+	size_t rom_size
+) {
+	buxn_jit_lock(jit);
+
+	buxn_jit_image_header_t header = {
+		.magic = BUXN_JIT_IMAGE_MAGIC,
+		.fingerprint = buxn_jit_image_fingerprint(jit),
+		.rom_hash = buxn_jit_fnv1a(BUXN_JIT_FNV_OFFSET, rom, rom_size),
+		.rom_size = (uint32_t)rom_size,
+	};
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (!buxn_jit_block_matches_rom(jit, itr, rom, rom_size)) { continue; }
+
+		header.num_blocks += 1;
+		for (buxn_jit_link_t* link = itr->outgoing; link != NULL; link = link->next_out) {
+			header.num_links += 1;
+		}
+		for (buxn_jit_reloc_t* reloc = itr->relocs; reloc != NULL; reloc = reloc->next) {
+			header.num_relocs += 1;
+		}
+	}
+
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		buxn_jit_unlock(jit);
+		return false;
+	}
+
+	// Written again once the checksum is known
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	uint64_t checksum = BUXN_JIT_FNV_OFFSET;
+
+	uint64_t code_offset = buxn_jit_image_align(
+		sizeof(buxn_jit_image_header_t)
+		+ (uint64_t)header.num_blocks * sizeof(buxn_jit_image_block_t)
+		+ (uint64_t)header.num_links * sizeof(buxn_jit_image_link_t)
+		+ (uint64_t)header.num_relocs * sizeof(buxn_jit_image_reloc_t)
+	);
+	uint64_t first_code_offset = code_offset;
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (!buxn_jit_block_matches_rom(jit, itr, rom, rom_size)) { continue; }
+
+		sljit_uw code = (sljit_uw)itr->fn;
+		buxn_jit_image_block_t block = {
+			.code_offset = code_offset,
+			.code_size = (uint32_t)itr->code_size,
+			.head_offset = (uint32_t)(itr->head_addr - code),
+			.body_offset = (uint32_t)(itr->body_addr - code),
+			.pc = itr->key,
+			.last_pc = itr->last_pc,
+			.shape = itr->shape,
+		};
+		for (buxn_jit_link_t* link = itr->outgoing; link != NULL; link = link->next_out) {
+			block.num_links += 1;
+		}
+		for (buxn_jit_reloc_t* reloc = itr->relocs; reloc != NULL; reloc = reloc->next) {
+			block.num_relocs += 1;
+		}
+		success &= buxn_jit_image_write(file, &block, sizeof(block), &checksum);
+
+		code_offset = buxn_jit_image_align(code_offset + itr->code_size);
+	}
+
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (!buxn_jit_block_matches_rom(jit, itr, rom, rom_size)) { continue; }
+
+		sljit_uw code = (sljit_uw)itr->fn;
+		for (buxn_jit_link_t* link = itr->outgoing; link != NULL; link = link->next_out) {
+			buxn_jit_image_link_t record = {
+				.type = link->type,
+				.jump_offset = (uint32_t)(link->jump_addr - code),
+				.fallback_offset = (uint32_t)(link->fallback_addr - code),
+				.resume_offset = link->type == BUXN_JIT_LINK_RESUME
+					? (uint32_t)(link->resume_addr - code)
+					: 0,
+				.key_offset = link->type == BUXN_JIT_LINK_IC
+					? (uint32_t)(link->key_addr - code)
+					: 0,
+				.target = link->target != NULL ? link->target->key : 0,
+				.ic_site = link->ic_site,
+				.ic_slot = link->ic_slot,
+				.target_shape = link->target != NULL ? link->target->shape : 0,
+			};
+			success &= buxn_jit_image_write(file, &record, sizeof(record), &checksum);
+		}
+	}
+
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (!buxn_jit_block_matches_rom(jit, itr, rom, rom_size)) { continue; }
+
+		sljit_uw code = (sljit_uw)itr->fn;
+		for (buxn_jit_reloc_t* reloc = itr->relocs; reloc != NULL; reloc = reloc->next) {
+			buxn_jit_image_reloc_t record = {
+				.type = reloc->type,
+				.offset = (uint32_t)(reloc->addr - code),
+			};
+			success &= buxn_jit_image_write(file, &record, sizeof(record), &checksum);
+		}
+	}
+
+	static const uint8_t padding[BUXN_JIT_IMAGE_CODE_ALIGNMENT] = { 0 };
+	uint64_t offset = (uint64_t)ftell(file);
+	code_offset = first_code_offset;
+	for (buxn_jit_block_t* itr = jit->blocks.first; itr != NULL; itr = itr->next) {
+		if (!buxn_jit_block_matches_rom(jit, itr, rom, rom_size)) { continue; }
+
+		success &= buxn_jit_image_write(file, padding, code_offset - offset, &checksum);
+		success &= buxn_jit_image_write(file, (const void*)itr->fn, itr->code_size, &checksum);
+
+		offset = code_offset + itr->code_size;
+		code_offset = buxn_jit_image_align(offset);
+	}
+
+	header.checksum = checksum;
+	success &= fseek(file, 0, SEEK_SET) == 0;
+	success &= fwrite(&header, sizeof(header), 1, file) == 1;
+	success &= fclose(file) == 0;
+	buxn_jit_unlock(jit);
+	return success;
+}
+
+bool
+buxn_jit_load_image(
+	buxn_jit_t* jit,
+	const char* path,
+	const void* rom,
+	size_t rom_size
+) {
+	// Only one image can be loaded
+	if (jit->image != NULL) { return false; }
+
+	size_t size;
+	uint8_t* image = buxn_jit_map_image(path, &size);
+	if (image == NULL) { return false; }
+
+	if (
+		!buxn_jit_validate_image(jit, image, size, rom, rom_size)
+		|| !buxn_jit_protect_image(image, size)
+	) {
+		buxn_jit_release_exec(image, size);
+		return false;
+	}
+
+	buxn_jit_lock(jit);
+	jit->image = image;
+	jit->image_size = size;
+
+	const buxn_jit_image_header_t* header = (const void*)image;
+	const buxn_jit_image_block_t* blocks = (const void*)(header + 1);
+	const buxn_jit_image_link_t* links = (const void*)(blocks + header->num_blocks);
+	const buxn_jit_image_reloc_t* relocs = (const void*)(links + header->num_links);
+
+	// Install all blocks first so that links between them can be patched
+	for (uint32_t i = 0; i < header->num_blocks; ++i) {
+		const buxn_jit_image_block_t* record = &blocks[i];
+		buxn_jit_block_t* block = buxn_jit_find_variant(jit, record->pc, record->shape);
+		// Already compiled in this process
+		if (block->fn != NULL || block->queued) { continue; }
+
+		sljit_uw code = (sljit_uw)(image + record->code_offset);
+		block->fn = (buxn_jit_fn_t)code;
+		block->head_addr = code + record->head_offset;
+		block->body_addr = code + record->body_offset;
+		block->executable_offset = 0;
+		block->code_size = record->code_size;
+		block->last_pc = record->last_pc;
+		block->referenced = true;
+		block->from_image = true;
+		buxn_jit_scan_code(
+			jit, jit->vm->memory, 0, block,
+			BUXN_JIT_SCAN_MARK | BUXN_JIT_SCAN_RECORD
+		);
+		jit->stats.code_size += record->code_size;
+
+		for (buxn_jit_link_t* itr = block->incoming; itr != NULL; itr = itr->next_in) {
+			buxn_jit_patch_link(itr);
+		}
+	}
+
+	// Every address baked into the code still belongs to the process which
+	// saved the image
+	for (uint32_t i = 0; i < header->num_blocks; ++i) {
+		const buxn_jit_image_block_t* record = &blocks[i];
+		buxn_jit_block_t* block = buxn_jit_find_variant(jit, record->pc, record->shape);
+		sljit_uw code = (sljit_uw)(image + record->code_offset);
+		bool installed = (sljit_uw)block->fn == code;
+
+		for (uint32_t j = 0; installed && j < record->num_relocs; ++j) {
+			const buxn_jit_image_reloc_t* reloc_record = &relocs[j];
+			buxn_jit_reloc_t* reloc = buxn_jit_alloc_reloc(jit);
+			reloc->type = (buxn_jit_reloc_type_t)reloc_record->type;
+			reloc->addr = code + reloc_record->offset;
+			reloc->next = block->relocs;
+			block->relocs = reloc;
+
+			sljit_set_const(
+				reloc->addr,
+				SLJIT_MOV,
+				buxn_jit_reloc_value(jit, reloc->type),
+				0
+			);
+		}
+		relocs += record->num_relocs;
+
+		for (uint32_t j = 0; installed && j < record->num_links; ++j) {
+			const buxn_jit_image_link_t* link_record = &links[j];
+			buxn_jit_link_t* link = buxn_jit_alloc_link(jit);
+			*link = (buxn_jit_link_t){
+				.type = (buxn_jit_link_type_t)link_record->type,
+				.source = block,
+				.jump_addr = code + link_record->jump_offset,
+				.fallback_addr = code + link_record->fallback_offset,
+				.resume_addr = code + link_record->resume_offset,
+				.key_addr = code + link_record->key_offset,
+				.ic_site = link_record->ic_site,
+				.ic_slot = link_record->ic_slot,
+				.next_out = block->outgoing,
+			};
+			block->outgoing = link;
+
+			if (link->type == BUXN_JIT_LINK_RESUME) {
+				sljit_set_jump_addr(link->jump_addr, link->resume_addr, 0);
+			} else if (link->type == BUXN_JIT_LINK_IC) {
+				// Inline caches start empty
+				sljit_set_const(link->key_addr, SLJIT_MOV, -1, 0);
+				buxn_jit_unpatch_link(link);
+			} else {
+				link->target = buxn_jit_link_variant(
+					jit,
+					link_record->target,
+					link_record->target_shape
+				);
+				link->next_in = link->target->incoming;
+				link->target->incoming = link;
+
+				if (link->target->fn != NULL) {
+					buxn_jit_patch_link(link);
+				} else {
+					buxn_jit_unpatch_link(link);
+				}
+			}
+		}
+		links += record->num_links;
+	}
+
+	buxn_jit_unlock(jit);
+	return true;
+}
+
+// }}}
+
+// Utils {{{
+
+static bool
+buxn_jit_stack_cache_park(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache
+);
+
+static bool
+buxn_jit_mem_values_evict(buxn_jit_ctx_t* ctx);
+
+static void
+buxn_jit_save_state(buxn_jit_ctx_t* ctx);
+
+static void
+buxn_jit_mem_values_clear(buxn_jit_ctx_t* ctx);
+
+static inline bool
+buxn_jit_op_flag_2(buxn_jit_ctx_t* ctx) {
+	return ctx->current_opcode & BUXN_JIT_OP_2
+		&&
+		ctx->current_opcode != 0x20  // JCI
+		&&
+		ctx->current_opcode != 0x40  // JMI
+		&&
+		ctx->current_opcode != 0x60  // JSI
+		;
+}
+
+static inline bool
+buxn_jit_op_flag_k(buxn_jit_ctx_t* ctx) {
+	return ctx->current_opcode & BUXN_JIT_OP_K
+		&&
+		ctx->current_opcode != 0x20  // JCI
+		&&
+		ctx->current_opcode != 0x40  // JMI
+		&&
+		ctx->current_opcode != 0x60  // JSI
+		&&
+		ctx->current_opcode != 0x80  // LIT
+		&&
+		ctx->current_opcode != 0xa0  // LIT2
+		&&
+		ctx->current_opcode != 0xc0  // LITr
+		&&
+		ctx->current_opcode != 0xe0  // LIT2r
+		;
+}
+
+static inline bool
+buxn_jit_op_flag_r(buxn_jit_ctx_t* ctx) {
+	return ctx->current_opcode & BUXN_JIT_OP_R
+		&&
+		ctx->current_opcode != 0x20  // JCI
+		&&
+		ctx->current_opcode != 0x40  // JMI
+		&&
+		ctx->current_opcode != 0x60  // JSI
+		;
+}
+
+static buxn_jit_reg_t
+buxn_jit_find_free_reg(buxn_jit_ctx_t* ctx) {
+	for (int i = 0; i < (BUXN_JIT_R_OP_MAX - BUXN_JIT_R_OP_MIN + 1); ++i) {
+		if (ctx->reg_ref_counts[i] == 0) {
+			return SLJIT_R(BUXN_JIT_R_OP_MIN + i);
+		}
+	}
+
+	return 0;
+}
+
+static void
+buxn_jit_retain_reg(buxn_jit_ctx_t* ctx, buxn_jit_reg_t reg) {
+	BUXN_JIT_ASSERT(
+		BUXN_JIT_R_OP_MIN <= reg - SLJIT_R0 && reg - SLJIT_R0 <= BUXN_JIT_R_OP_MAX,
+		"Invalid register"
+	);
+	ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] += 1;
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; retain_reg(r%d) => %d\n",
+		reg - SLJIT_R0,
+		ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)]
+	);
+#endif
+}
+
+static void
+buxn_jit_release_reg(buxn_jit_ctx_t* ctx, buxn_jit_reg_t reg) {
+	BUXN_JIT_ASSERT(
+		SLJIT_R(BUXN_JIT_R_OP_MIN) <= reg && reg <= SLJIT_R(BUXN_JIT_R_OP_MAX),
+		"Invalid register"
+	);
+	BUXN_JIT_ASSERT(
+		ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] > 0,
+		"Releasing unused register"
+	);
+	ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] -= 1;
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; release_reg(r%d) => %d\n",
+		reg - SLJIT_R0,
+		ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)]
+	);
+	if (ctx->reg_ref_counts[reg - SLJIT_R(BUXN_JIT_R_OP_MIN)] == 0) {
+		fprintf(stderr, "  ; free_reg(r%d)\n", reg - SLJIT_R0);
+	}
+#endif
+}
+
+static buxn_jit_reg_t
+buxn_jit_alloc_reg(buxn_jit_ctx_t* ctx) {
+	buxn_jit_reg_t reg;
+	while ((reg  = buxn_jit_find_free_reg(ctx)) == 0) {
+		// Try to park from current cache first then opposing cache
+		buxn_jit_stack_cache_t* current = buxn_jit_op_flag_r(ctx)
+			? &ctx->rst_cache
+			: &ctx->wst_cache;
+		buxn_jit_stack_cache_t* opposing = buxn_jit_op_flag_r(ctx)
+			? &ctx->wst_cache
+			: &ctx->rst_cache;
+		if (
+			!buxn_jit_stack_cache_park(ctx, current)
+			&&
+			!buxn_jit_stack_cache_park(ctx, opposing)
+			&&
+			!buxn_jit_mem_values_evict(ctx)
+		) {
+			break;
+		}
+	}
+	BUXN_JIT_ASSERT(reg != 0, "Out of registers");
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; alloc_reg() => r%d\n", reg - SLJIT_R0);
+#endif
+	buxn_jit_retain_reg(ctx, reg);
+
+	return reg;
+}
+
+// The exponent if the value is a power of two, -1 otherwise
+static int
+buxn_jit_log2(uint16_t value) {
+	if (value == 0 || (value & (value - 1)) != 0) { return -1; }
+
+	int exponent = 0;
+	while ((value >>= 1) != 0) { exponent += 1; }
+	return exponent;
+}
+
+// Find m and k such that a / divisor == (a * m) >> k for every a of the given
+// width (Granlund-Montgomery).
+// Returns false if the product would not fit in a machine word.
+static bool
+buxn_jit_div_magic(
+	uint16_t divisor,
+	int num_bits,
+	uint64_t* multiplier,
+	int* shift
+) {
+	for (int k = num_bits; k <= num_bits + 16; ++k) {
+		uint64_t m = (((uint64_t)1 << k) + divisor - 1) / divisor;
+		uint64_t error = m * divisor - ((uint64_t)1 << k);
+		if (error <= ((uint64_t)1 << (k - num_bits))) {
+			uint64_t max_product = (((uint64_t)1 << num_bits) - 1) * m;
+			if (sizeof(sljit_sw) < 8 && max_product > UINT32_MAX) { return false; }
+
+			*multiplier = m;
+			*shift = k;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Shorts are big endian and may be unaligned
+static void
+buxn_jit_emit_load_u16(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_reg_t dst,
+	sljit_s32 mem, sljit_sw memw
+) {
+	sljit_emit_mem(
+		ctx->compiler,
+		SLJIT_MOV_U16 | SLJIT_MEM_LOAD | SLJIT_MEM_UNALIGNED,
+		dst,
+		mem, memw
+	);
+#if SLJIT_LITTLE_ENDIAN
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_REV_U16,
+		dst, 0,
+		dst, 0
+	);
+#endif
+}
+
+// TMP is clobbered
+static void
+buxn_jit_emit_store_u16(
+	buxn_jit_ctx_t* ctx,
+	sljit_s32 src, sljit_sw srcw,
+	sljit_s32 mem, sljit_sw memw
+) {
+	if (src & SLJIT_MEM) {
+		// Slots are word-sized, read the whole word
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			BUXN_JIT_TMP(), 0,
+			src, srcw
+		);
+		src = BUXN_JIT_TMP();
+		srcw = 0;
+	}
+	sljit_emit_op1(
+		ctx->compiler,
+#if SLJIT_LITTLE_ENDIAN
+		SLJIT_REV_U16,
+#else
+		SLJIT_MOV_U16,
+#endif
+		BUXN_JIT_TMP(), 0,
+		src, srcw
+	);
+	sljit_emit_mem(
+		ctx->compiler,
+		SLJIT_MOV_U16 | SLJIT_MEM_STORE | SLJIT_MEM_UNALIGNED,
+		BUXN_JIT_TMP(),
+		mem, memw
+	);
+}
+
+static uint64_t
+buxn_jit_time_ns(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// }}}
+
+// Stack cache {{{
+
+static void
+buxn_jit_set_mem_base(buxn_jit_ctx_t* ctx, sljit_sw base);
+
+static bool
+buxn_jit_stack_cache_spill(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache
+);
+
+static inline buxn_jit_stack_cache_cell_t*
+buxn_jit_stack_cache_at(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache,
+	uint8_t index
+) {
+	return &cache->cells[(cache->head + index) % ctx->cache_size];
+}
+
+// Every cell has its own slot in the frame
+static sljit_sw
+buxn_jit_stack_cache_slot(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache,
+	const buxn_jit_stack_cache_cell_t* cell
+) {
+	sljit_sw index = cell - cache->cells;
+	if (cache == &ctx->rst_cache) { index += ctx->cache_size; }
+	return index * (sljit_sw)sizeof(sljit_sw);
+}
+
+// Move the bottom-most cell which still holds a register into its slot
+static bool
+buxn_jit_stack_cache_park(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache
+) {
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		if (cell->in_slot) { continue; }
+
+#if BUXN_JIT_VERBOSE
+		fprintf(stderr, "  ; park(reg=r%d)\n", cell->value.reg - SLJIT_R0);
+#endif
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			SLJIT_MEM1(SLJIT_SP), buxn_jit_stack_cache_slot(ctx, cache, cell),
+			cell->value.reg, 0
+		);
+		buxn_jit_release_reg(ctx, cell->value.reg);
+		cell->in_slot = true;
+		ctx->jit->stats.num_slot_spills += 1;
+		return true;
+	}
+
+	return false;
+}
+
+// Bring a parked cell back into a register
+static void
+buxn_jit_stack_cache_unpark(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache,
+	buxn_jit_stack_cache_cell_t* cell
+) {
+	if (!cell->in_slot) { return; }
+
+	// The cell is skipped while it is still in its slot
+	buxn_jit_reg_t reg = buxn_jit_alloc_reg(ctx);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV,
+		reg, 0,
+		SLJIT_MEM1(SLJIT_SP), buxn_jit_stack_cache_slot(ctx, cache, cell)
+	);
+	cell->value.reg = reg;
+	cell->in_slot = false;
+}
+
+static void
+buxn_jit_stack_cache_push(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t*  cache,
+	buxn_jit_operand_t value
+) {
+	if (cache->len >= ctx->cache_size) {
+		ctx->jit->stats.num_spills += buxn_jit_stack_cache_at(ctx, cache, 0)->need_flush;
+		buxn_jit_stack_cache_spill(ctx, cache);
+	}
+
+	buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, cache->len++);
+	cell->value = value;
+	cell->need_flush = true;
+	cell->in_slot = false;
+	buxn_jit_retain_reg(ctx, value.reg);
+}
+
+static buxn_jit_reg_t
+buxn_jit_pop_from_mem(buxn_jit_ctx_t* ctx, bool flag_2, bool flag_r) {
+	sljit_sw mem_base = flag_r ? SLJIT_OFFSETOF(buxn_vm_t, rs) : SLJIT_OFFSETOF(buxn_vm_t, ws);
+	buxn_jit_set_mem_base(ctx, mem_base);
+
+	buxn_jit_reg_t stack_ptr_reg = flag_r ? ctx->rsp_reg : ctx->wsp_reg;
+	buxn_jit_reg_t reg = buxn_jit_alloc_reg(ctx);
+
+	if (flag_2) {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_SUB,
+			stack_ptr_reg, 0,
+			stack_ptr_reg, 0,
+			SLJIT_IMM, 2
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			stack_ptr_reg, 0
+		);
+		struct sljit_jump* wrap = sljit_emit_cmp(
+			ctx->compiler,
+			SLJIT_EQUAL,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			SLJIT_IMM, 0xff
+		);
+		buxn_jit_emit_load_u16(ctx, reg, BUXN_JIT_MEM(), 0);
+		struct sljit_jump* done = sljit_emit_jump(ctx->compiler, SLJIT_JUMP);
+
+		// The low byte is at the bottom of the stack
+		sljit_set_label(wrap, sljit_emit_label(ctx->compiler));
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			reg, 0,
+			BUXN_JIT_MEM(), 0
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_SHL,
+			reg, 0,
+			reg, 0,
+			SLJIT_IMM, 8
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_TMP(), 0,
+			SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), 0
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_OR,
+			reg, 0,
+			reg, 0,
+			BUXN_JIT_TMP(), 0
+		);
+		sljit_set_label(done, sljit_emit_label(ctx->compiler));
+	} else {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_SUB,
+			stack_ptr_reg, 0,
+			stack_ptr_reg, 0,
+			SLJIT_IMM, 1
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			stack_ptr_reg, 0
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			reg, 0,
+			BUXN_JIT_MEM(), 0
+		);
+	}
+
+	return reg;
+}
+
+static buxn_jit_reg_t
+buxn_jit_stack_cache_pop(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t*  cache,
+	bool flag_2
+) {
+	bool flag_r = cache == &ctx->rst_cache;
+	if (flag_2) {
+		if (cache->len == 0) {
+			// There is nothing in the cache, pop from memory
+			return buxn_jit_pop_from_mem(ctx, flag_2, flag_r);
+		} else {
+			buxn_jit_stack_cache_cell_t* top = buxn_jit_stack_cache_at(ctx, cache, cache->len - 1);
+			buxn_jit_stack_cache_unpark(ctx, cache, top);
+			cache->len -= 1;
+			if (top->value.is_short) {
+				// The top value is the right size, just return it
+				return top->value.reg;
+			} else {
+				// The top value is a byte, pop the high byte from the stack
+				buxn_jit_reg_t hi = buxn_jit_stack_cache_pop(ctx, cache, false);
+				sljit_emit_op2(
+					ctx->compiler,
+					SLJIT_SHL,
+					hi, 0,
+					hi, 0,
+					SLJIT_IMM, 8
+				);
+				sljit_emit_op2(
+					ctx->compiler,
+					SLJIT_OR,
+					hi, 0,
+					hi, 0,
+					top->value.reg, 0
+				);
+				buxn_jit_release_reg(ctx, top->value.reg);
+				return hi;
+			}
+		}
+	} else {
+		if (cache->len == 0) {
+			// There is nothing in the cache, pop from memory
+			return buxn_jit_pop_from_mem(ctx, flag_2, flag_r);
+		} else {
+			buxn_jit_stack_cache_cell_t* top = buxn_jit_stack_cache_at(ctx, cache, cache->len - 1);
+
+			if (top->value.is_short) {
+				// The top value is a short, split it
+				// Alloc a register to hold the low byte
+				buxn_jit_reg_t reg = buxn_jit_alloc_reg(ctx);
+				// Allocating a register could have parked the top value
+				buxn_jit_stack_cache_unpark(ctx, cache, top);
+				sljit_emit_op1(
+					ctx->compiler,
+					SLJIT_MOV_U8,
+					reg, 0,
+					top->value.reg, 0
+				);
+				sljit_emit_op2(
+					ctx->compiler,
+					SLJIT_LSHR,
+					top->value.reg, 0,
+					top->value.reg, 0,
+					SLJIT_IMM, 8
+				);
+				top->value.is_short = false;
+				return reg;
+			} else {
+				// The top value is the right size, just return it
+				buxn_jit_stack_cache_unpark(ctx, cache, top);
+				cache->len -= 1;
+				return top->value.reg;
+			}
+		}
+	}
+}
+
+static void
+buxn_jit_discard_from_mem(buxn_jit_ctx_t* ctx, bool flag_2, bool flag_r) {
+	buxn_jit_reg_t stack_ptr_reg = flag_r ? ctx->rsp_reg : ctx->wsp_reg;
+	sljit_emit_op2(
+		ctx->compiler,
+		SLJIT_SUB,
+		stack_ptr_reg, 0,
+		stack_ptr_reg, 0,
+		SLJIT_IMM, flag_2 ? 2 : 1
+	);
+}
+
+static void
+buxn_jit_stack_cache_discard(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t*  cache,
+	bool flag_2
+) {
+	bool flag_r = cache == &ctx->rst_cache;
+	if (flag_2) {
+		if (cache->len == 0) {
+			// There is nothing in the cache, discard from memory
+			buxn_jit_discard_from_mem(ctx, flag_2, flag_r);
+		} else {
+			// Discard the top value
+			buxn_jit_stack_cache_cell_t* top = buxn_jit_stack_cache_at(ctx, cache, --cache->len);
+			if (!top->in_slot) {
+				buxn_jit_release_reg(ctx, top->value.reg);
+			}
+			if (!top->value.is_short) {
+				// The top value is a byte, discard the next byte
+				buxn_jit_stack_cache_discard(ctx, cache, false);
+			}
+		}
+	} else {
+		if (cache->len == 0) {
+			// There is nothing in the cache, discard from memory
+			buxn_jit_discard_from_mem(ctx, flag_2, flag_r);
+		} else {
+			buxn_jit_stack_cache_cell_t* top = buxn_jit_stack_cache_at(ctx, cache, cache->len - 1);
+
+			if (top->value.is_short) {
+				// The top value is a short, reduce it
+				buxn_jit_stack_cache_unpark(ctx, cache, top);
+				sljit_emit_op2(
+					ctx->compiler,
+					SLJIT_LSHR,
+					top->value.reg, 0,
+					top->value.reg, 0,
+					SLJIT_IMM, 8
+				);
+				top->value.is_short = false;
+			} else {
+				// The top value is the right size, just discard it
+				cache->len -= 1;
+				if (!top->in_slot) {
+					buxn_jit_release_reg(ctx, top->value.reg);
+				}
+			}
+		}
+	}
+}
+
+// The value is read from src which is either the operand register or a slot
+static void
+buxn_jit_do_push(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t operand,
+	sljit_s32 src, sljit_sw srcw,
+	bool flag_r
+) {
+	buxn_jit_set_mem_base(
+		ctx,
+		flag_r ? SLJIT_OFFSETOF(buxn_vm_t, rs) : SLJIT_OFFSETOF(buxn_vm_t, ws)
+	);
+	buxn_jit_reg_t stack_ptr_reg = flag_r
+		? SLJIT_S(BUXN_JIT_S_RSP)
+		: SLJIT_S(BUXN_JIT_S_WSP);
+
+	if (operand.is_short) {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			stack_ptr_reg, 0
+		);
+		struct sljit_jump* wrap = sljit_emit_cmp(
+			ctx->compiler,
+			SLJIT_EQUAL,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			SLJIT_IMM, 0xff
+		);
+		buxn_jit_emit_store_u16(ctx, src, srcw, BUXN_JIT_MEM(), 0);
+		struct sljit_jump* done = sljit_emit_jump(ctx->compiler, SLJIT_JUMP);
+
+		// The low byte goes to the bottom of the stack
+		sljit_set_label(wrap, sljit_emit_label(ctx->compiler));
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_LSHR,
+			BUXN_JIT_TMP(), 0,
+			src, srcw,
+			SLJIT_IMM, 8
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM(), 0,
+			BUXN_JIT_TMP(), 0
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_AND,
+			BUXN_JIT_TMP(), 0,
+			src, srcw,
+			SLJIT_IMM, 0xff
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), 0,
+			BUXN_JIT_TMP(), 0
+		);
+		sljit_set_label(done, sljit_emit_label(ctx->compiler));
+
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			stack_ptr_reg, 0,
+			stack_ptr_reg, 0,
+			SLJIT_IMM, 2
+		);
+	} else {
+		if (src & SLJIT_MEM) {
+			// Slots are word-sized, read the whole word
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV,
+				BUXN_JIT_TMP(), 0,
+				src, srcw
+			);
+			src = BUXN_JIT_TMP();
+			srcw = 0;
+		}
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			stack_ptr_reg, 0
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM(), 0,
+			src, srcw
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			stack_ptr_reg, 0,
+			stack_ptr_reg, 0,
+			SLJIT_IMM, 1
+		);
+	}
+}
+
+static void
+buxn_jit_flush_cell(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache,
+	buxn_jit_stack_cache_cell_t* cell
+) {
+	bool flag_r = cache == &ctx->rst_cache;
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; flush(reg=r%d, in_slot=%d, flag_2=%d, flag_r=%d) {{{\n",
+		cell->value.reg - SLJIT_R0,
+		cell->in_slot,
+		cell->value.is_short,
+		flag_r
+	);
+#endif
+	if (cell->in_slot) {
+		buxn_jit_do_push(
+			ctx,
+			cell->value,
+			SLJIT_MEM1(SLJIT_SP), buxn_jit_stack_cache_slot(ctx, cache, cell),
+			flag_r
+		);
+	} else {
+		buxn_jit_do_push(ctx, cell->value, cell->value.reg, 0, flag_r);
+	}
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; }}}\n");
+#endif
+	cell->need_flush = false;
+}
+
+static bool
+buxn_jit_stack_cache_spill(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache
+) {
+	if (cache->len == 0) { return false; }
+
+	buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, 0);
+	if (cell->need_flush) {
+		buxn_jit_flush_cell(ctx, cache, cell);
+	}
+	if (!cell->in_slot) {
+		buxn_jit_release_reg(ctx, cell->value.reg);
+	}
+
+	cache->head = (cache->head + 1) % ctx->cache_size;
+	cache->len -= 1;
+
+	return true;
+}
+
+// Write every cell in a single pass: the stack pointer is bumped once and each
+// cell is written at a fixed displacement from it.
+// Cells are pushed one by one if the stack would wrap around.
+static void
+buxn_jit_stack_cache_flush(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache
+) {
+	uint8_t num_cells = 0;
+	sljit_sw num_bytes = 0;
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		if (cell->need_flush) {
+			num_cells += 1;
+			num_bytes += cell->value.is_short ? 2 : 1;
+		}
+	}
+	if (num_cells == 0) { return; }
+
+	struct sljit_jump* wrap = NULL;
+	struct sljit_jump* done = NULL;
+	if (num_cells > 1) {
+		bool flag_r = cache == &ctx->rst_cache;
+		buxn_jit_reg_t stack_ptr_reg = flag_r
+			? SLJIT_S(BUXN_JIT_S_RSP)
+			: SLJIT_S(BUXN_JIT_S_WSP);
+#if BUXN_JIT_VERBOSE
+		fprintf(
+			stderr,
+			"  ; flush_batch(num_cells=%d, num_bytes=%d, flag_r=%d)\n",
+			num_cells,
+			(int)num_bytes,
+			flag_r
+		);
+#endif
+		buxn_jit_set_mem_base(
+			ctx,
+			flag_r ? SLJIT_OFFSETOF(buxn_vm_t, rs) : SLJIT_OFFSETOF(buxn_vm_t, ws)
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			stack_ptr_reg, 0
+		);
+		wrap = sljit_emit_cmp(
+			ctx->compiler,
+			SLJIT_GREATER,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			SLJIT_IMM, 256 - num_bytes
+		);
+		// The offset register becomes a pointer to the top of the stack
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			SLJIT_R(BUXN_JIT_R_MEM_BASE), 0
+		);
+		sljit_sw offset = 0;
+		for (uint8_t i = 0; i < cache->len; ++i) {
+			buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+			if (!cell->need_flush) { continue; }
+
+			sljit_s32 src = cell->value.reg;
+			sljit_sw srcw = 0;
+			if (cell->in_slot) {
+				src = SLJIT_MEM1(SLJIT_SP);
+				srcw = buxn_jit_stack_cache_slot(ctx, cache, cell);
+			}
+
+			if (cell->value.is_short) {
+				buxn_jit_emit_store_u16(
+					ctx,
+					src, srcw,
+					SLJIT_MEM1(BUXN_JIT_MEM_OFFSET()), offset
+				);
+				offset += 2;
+			} else {
+				if (src & SLJIT_MEM) {
+					// Slots are word-sized, read the whole word
+					sljit_emit_op1(
+						ctx->compiler,
+						SLJIT_MOV,
+						BUXN_JIT_TMP(), 0,
+						src, srcw
+					);
+					src = BUXN_JIT_TMP();
+					srcw = 0;
+				}
+				sljit_emit_op1(
+					ctx->compiler,
+					SLJIT_MOV_U8,
+					SLJIT_MEM1(BUXN_JIT_MEM_OFFSET()), offset,
+					src, srcw
+				);
+				offset += 1;
+			}
+		}
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			stack_ptr_reg, 0,
+			stack_ptr_reg, 0,
+			SLJIT_IMM, num_bytes
+		);
+		done = sljit_emit_jump(ctx->compiler, SLJIT_JUMP);
+		sljit_set_label(wrap, sljit_emit_label(ctx->compiler));
+	}
+
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		if (cell->need_flush) {
+			buxn_jit_flush_cell(ctx, cache, cell);
+		}
+	}
+
+	if (done != NULL) {
+		sljit_set_label(done, sljit_emit_label(ctx->compiler));
+	}
+}
+
+static void
+buxn_jit_stack_cache_clear(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_stack_cache_t* cache
+) {
+	buxn_jit_stack_cache_flush(ctx, cache);
+	while (buxn_jit_stack_cache_spill(ctx, cache)) { }
+}
+
+static void
+buxn_jit_clear_stack_caches(buxn_jit_ctx_t* ctx) {
+	buxn_jit_stack_cache_clear(ctx, &ctx->wst_cache);
+	buxn_jit_stack_cache_clear(ctx, &ctx->rst_cache);
+	buxn_jit_mem_values_clear(ctx);
+}
+
+static void
+buxn_jit_stack_cache_retain(buxn_jit_ctx_t* ctx, buxn_jit_stack_cache_t* cache) {
+	// Remove flushed cells
+	uint8_t num_flushed = 0;
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		num_flushed += !cell->need_flush;
+	}
+	cache->head = (cache->head + num_flushed) % ctx->cache_size;
+	cache->len -= num_flushed;
+
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		if (!cell->in_slot) {
+			buxn_jit_retain_reg(ctx, cell->value.reg);
+		}
+	}
+}
+
+// }}}
+
+// Micro ops {{{
+
+static inline void
+buxn_jit_set_mem_base(buxn_jit_ctx_t* ctx, sljit_sw base) {
+	if (ctx->mem_base != base) {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			SLJIT_R(BUXN_JIT_R_MEM_BASE), 0,
+			SLJIT_S(BUXN_JIT_S_VM), 0,
+			SLJIT_IMM, base
+		);
+		ctx->mem_base = base;
+	}
+}
+
+static void
+buxn_jit_push_ex(buxn_jit_ctx_t* ctx, buxn_jit_operand_t operand, bool flag_r) {
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; push(reg=r%d, flag_2=%d, flag_r=%d)\n",
+		operand.reg - SLJIT_R0,
+		operand.is_short,
+		flag_r
+	);
+#endif
+
+	BUXN_JIT_ASSERT(
+		ctx->reg_ref_counts[operand.reg - SLJIT_R(BUXN_JIT_R_OP_MIN)],
+		"Pushing operand with unused register"
+	);
+
+	// Defer the entire push operation until it's actually needed
+	buxn_jit_stack_cache_t* cache = flag_r ? &ctx->rst_cache : &ctx->wst_cache;
+	buxn_jit_stack_cache_push(ctx, cache, operand);
+
+	buxn_jit_value_t* stack = flag_r ? ctx->rst : ctx->wst;
+	uint8_t* stack_ptr = flag_r ? &ctx->rsp : &ctx->wsp;
+
+	if (operand.is_short) {
+		buxn_jit_value_t* hi = &stack[(*stack_ptr)++];
+		buxn_jit_value_t* lo = &stack[(*stack_ptr)++];
+		hi->semantics = lo->semantics = operand.semantics;
+		hi->const_value = operand.const_value >> 8;
+		lo->const_value = operand.const_value & 0xff;
+	} else {
+		buxn_jit_value_t* value = &stack[(*stack_ptr)++];
+		value->semantics = operand.semantics;
+		value->const_value = (uint8_t)operand.const_value;
+	}
+}
+
+static buxn_jit_operand_t
+buxn_jit_pop_ex(buxn_jit_ctx_t* ctx, bool flag_2, bool flag_r) {
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; pop(flag_2=%d, flag_r=%d) {{{\n", flag_2, flag_r);
+#endif
+
+	buxn_jit_value_t* stack = flag_r ? ctx->rst : ctx->wst;
+	uint8_t* stack_ptr = flag_r ? ctx->ersp : ctx->ewsp;
+
+	buxn_jit_operand_t operand = {
+		.is_short = flag_2,
+	};
+
+	if (flag_2) {
+		buxn_jit_value_t lo = stack[--(*stack_ptr)];
+		buxn_jit_value_t hi = stack[--(*stack_ptr)];
+		if (
+			(hi.semantics & BUXN_JIT_SEM_CONST)
+			&&
+			(lo.semantics & BUXN_JIT_SEM_CONST)
+		) {
+			operand.semantics = BUXN_JIT_SEM_CONST
+				| (hi.semantics & lo.semantics & BUXN_JIT_SEM_IMM);
+			operand.const_value = (uint16_t)hi.const_value << 8 | (uint16_t)lo.const_value;
+		}
+	} else {
+		buxn_jit_value_t value = stack[--(*stack_ptr)];
+		operand.const_value = value.const_value;
+		operand.semantics = value.semantics;
+	}
+
+	buxn_jit_stack_cache_t* cache = flag_r ? &ctx->rst_cache : &ctx->wst_cache;
+	operand.reg = buxn_jit_stack_cache_pop(ctx, cache, flag_2);
+
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; }}} => r%d\n", operand.reg - SLJIT_R0);
+#endif
+
+	return operand;
+}
+
+static void
+buxn_jit_push(buxn_jit_ctx_t* ctx, buxn_jit_operand_t operand) {
+	buxn_jit_push_ex(ctx, operand, buxn_jit_op_flag_r(ctx));
+}
+
+static buxn_jit_operand_t
+buxn_jit_pop(buxn_jit_ctx_t* ctx) {
+	return buxn_jit_pop_ex(ctx, buxn_jit_op_flag_2(ctx), buxn_jit_op_flag_r(ctx));
+}
+
+// Load a process-specific address into a register.
+// It is recorded so that the code can be relocated when it is loaded from an
+// image.
+static void
+buxn_jit_emit_reloc(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_reg_t reg,
+	buxn_jit_reloc_type_t type
+) {
+	buxn_jit_reloc_t* reloc = buxn_jit_alloc_reloc(ctx->jit);
+	reloc->type = type;
+	reloc->value = sljit_emit_const(
+		ctx->compiler,
+		SLJIT_MOV,
+		reg, 0,
+		buxn_jit_reloc_value(ctx->jit, type)
+	);
+	reloc->next = ctx->block->relocs;
+	ctx->block->relocs = reloc;
+}
+
+static void
+buxn_jit_queue_resume_point(
+	buxn_jit_ctx_t* ctx,
+	struct sljit_jump* jump,
+	struct sljit_label* bail,
+	struct sljit_label* resume
+) {
+	buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
+	entry->link_type = BUXN_JIT_LINK_RESUME;
+	entry->block = NULL;
+	entry->source = ctx->block;
+	entry->compiler = ctx->compiler;
+	entry->fallback = bail;
+	entry->resume = resume;
+	entry->jump = jump;
+	buxn_jit_enqueue(&ctx->jit->link_queue, entry);
+}
+
+static void
+buxn_jit_take_snapshot(buxn_jit_ctx_t* ctx, buxn_jit_snapshot_t* snapshot) {
+	snapshot->wst_cache = ctx->wst_cache;
+	snapshot->rst_cache = ctx->rst_cache;
+	memcpy(snapshot->mem_values, ctx->mem_values, sizeof(snapshot->mem_values));
+	snapshot->num_mem_values = ctx->num_mem_values;
+	memcpy(snapshot->reg_ref_counts, ctx->reg_ref_counts, sizeof(snapshot->reg_ref_counts));
+	snapshot->mem_base = ctx->mem_base;
+}
+
+static void
+buxn_jit_restore_snapshot(buxn_jit_ctx_t* ctx, const buxn_jit_snapshot_t* snapshot) {
+	ctx->wst_cache = snapshot->wst_cache;
+	ctx->rst_cache = snapshot->rst_cache;
+	memcpy(ctx->mem_values, snapshot->mem_values, sizeof(ctx->mem_values));
+	ctx->num_mem_values = snapshot->num_mem_values;
+	memcpy(ctx->reg_ref_counts, snapshot->reg_ref_counts, sizeof(ctx->reg_ref_counts));
+	ctx->mem_base = snapshot->mem_base;
+}
+
+// Leave the block after a helper call if the block was invalidated by it.
+// Cached stack values are written back before leaving.
+static void
+buxn_jit_resume_point(buxn_jit_ctx_t* ctx) {
+	struct sljit_jump* resume = sljit_emit_jump(
+		ctx->compiler,
+		SLJIT_JUMP | SLJIT_REWRITABLE_JUMP
+	);
+	struct sljit_label* bail = sljit_emit_label(ctx->compiler);
+	if (ctx->wst_cache.len > 0 || ctx->rst_cache.len > 0) {
+		buxn_jit_snapshot_t snapshot;
+		buxn_jit_take_snapshot(ctx, &snapshot);
+		buxn_jit_clear_stack_caches(ctx);
+		buxn_jit_save_state(ctx);
+		sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, ctx->pc);
+		buxn_jit_restore_snapshot(ctx, &snapshot);
+	} else {
+		sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, ctx->pc);
+	}
+	struct sljit_label* resume_label = sljit_emit_label(ctx->compiler);
+	sljit_set_label(resume, resume_label);
+	buxn_jit_queue_resume_point(ctx, resume, bail, resume_label);
+}
+
+// `last` is below `first` when the second byte of a short wrapped around
+static void
+buxn_jit_code_write_helper(sljit_up jit, sljit_u32 first, sljit_u32 last) {
+	if (first <= last) {
+		buxn_jit_invalidate_range((buxn_jit_t*)jit, (uint16_t)first, (uint16_t)last);
+	} else {
+		buxn_jit_invalidate_range((buxn_jit_t*)jit, (uint16_t)first, (uint16_t)first);
+		buxn_jit_invalidate_range((buxn_jit_t*)jit, (uint16_t)last, (uint16_t)last);
+	}
+}
+
+// Check whether a store overwrote compiled code.
+// The store itself has already happened or it is deferred, the block is left
+// right after so that execution continues with freshly compiled code.
+static void
+buxn_jit_guard_code_write(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	bool is_short
+) {
+	// The memory base is borrowed for the code map
+	buxn_jit_reg_t code_map = SLJIT_R(BUXN_JIT_R_MEM_BASE);
+	buxn_jit_emit_reloc(ctx, code_map, BUXN_JIT_RELOC_CODE_MAP);
+	ctx->mem_base = 0;
+
+	// A short written at the end of the zero page or of memory wraps around
+	// to address 0
+	sljit_s32 wrap_op = addr.is_short ? SLJIT_MOV_U16 : SLJIT_MOV_U8;
+	bool is_imm = addr.semantics & BUXN_JIT_SEM_IMM;
+	uint16_t first = addr.const_value;
+	uint16_t last = is_short
+		? (addr.is_short ? (uint16_t)(first + 1) : (uint8_t)(first + 1))
+		: first;
+	if (is_imm) {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_TMP(), 0,
+			SLJIT_MEM1(code_map), first
+		);
+		if (is_short) {
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_OR,
+				BUXN_JIT_TMP(), 0,
+				BUXN_JIT_TMP(), 0,
+				SLJIT_MEM1(code_map), last
+			);
+		}
+	} else {
+		// The memory offset still points at the first written byte
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_TMP(), 0,
+			SLJIT_MEM2(code_map, BUXN_JIT_MEM_OFFSET()), 0
+		);
+		if (is_short) {
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_ADD,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				SLJIT_IMM, 1
+			);
+			sljit_emit_op1(
+				ctx->compiler,
+				wrap_op,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				BUXN_JIT_MEM_OFFSET(), 0
+			);
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_OR,
+				BUXN_JIT_TMP(), 0,
+				BUXN_JIT_TMP(), 0,
+				SLJIT_MEM2(code_map, BUXN_JIT_MEM_OFFSET()), 0
+			);
+		}
+	}
+	struct sljit_jump* no_code = sljit_emit_cmp(
+		ctx->compiler,
+		SLJIT_EQUAL,
+		BUXN_JIT_TMP(), 0,
+		SLJIT_IMM, 0
+	);
+#if BUXN_JIT_VERBOSE
+	int label_id = ctx->label_id++;
+	fprintf(stderr, "  ; jump => label%d\n", label_id);
+#endif
+
+	// Side exit: the cached state must be kept intact for the fast path
+	buxn_jit_snapshot_t snapshot;
+	buxn_jit_take_snapshot(ctx, &snapshot);
+	buxn_jit_stack_cache_flush(ctx, &ctx->wst_cache);
+	buxn_jit_stack_cache_flush(ctx, &ctx->rst_cache);
+	buxn_jit_mem_values_clear(ctx);
+
+	if (is_imm) {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV32,
+			SLJIT_R1, 0,
+			SLJIT_IMM, first
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV32,
+			SLJIT_R2, 0,
+			SLJIT_IMM, last
+		);
+	} else {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U16,
+			SLJIT_R1, 0,
+			addr.reg, 0
+		);
+		if (is_short) {
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_ADD,
+				SLJIT_R2, 0,
+				SLJIT_R1, 0,
+				SLJIT_IMM, 1
+			);
+			sljit_emit_op1(
+				ctx->compiler,
+				wrap_op,
+				SLJIT_R2, 0,
+				SLJIT_R2, 0
+			);
+		} else {
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV,
+				SLJIT_R2, 0,
+				SLJIT_R1, 0
+			);
+		}
+	}
+	buxn_jit_emit_reloc(ctx, SLJIT_R0, BUXN_JIT_RELOC_JIT);
+	buxn_jit_emit_reloc(ctx, SLJIT_R3, BUXN_JIT_RELOC_CODE_WRITE);
+	sljit_emit_icall(
+		ctx->compiler,
+		SLJIT_CALL,
+		SLJIT_ARGS3V(P, 32, 32),
+		SLJIT_R3, 0
+	);
+	sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, ctx->pc);
+
+	buxn_jit_restore_snapshot(ctx, &snapshot);
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; label%d:\n", label_id);
+#endif
+	sljit_set_label(no_code, sljit_emit_label(ctx->compiler));
+}
+
+static buxn_jit_operand_t
+buxn_jit_load(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_reg_t reg,
+	buxn_jit_operand_t addr
+) {
+	buxn_jit_operand_t result = {
+		.is_short = buxn_jit_op_flag_2(ctx),
+		.reg = reg,
+	};
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; r%d = load(addr=r%d(0x%04x), flag_2=%d)\n",
+		result.reg - SLJIT_R0,
+		addr.reg - SLJIT_R0,
+		addr.const_value,
+		result.is_short
+	);
+#endif
+
+	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U16,
+		BUXN_JIT_MEM_OFFSET(), 0,
+		addr.reg, 0
+	);
+	if (!result.is_short) {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			result.reg, 0,
+			BUXN_JIT_MEM(), 0
+		);
+		return result;
+	}
+
+	struct sljit_jump* wrap = NULL;
+	struct sljit_jump* done = NULL;
+	sljit_sw last = addr.is_short ? 0xffff : 0xff;
+	bool is_imm = addr.semantics & BUXN_JIT_SEM_IMM;
+	if (!is_imm) {
+		wrap = sljit_emit_cmp(
+			ctx->compiler,
+			SLJIT_EQUAL,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			SLJIT_IMM, last
+		);
+	}
+	if (!is_imm || addr.const_value != last) {
+		buxn_jit_emit_load_u16(ctx, result.reg, BUXN_JIT_MEM(), 0);
+		if (wrap == NULL) { return result; }
+
+		done = sljit_emit_jump(ctx->compiler, SLJIT_JUMP);
+		sljit_set_label(wrap, sljit_emit_label(ctx->compiler));
+	}
+
+	// The low byte wraps around to address 0
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U8,
+		result.reg, 0,
+		BUXN_JIT_MEM(), 0
+	);
+	sljit_emit_op2(
+		ctx->compiler,
+		SLJIT_SHL,
+		result.reg, 0,
+		result.reg, 0,
+		SLJIT_IMM, 8
+	);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U8,
+		BUXN_JIT_TMP(), 0,
+		SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), 0
+	);
+	sljit_emit_op2(
+		ctx->compiler,
+		SLJIT_OR,
+		result.reg, 0,
+		result.reg, 0,
+		BUXN_JIT_TMP(), 0
+	);
+	if (done != NULL) {
+		sljit_set_label(done, sljit_emit_label(ctx->compiler));
+	}
+
+	return result;
+}
+
+static void
+buxn_jit_store(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	buxn_jit_operand_t value
+) {
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; store(addr=r%d(0x%04x), value=r%d, flag_2=%d)\n",
+		addr.reg - SLJIT_R0,
+		addr.const_value,
+		value.reg - SLJIT_R0,
+		value.is_short
+	);
+#endif
+
+	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U16,
+		BUXN_JIT_MEM_OFFSET(), 0,
+		addr.reg, 0
+	);
+
+	if (value.is_short) {
+		struct sljit_jump* wrap = NULL;
+		struct sljit_jump* done = NULL;
+		sljit_sw last = addr.is_short ? 0xffff : 0xff;
+		bool is_imm = addr.semantics & BUXN_JIT_SEM_IMM;
+		if (!is_imm) {
+			wrap = sljit_emit_cmp(
+				ctx->compiler,
+				SLJIT_EQUAL,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				SLJIT_IMM, last
+			);
+		}
+		if (!is_imm || addr.const_value != last) {
+			buxn_jit_emit_store_u16(ctx, value.reg, 0, BUXN_JIT_MEM(), 0);
+			if (wrap != NULL) {
+				done = sljit_emit_jump(ctx->compiler, SLJIT_JUMP);
+				sljit_set_label(wrap, sljit_emit_label(ctx->compiler));
+			}
+		}
+
+		if (!is_imm || addr.const_value == last) {
+			// The low byte wraps around to address 0
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_LSHR,
+				BUXN_JIT_TMP(), 0,
+				value.reg, 0,
+				SLJIT_IMM, 8
+			);
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U8,
+				BUXN_JIT_MEM(), 0,
+				BUXN_JIT_TMP(), 0
+			);
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U8,
+				SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), 0,
+				value.reg, 0
+			);
+		}
+		if (done != NULL) {
+			sljit_set_label(done, sljit_emit_label(ctx->compiler));
+		}
+	} else {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM(), 0,
+			value.reg, 0
+		);
+	}
+
+	buxn_jit_guard_code_write(ctx, addr, value.is_short);
+}
+
+static bool
+buxn_jit_mem_value_overlaps(
+	const buxn_jit_mem_value_t* value,
+	uint16_t addr,
+	bool is_short
+) {
+	int lo = addr;
+	int hi = addr + (is_short ? 1 : 0);
+	int value_hi = value->addr + (value->is_short ? 1 : 0);
+	return lo <= value_hi && value->addr <= hi;
+}
+
+// Write a deferred store back to memory and drop the value.
+// The register is clobbered and neither the memory base nor TMP is touched so
+// that it can be done in the middle of an opcode.
+static void
+buxn_jit_mem_value_remove(buxn_jit_ctx_t* ctx, uint8_t index) {
+	buxn_jit_mem_value_t value = ctx->mem_values[index];
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; mem_value_remove(addr=0x%04x, reg=r%d, flag_2=%d, dirty=%d)\n",
+		value.addr,
+		value.reg - SLJIT_R0,
+		value.is_short,
+		value.dirty
+	);
+#endif
+	if (value.dirty) {
+		sljit_sw offset = SLJIT_OFFSETOF(buxn_vm_t, memory) + value.addr;
+		if (value.is_short) {
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U8,
+				SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), offset + 1,
+				value.reg, 0
+			);
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_LSHR,
+				value.reg, 0,
+				value.reg, 0,
+				SLJIT_IMM, 8
+			);
+		}
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), offset,
+			value.reg, 0
+		);
+	}
+
+	buxn_jit_release_reg(ctx, value.reg);
+	ctx->mem_values[index] = ctx->mem_values[--ctx->num_mem_values];
+}
+
+static bool
+buxn_jit_mem_values_evict(buxn_jit_ctx_t* ctx) {
+	if (ctx->num_mem_values == 0) { return false; }
+
+	buxn_jit_mem_value_remove(ctx, 0);
+	return true;
+}
+
+// Memory must be up to date before it can be accessed by anything else
+static void
+buxn_jit_mem_values_clear(buxn_jit_ctx_t* ctx) {
+	while (buxn_jit_mem_values_evict(ctx)) { }
+}
+
+// Drop the values overlapping a range of memory.
+// Deferred stores which are entirely overwritten are never written back.
+static void
+buxn_jit_mem_values_forget(
+	buxn_jit_ctx_t* ctx,
+	uint16_t addr,
+	bool is_short,
+	bool overwritten
+) {
+	for (int i = ctx->num_mem_values - 1; i >= 0; --i) {
+		buxn_jit_mem_value_t* value = &ctx->mem_values[i];
+		if (!buxn_jit_mem_value_overlaps(value, addr, is_short)) { continue; }
+
+		if (
+			overwritten
+			&&
+			value->dirty
+			&&
+			value->addr >= addr
+			&&
+			value->addr + (value->is_short ? 1 : 0) <= addr + (is_short ? 1 : 0)
+		) {
+			value->dirty = false;
+			ctx->jit->stats.num_dead_stores += 1;
+		}
+		buxn_jit_mem_value_remove(ctx, (uint8_t)i);
+	}
+}
+
+static void
+buxn_jit_mem_values_remember(
+	buxn_jit_ctx_t* ctx,
+	uint16_t addr,
+	buxn_jit_operand_t value,
+	bool dirty
+) {
+	// Popped registers may be modified in place so the value gets its own copy
+	buxn_jit_reg_t reg = buxn_jit_alloc_reg(ctx);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV,
+		reg, 0,
+		value.reg, 0
+	);
+	if (ctx->num_mem_values == BUXN_JIT_MAX_MEM_VALUES) {
+		buxn_jit_mem_values_evict(ctx);
+	}
+
+	ctx->mem_values[ctx->num_mem_values++] = (buxn_jit_mem_value_t){
+		.addr = addr,
+		.is_short = value.is_short,
+		.dirty = dirty,
+		.reg = reg,
+	};
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; mem_value_remember(addr=0x%04x, reg=r%d, flag_2=%d, dirty=%d)\n",
+		addr,
+		reg - SLJIT_R0,
+		value.is_short,
+		dirty
+	);
+#endif
+}
+
+// Whether the operand is a literal address and the access does not wrap around
+static bool
+buxn_jit_is_fixed_addr(buxn_jit_ctx_t* ctx, buxn_jit_operand_t addr) {
+	int last = addr.const_value + (buxn_jit_op_flag_2(ctx) ? 1 : 0);
+	return (addr.semantics & BUXN_JIT_SEM_IMM)
+		&& last <= (addr.is_short ? 0xffff : 0xff);
+}
+
+// A load which may be served by an earlier load or store of the same address
+static buxn_jit_operand_t
+buxn_jit_load_var(buxn_jit_ctx_t* ctx, buxn_jit_operand_t addr) {
+	if (!buxn_jit_is_fixed_addr(ctx, addr)) {
+		buxn_jit_mem_values_clear(ctx);
+		return buxn_jit_load(ctx, buxn_jit_alloc_reg(ctx), addr);
+	}
+
+	// Allocating may evict the value being looked up
+	buxn_jit_operand_t result = {
+		.is_short = buxn_jit_op_flag_2(ctx),
+		.reg = buxn_jit_alloc_reg(ctx),
+	};
+	for (uint8_t i = 0; i < ctx->num_mem_values; ++i) {
+		buxn_jit_mem_value_t* value = &ctx->mem_values[i];
+		if (value->addr == addr.const_value && value->is_short == result.is_short) {
+#if BUXN_JIT_VERBOSE
+			fprintf(
+				stderr,
+				"  ; r%d = forward(addr=0x%04x, reg=r%d)\n",
+				result.reg - SLJIT_R0,
+				addr.const_value,
+				value->reg - SLJIT_R0
+			);
+#endif
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV,
+				result.reg, 0,
+				value->reg, 0
+			);
+			ctx->jit->stats.num_forwarded_loads += 1;
+			return result;
+		}
+	}
+
+	buxn_jit_mem_values_forget(ctx, addr.const_value, result.is_short, false);
+	result = buxn_jit_load(ctx, result.reg, addr);
+	buxn_jit_mem_values_remember(ctx, addr.const_value, result, false);
+	return result;
+}
+
+// A store which is kept in a register until the end of the block when it
+// targets a fixed zero page address
+static void
+buxn_jit_store_var(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	buxn_jit_operand_t value
+) {
+	if (!buxn_jit_is_fixed_addr(ctx, addr)) {
+		buxn_jit_mem_values_clear(ctx);
+		buxn_jit_store(ctx, addr, value);
+		return;
+	}
+
+	bool deferred = addr.const_value + (value.is_short ? 1 : 0) <= 0xff;
+	buxn_jit_mem_values_forget(ctx, addr.const_value, value.is_short, deferred);
+	if (!deferred) {
+		buxn_jit_store(ctx, addr, value);
+	}
+	buxn_jit_mem_values_remember(ctx, addr.const_value, value, deferred);
+	// The zero page may hold code too, the side exit writes the value back
+	if (deferred) {
+		buxn_jit_guard_code_write(ctx, addr, value.is_short);
+	}
+}
+
+static void
+buxn_jit_load_state(buxn_jit_ctx_t* ctx) {
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U8,
+		SLJIT_S(BUXN_JIT_S_WSP), 0,
+		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, wsp)
+	);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U8,
+		SLJIT_S(BUXN_JIT_S_RSP), 0,
+		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, rsp)
+	);
+}
+
+static void
+buxn_jit_save_state(buxn_jit_ctx_t* ctx) {
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U8,
+		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, wsp),
+		SLJIT_S(BUXN_JIT_S_WSP), 0
+	);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U8,
+		SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), SLJIT_OFFSETOF(buxn_vm_t, rsp),
+		SLJIT_S(BUXN_JIT_S_RSP), 0
+	);
+}
+
+// Blocks jump into each other's bodies so they must all share the same frame.
+// It holds a slot for every stack cache cell.
+static sljit_s32
+buxn_jit_frame_size(buxn_jit_ctx_t* ctx) {
+	return (sljit_s32)ctx->cache_size * 2 * (sljit_s32)sizeof(sljit_sw);
+}
+
+// sljit-specific fast calling convention
+static void
+buxn_jit_fast_enter(buxn_jit_ctx_t* ctx) {
+	sljit_emit_enter(
+		ctx->compiler,
+		SLJIT_ENTER_KEEP(BUXN_JIT_S_COUNT) | SLJIT_ENTER_REG_ARG,
+		SLJIT_ARGS0(32),
+		BUXN_JIT_R_COUNT,
+		BUXN_JIT_S_COUNT,
+		buxn_jit_frame_size(ctx)
+	);
+}
+
+// Indirect jumps compare their target against a few remembered ones before
+// going through a helper.
+// The stack cache must be empty.
+static void
+buxn_jit_inline_cache(buxn_jit_ctx_t* ctx, buxn_jit_operand_t target) {
+	uint16_t ic_site = ctx->num_ic_sites++;
+	struct sljit_label* miss = NULL;
+	struct sljit_jump* hits[BUXN_JIT_IC_SIZE];
+	struct sljit_const* keys[BUXN_JIT_IC_SIZE];
+	for (int i = 0; i < BUXN_JIT_IC_SIZE; ++i) {
+		// An empty entry never matches
+		keys[i] = sljit_emit_const(ctx->compiler, SLJIT_MOV, BUXN_JIT_TMP(), 0, -1);
+		hits[i] = sljit_emit_cmp(
+			ctx->compiler,
+			SLJIT_EQUAL | SLJIT_REWRITABLE_JUMP,
+			target.reg, 0,
+			BUXN_JIT_TMP(), 0
+		);
+	}
+
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; inline cache miss\n");
+#endif
+	miss = sljit_emit_label(ctx->compiler);
+	for (int i = 0; i < BUXN_JIT_IC_SIZE; ++i) {
+		sljit_set_label(hits[i], miss);
+
+		buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
+		entry->link_type = BUXN_JIT_LINK_IC;
+		entry->block = NULL;
+		entry->source = ctx->block;
+		entry->compiler = ctx->compiler;
+		entry->fallback = miss;
+		entry->key = keys[i];
+		entry->ic_site = ic_site;
+		entry->ic_slot = (uint8_t)i;
+		entry->jump = hits[i];
+		buxn_jit_enqueue(&ctx->jit->link_queue, entry);
+	}
+
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV,
+		SLJIT_R2, 0,
+		target.reg, 0
+	);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV32,
+		SLJIT_R1, 0,
+		SLJIT_IMM, (sljit_sw)(
+			(uint32_t)ic_site << 21
+			| (uint32_t)ctx->block->shape << 16
+			| ctx->block->key
+		)
+	);
+	buxn_jit_emit_reloc(ctx, SLJIT_R0, BUXN_JIT_RELOC_JIT);
+	buxn_jit_emit_reloc(ctx, SLJIT_R3, BUXN_JIT_RELOC_IC_MISS);
+	sljit_emit_icall(
+		ctx->compiler,
+		SLJIT_CALL,
+		SLJIT_ARGS3(W, P, 32, 32),
+		SLJIT_R3, 0
+	);
+	struct sljit_jump* leave = sljit_emit_cmp(
+		ctx->compiler,
+		SLJIT_LESS_EQUAL,
+		SLJIT_R0, 0,
+		SLJIT_IMM, 0xffff
+	);
+	sljit_emit_ijump(ctx->compiler, SLJIT_JUMP, SLJIT_R0, 0);
+	sljit_set_label(leave, sljit_emit_label(ctx->compiler));
+	sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_R0, 0);
+}
+
+// The loop header at the given address if it was already compiled
+static buxn_jit_insn_t*
+buxn_jit_loop_header_at(buxn_jit_ctx_t* ctx, uint16_t addr) {
+	for (uint16_t i = 0; i < ctx->num_insns; ++i) {
+		buxn_jit_insn_t* insn = &ctx->insns[i];
+		if (insn->pc == addr) {
+			return insn->loop_header && insn->label != NULL ? insn : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+// Leave at most BUXN_JIT_MAX_HANDOFF values in the working stack cache
+static void
+buxn_jit_stack_cache_trim(buxn_jit_ctx_t* ctx) {
+	buxn_jit_stack_cache_t* cache = &ctx->wst_cache;
+	// Values which are already in memory must not be pushed again by the
+	// target
+	while (
+		cache->len > 0
+		&&
+		(
+			cache->len > BUXN_JIT_MAX_HANDOFF
+			||
+			!buxn_jit_stack_cache_at(ctx, cache, 0)->need_flush
+		)
+	) {
+		buxn_jit_stack_cache_spill(ctx, cache);
+	}
+}
+
+// Write back the stack caches before a jump.
+// An immediate jump to a compiled block keeps the top of the working stack
+// cache so that it can be passed in registers.
+static void
+buxn_jit_prepare_jump(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t target,
+	uint16_t return_addr
+) {
+	buxn_jit_mem_values_clear(ctx);
+	buxn_jit_stack_cache_clear(ctx, &ctx->rst_cache);
+
+	bool is_imm = (target.semantics & (BUXN_JIT_SEM_IMM_JMP | BUXN_JIT_SEM_IMM))
+		&& return_addr == 0;
+	uint16_t addr = target.is_short
+		? target.const_value
+		: (uint16_t)(ctx->pc + (int8_t)target.const_value);
+	bool can_hand_off = is_imm
+		&& (
+			buxn_jit_loop_header_at(ctx, addr) != NULL
+			||
+			(
+				target.is_short
+				&& target.const_value >= BUXN_RESET_VECTOR
+				&& (
+					ctx->jit->config.hot_threshold == 0
+					||
+					buxn_jit_find_block(ctx->jit, target.const_value)->fn != NULL
+				)
+			)
+		);
+	if (!can_hand_off) {
+		buxn_jit_stack_cache_clear(ctx, &ctx->wst_cache);
+		return;
+	}
+
+	buxn_jit_stack_cache_trim(ctx);
+}
+
+// The number of cached working stack values and which of them are shorts,
+// bottom first
+static uint8_t
+buxn_jit_stack_cache_shape(buxn_jit_ctx_t* ctx) {
+	buxn_jit_stack_cache_t* cache = &ctx->wst_cache;
+	uint8_t shape = cache->len;
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		if (buxn_jit_stack_cache_at(ctx, cache, i)->value.is_short) {
+			shape |= 1 << (2 + i);
+		}
+	}
+	return shape;
+}
+
+// Move the working stack cache into the registers a variant expects.
+// The cache itself is kept for the code after a conditional jump.
+static void
+buxn_jit_hand_off(buxn_jit_ctx_t* ctx) {
+	buxn_jit_stack_cache_t* cache = &ctx->wst_cache;
+	sljit_s32 srcs[BUXN_JIT_MAX_HANDOFF];
+	sljit_sw srcws[BUXN_JIT_MAX_HANDOFF];
+	bool pending[BUXN_JIT_MAX_HANDOFF];
+	uint8_t num_pending = 0;
+	for (uint8_t i = 0; i < cache->len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		if (cell->in_slot) {
+			srcs[i] = SLJIT_MEM1(SLJIT_SP);
+			srcws[i] = buxn_jit_stack_cache_slot(ctx, cache, cell);
+		} else {
+			srcs[i] = cell->value.reg;
+			srcws[i] = 0;
+		}
+		pending[i] = srcs[i] != SLJIT_R(BUXN_JIT_R_OP_MIN + i);
+		num_pending += pending[i];
+	}
+
+	// Parallel move: a register is only overwritten once nothing reads it
+	while (num_pending > 0) {
+		bool progress = false;
+		for (uint8_t i = 0; i < cache->len; ++i) {
+			if (!pending[i]) { continue; }
+
+			sljit_s32 dst = SLJIT_R(BUXN_JIT_R_OP_MIN + i);
+			bool blocked = false;
+			for (uint8_t j = 0; j < cache->len; ++j) {
+				blocked |= j != i && pending[j] && srcs[j] == dst;
+			}
+			if (blocked) { continue; }
+
+			sljit_emit_op1(ctx->compiler, SLJIT_MOV, dst, 0, srcs[i], srcws[i]);
+			pending[i] = false;
+			num_pending -= 1;
+			progress = true;
+		}
+
+		if (!progress) {
+			// Break a cycle through the temporary register
+			for (uint8_t i = 0; i < cache->len; ++i) {
+				if (!pending[i] || (srcs[i] & SLJIT_MEM)) { continue; }
+
+				sljit_s32 reg = srcs[i];
+				sljit_emit_op1(ctx->compiler, SLJIT_MOV, BUXN_JIT_TMP(), 0, reg, 0);
+				for (uint8_t j = 0; j < cache->len; ++j) {
+					if (pending[j] && srcs[j] == reg) { srcs[j] = BUXN_JIT_TMP(); }
+				}
+				break;
+			}
+		}
+	}
+}
+
+// A variant starts with the values passed by the jumps into it
+static void
+buxn_jit_enter_variant(buxn_jit_ctx_t* ctx, uint8_t shape) {
+	buxn_jit_stack_cache_t* cache = &ctx->wst_cache;
+	uint8_t len = shape & 0x3;
+	for (uint8_t i = 0; i < len; ++i) {
+		bool is_short = (shape >> (2 + i)) & 1;
+		*buxn_jit_stack_cache_at(ctx, cache, cache->len++) = (buxn_jit_stack_cache_cell_t){
+			.value = {
+				.is_short = is_short,
+				.reg = SLJIT_R(BUXN_JIT_R_OP_MIN + i),
+			},
+			.need_flush = true,
+		};
+		ctx->wsp += is_short ? 2 : 1;
+	}
+}
+
+// Jump into a variant of the target which takes over the working stack cache
+static void
+buxn_jit_jump_variant(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t target,
+	uint8_t shape
+) {
+	buxn_jit_hand_off(ctx);
+	struct sljit_jump* jump = sljit_emit_jump(
+		ctx->compiler,
+		SLJIT_JUMP | SLJIT_REWRITABLE_JUMP
+	);
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; jump => here (shape=0x%02x)\n", shape);
+#endif
+	// Until the variant is linked, write the values back and go through the
+	// trampoline
+	struct sljit_label* fallback = sljit_emit_label(ctx->compiler);
+	sljit_set_label(jump, fallback);
+
+	buxn_jit_stack_cache_t handed_off = { .len = ctx->wst_cache.len };
+	for (uint8_t i = 0; i < handed_off.len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, &ctx->wst_cache, i);
+		handed_off.cells[i] = (buxn_jit_stack_cache_cell_t){
+			.value = {
+				.is_short = cell->value.is_short,
+				.reg = SLJIT_R(BUXN_JIT_R_OP_MIN + i),
+			},
+			.need_flush = true,
+		};
+	}
+	sljit_sw mem_base = ctx->mem_base;
+	buxn_jit_stack_cache_flush(ctx, &handed_off);
+	ctx->mem_base = mem_base;
+	sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, target.const_value);
+
+	buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
+	entry->link_type = BUXN_JIT_LINK_TO_BODY;
+	entry->block = buxn_jit_link_variant(ctx->jit, target.const_value, shape);
+	entry->source = ctx->block;
+	entry->compiler = ctx->compiler;
+	entry->fallback = fallback;
+	entry->jump = jump;
+	buxn_jit_enqueue(&ctx->jit->link_queue, entry);
+}
+
+// Loop headers start from a fixed state so that back edges can jump straight
+// to them.
+// The working stack cache is where a variant would expect it, the return
+// stack cache is empty and the memory base points at RAM.
+static void
+buxn_jit_loop_header(buxn_jit_ctx_t* ctx, buxn_jit_insn_t* insn) {
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; Loop header 0x%04x {{{\n", insn->pc);
+#endif
+	buxn_jit_mem_values_clear(ctx);
+	buxn_jit_stack_cache_clear(ctx, &ctx->rst_cache);
+	buxn_jit_stack_cache_trim(ctx);
+	buxn_jit_hand_off(ctx);
+
+	buxn_jit_stack_cache_t* cache = &ctx->wst_cache;
+	buxn_jit_stack_cache_t header = { .len = cache->len };
+	for (uint8_t i = 0; i < header.len; ++i) {
+		buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, cache, i);
+		header.cells[i] = (buxn_jit_stack_cache_cell_t){
+			.value = {
+				.is_short = cell->value.is_short,
+				.reg = SLJIT_R(BUXN_JIT_R_OP_MIN + i),
+			},
+			.need_flush = true,
+		};
+	}
+	*cache = header;
+	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+
+	// Nothing is known about the values of later iterations
+	memset(ctx->wst, 0, sizeof(ctx->wst));
+	memset(ctx->rst, 0, sizeof(ctx->rst));
+
+	insn->shape = buxn_jit_stack_cache_shape(ctx);
+	insn->label = sljit_emit_label(ctx->compiler);
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; }}} (shape=0x%02x)\n", insn->shape);
+#endif
+}
+
+// Go back to a loop header in the same block without writing anything back
+// to the VM
+static void
+buxn_jit_loop_back_edge(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* header) {
+	buxn_jit_hand_off(ctx);
+	sljit_sw mem_base = ctx->mem_base;
+	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+	ctx->mem_base = mem_base;
+	sljit_set_label(sljit_emit_jump(ctx->compiler, SLJIT_JUMP), header->label);
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; jump => loop 0x%04x\n", header->pc);
+#endif
+	ctx->jit->stats.num_loops += 1;
+}
+
+static void
+buxn_jit_jump_abs(buxn_jit_ctx_t* ctx, buxn_jit_operand_t target, uint16_t return_addr) {
+	struct sljit_jump* exit = NULL;
+	struct sljit_label* bail = NULL;
+#if BUXN_JIT_VERBOSE
+	int exit_id = 0;
+#endif
+
+	// The fallback of an unlinked call returns the target.
+	// For a call to the very next instruction, that cannot be told apart from
+	// its return so such a call always goes through the trampoline.
+	bool is_linkable = (target.semantics & BUXN_JIT_SEM_CONST)
+		&& (return_addr == 0 || return_addr != target.const_value);
+	if (is_linkable) {
+		buxn_jit_insn_t* header = return_addr == 0
+			&& (target.semantics & (BUXN_JIT_SEM_IMM_JMP | BUXN_JIT_SEM_IMM))
+			? buxn_jit_loop_header_at(ctx, target.const_value)
+			: NULL;
+		if (header != NULL && buxn_jit_stack_cache_shape(ctx) == header->shape) {
+			buxn_jit_loop_back_edge(ctx, header);
+			return;
+		}
+
+		if (return_addr == 0 && ctx->wst_cache.len > 0) {
+			buxn_jit_jump_variant(ctx, target, buxn_jit_stack_cache_shape(ctx));
+			return;
+		} else if (return_addr == 0) {
+			struct sljit_jump* jump;
+
+			if (target.semantics & (BUXN_JIT_SEM_IMM_JMP | BUXN_JIT_SEM_IMM)) {
+				jump = sljit_emit_jump(
+					ctx->compiler,
+					SLJIT_JUMP | SLJIT_REWRITABLE_JUMP
+				);
+			} else {
+				// Recheck assumed constant value before jumping
+				jump = sljit_emit_cmp(
+					ctx->compiler,
+					SLJIT_EQUAL | SLJIT_REWRITABLE_JUMP,
+					target.reg, 0,
+					SLJIT_IMM, target.const_value
+				);
+			}
+#if BUXN_JIT_VERBOSE
+			fprintf(stderr, "  ; jump => here\n");
+#endif
+			// Until the target is linked, fall through to the trampoline
+			struct sljit_label* fallback = sljit_emit_label(ctx->compiler);
+			sljit_set_label(jump, fallback);
+
+			buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
+			entry->link_type = BUXN_JIT_LINK_TO_BODY;
+			entry->block = buxn_jit_link_target(ctx->jit, target.const_value);
+			entry->source = ctx->block;
+			entry->compiler = ctx->compiler;
+			entry->fallback = fallback;
+			entry->jump = jump;
+			buxn_jit_enqueue(&ctx->jit->link_queue, entry);
+		} else {
+			struct sljit_jump* skip_call = NULL;
+#if BUXN_JIT_VERBOSE
+			int skip_id = 0;
+#endif
+			if ((target.semantics & (BUXN_JIT_SEM_IMM_JMP | BUXN_JIT_SEM_IMM)) == 0) {
+				// Recheck assumed constant value before calling
+				skip_call = sljit_emit_cmp(
+					ctx->compiler,
+					SLJIT_NOT_EQUAL,
+					target.reg, 0,
+					SLJIT_IMM, target.const_value
+				);
+#if BUXN_JIT_VERBOSE
+				skip_id = ctx->label_id++;
+				fprintf(stderr, "  ; jump => label%d\n", skip_id);
+#endif
+			}
+
+			// This is because we can return from this call and continue execution
+			// The target is compiled by a different buxn_jit_ctx_t so upon return,
+			// the cached states will be invalid.
+			//
+			// Other remote jumps do not have to care about cache invalidation
+			// since execution will never return to this function.
+			ctx->mem_base = 0;
+			struct sljit_jump* call = sljit_emit_call(
+				ctx->compiler,
+				SLJIT_CALL_REG_ARG | SLJIT_REWRITABLE_JUMP,
+				SLJIT_ARGS0(32)
+			);
+
+			// If the return address is not as expected, trampoline
+			exit = sljit_emit_cmp(
+				ctx->compiler,
+				SLJIT_EQUAL | SLJIT_REWRITABLE_JUMP,
+				SLJIT_R0, 0,
+				SLJIT_IMM, return_addr
+			);
+#if BUXN_JIT_VERBOSE
+			exit_id = ctx->label_id++;
+			fprintf(stderr, "  ; jump => label%d\n", exit_id);
+#endif
+			bail = sljit_emit_label(ctx->compiler);
+			sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_R0, 0);
+
+			// Fallback callee for when the target is not linked.
+			// It returns the target address which mismatches the return
+			// address so the call is completed through the trampoline.
+			struct sljit_label* fallback = sljit_emit_label(ctx->compiler);
+			sljit_set_label(call, fallback);
+			buxn_jit_fast_enter(ctx);
+			sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, target.const_value);
+
+			if (skip_call != NULL) {
+#if BUXN_JIT_VERBOSE
+				fprintf(stderr, "  ; label%d:\n", skip_id);
+#endif
+				sljit_set_label(skip_call, sljit_emit_label(ctx->compiler));
+			}
+
+			buxn_jit_entry_t* entry = buxn_jit_alloc_entry(ctx->jit);
+			entry->link_type = BUXN_JIT_LINK_TO_HEAD;
+			entry->block = buxn_jit_link_target(ctx->jit, target.const_value);
+			entry->source = ctx->block;
+			entry->compiler = ctx->compiler;
+			entry->fallback = fallback;
+			entry->jump = call;
+			buxn_jit_enqueue(&ctx->jit->link_queue, entry);
+		}
+	} else if (
+		(target.semantics & BUXN_JIT_SEM_CONST) == 0
+		&&
+		(ctx->current_opcode & 0x5f) != 0x4c
+		&&
+		ctx->num_ic_sites < BUXN_JIT_MAX_IC_SITES
+	) {
+		// JMPr is most likely a return, it goes back to the native caller
+		// through the trampoline instead
+		buxn_jit_inline_cache(ctx, target);
+		return;
+	}
+
+	// Return to trampoline.
+	// This is always correct but slow.
+	sljit_emit_return(ctx->compiler, SLJIT_MOV32, target.reg, 0);
+
+	if (exit != NULL) {
+#if BUXN_JIT_VERBOSE
+		fprintf(stderr, "  ; label%d:\n", exit_id);
+#endif
+		struct sljit_label* resume = sljit_emit_label(ctx->compiler);
+		sljit_set_label(exit, resume);
+		// Returning the return address also resumes at the right place
+		// if this block is invalidated during the call
+		buxn_jit_queue_resume_point(ctx, exit, bail, resume);
+	}
+}
+
+static void
+buxn_jit_jump(buxn_jit_ctx_t* ctx, buxn_jit_operand_t target, uint16_t return_addr) {
+	buxn_jit_prepare_jump(ctx, target, return_addr);
+
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; jump(reg=r%d, addr=0x%04x, short=%d, return_addr=0x%04x)\n",
+		target.reg - SLJIT_R0,
+		target.const_value,
+		target.is_short,
+		return_addr
+	);
+#endif
+
+	if (target.is_short) {
+		buxn_jit_jump_abs(ctx, target, return_addr);
+	} else {
+		if (target.semantics & BUXN_JIT_SEM_BOOLEAN) {
+			// Save the compiler to ensure that finalization will not happen
+			// due to the next opcode
+			struct sljit_compiler* compiler = ctx->compiler;
+			struct sljit_jump* skip_next_opcode = sljit_emit_cmp(
+				ctx->compiler,
+				SLJIT_NOT_EQUAL,
+				target.reg, 0,
+				SLJIT_IMM, 0
+			);
+#if BUXN_JIT_VERBOSE
+	int label_id = ctx->label_id++;
+	fprintf(stderr, "  ; jump => label%d\n", label_id);
+#endif
+
+			buxn_jit_next_opcode(ctx);
+
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; label%d:\n", label_id);
+#endif
+			// Continue, regardless of the opcode after this
+			ctx->compiler = compiler;
+			// In case the previous opcode was executed, clear the stack cache
+			// so that the next opcode starts in a consistent state for both
+			// true and false branches
+			buxn_jit_clear_stack_caches(ctx);
+			sljit_set_label(skip_next_opcode, sljit_emit_label(ctx->compiler));
+		} else {
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_S8,
+				target.reg, 0,
+				target.reg, 0
+			);
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_ADD,
+				target.reg, 0,
+				target.reg, 0,
+				SLJIT_IMM, ctx->pc
+			);
+			target.const_value = (uint16_t)((int32_t)ctx->pc + (int32_t)(int8_t)target.const_value);
+
+			buxn_jit_jump_abs(ctx, target, return_addr);
+		}
+	}
+}
+
+// Jump to the target unless skip_jump was taken
+static void
+buxn_jit_jump_unless(
+	buxn_jit_ctx_t* ctx,
+	struct sljit_jump* skip_jump,
+	buxn_jit_operand_t target
+) {
+#if BUXN_JIT_VERBOSE
+	int label_id = ctx->label_id++;
+	fprintf(stderr, "  ; jump => label%d\n", label_id);
+#endif
+
+	buxn_jit_jump(ctx, target, 0);
+
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; label%d:\n", label_id);
+#endif
+	sljit_set_label(skip_jump, sljit_emit_label(ctx->compiler));
+}
+
+static void
+buxn_jit_conditional_jump(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t condition,
+	buxn_jit_operand_t target
+) {
+	buxn_jit_prepare_jump(ctx, target, 0);
+
+	sljit_emit_op2u(
+		ctx->compiler,
+		SLJIT_AND | SLJIT_SET_Z,
+		condition.reg, 0,
+		SLJIT_IMM, 0xff
+	);
+
+	struct sljit_jump* skip_jump = sljit_emit_jump(ctx->compiler, SLJIT_ZERO);
+	buxn_jit_jump_unless(ctx, skip_jump, target);
+}
+
+static void
+buxn_jit_finalize(buxn_jit_ctx_t* ctx) {
+	ctx->compiler = NULL;
+}
+
+// Read a byte of the code being compiled
+static inline uint8_t
+buxn_jit_peek(const buxn_jit_ctx_t* ctx, uint16_t addr) {
+	BUXN_JIT_ASSERT(
+		(uint16_t)(addr - ctx->memory_base) <= ctx->memory_end - ctx->memory_base,
+		"Read past the copied bytes"
+	);
+	return ctx->memory[(uint16_t)(addr - ctx->memory_base)];
+}
+
+static buxn_jit_operand_t
+buxn_jit_immediate(buxn_jit_ctx_t* ctx, bool is_short) {
+	buxn_jit_operand_t imm = {
+		// We will assume that it is a constant, even if it can be overwritten.
+		// Jump opcodes will recheck the assumption so it is safe.
+		.semantics = BUXN_JIT_SEM_CONST,
+		.is_short = is_short,
+		.reg = buxn_jit_alloc_reg(ctx),
+	};
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; r%d = rom(addr=0x%04x, flag_2=%d)\n",
+		imm.reg - SLJIT_R0,
+		ctx->pc,
+		imm.is_short
+	);
+#endif
+
+	uint16_t last = (uint16_t)(ctx->pc + (is_short ? 1 : 0));
+	if (
+		ctx->jit->config.const_literals
+		&& !ctx->jit->volatile_literals[ctx->pc]
+		&& !ctx->jit->volatile_literals[last]
+	) {
+		// Writes to the literal invalidate the block
+		imm.semantics |= BUXN_JIT_SEM_IMM;
+		imm.const_value = is_short
+			? (uint16_t)buxn_jit_peek(ctx, ctx->pc) << 8 | (uint16_t)buxn_jit_peek(ctx, last)
+			: buxn_jit_peek(ctx, ctx->pc);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			imm.reg, 0,
+			SLJIT_IMM, imm.const_value
+		);
+
+		ctx->pc = last + 1;
+		return imm;
+	}
+
+	if (is_short) {
+		uint8_t hi = buxn_jit_peek(ctx, (uint16_t)(ctx->pc + 0));
+		uint8_t lo = buxn_jit_peek(ctx, (uint16_t)(ctx->pc + 1));
+		imm.const_value = (uint16_t)hi << 8 | (uint16_t)lo;
+
+		buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+
+		if (ctx->pc < 0xffff) {  // No wrap around
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U16,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				SLJIT_IMM, ctx->pc
+			);
+			buxn_jit_emit_load_u16(ctx, imm.reg, BUXN_JIT_MEM(), 0);
+		} else {
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U16,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				SLJIT_IMM, ctx->pc
+			);
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U8,
+				imm.reg, 0,
+				BUXN_JIT_MEM(), 0
+			);
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_SHL,
+				imm.reg, 0,
+				imm.reg, 0,
+				SLJIT_IMM, 8
+			);
+
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U16,
+				BUXN_JIT_MEM_OFFSET(), 0,
+				SLJIT_IMM, ctx->pc + 1
+			);
+			sljit_emit_op1(
+				ctx->compiler,
+				SLJIT_MOV_U8,
+				BUXN_JIT_TMP(), 0,
+				BUXN_JIT_MEM(), 0
+			);
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_OR,
+				imm.reg, 0,
+				imm.reg, 0,
+				BUXN_JIT_TMP(), 0
+			);
+		}
+
+		ctx->pc += 2;
+	} else {
+		imm.const_value = buxn_jit_peek(ctx, ctx->pc);
+
+		buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U16,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			SLJIT_IMM, ctx->pc
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			imm.reg, 0,
+			BUXN_JIT_MEM(), 0
+		);
+
+		ctx->pc += 1;
+	}
+
+	return imm;
+}
+
+static buxn_jit_operand_t
+buxn_jit_immediate_jump_target(buxn_jit_ctx_t* ctx) {
+	// Immediate jump target should not be rewritten using door
+	buxn_jit_operand_t target = {
+		.semantics = BUXN_JIT_SEM_CONST | BUXN_JIT_SEM_IMM_JMP,
+		.is_short = true,
+		// A register is not needed as we will never use it
+		.reg = SLJIT_R(BUXN_JIT_R_TMP),
+	};
+	uint8_t hi = buxn_jit_peek(ctx, (uint16_t)(ctx->pc + 0));
+	uint8_t lo = buxn_jit_peek(ctx, (uint16_t)(ctx->pc + 1));
+	target.const_value = (uint16_t)hi << 8 | (uint16_t)lo;
+	ctx->pc += 2;
+
+	target.const_value += ctx->pc;
+
+	// Assinging to an unused register makes the tak benchmark run faster.
+	// I have no idea why.
+	// There is some weird scheduling thing going on.
+	// How do CPUs even work?
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_U16,
+		target.reg, 0,
+		SLJIT_IMM, target.const_value
+	);
+
+	return target;
+}
+
+// A comparison followed by JCI or a literal and JCN.
+// The flag is never materialized into a register.
+static void
+buxn_jit_compare_and_branch(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	buxn_jit_operand_t b = buxn_jit_pop(ctx);
+	buxn_jit_operand_t a = buxn_jit_pop(ctx);
+
+	// Skip the jump when the comparison is false
+	sljit_s32 skip_type;
+	switch (ctx->current_opcode & 0x1f) {
+		case 0x08:  // EQU
+			skip_type = SLJIT_NOT_EQUAL;
+			break;
+		case 0x09:  // NEQ
+			skip_type = SLJIT_EQUAL;
+			break;
+		case 0x0a:  // GTH
+			skip_type = SLJIT_LESS_EQUAL;
+			break;
+		default:  // LTH
+			skip_type = SLJIT_GREATER_EQUAL;
+			break;
+	}
+
+	ctx->current_opcode = insn->jump_opcode;
+	ctx->pc = insn->target_pc;
+	buxn_jit_operand_t target = insn->jump_opcode == 0x20  // JCI
+		? buxn_jit_immediate_jump_target(ctx)
+		: buxn_jit_immediate(ctx, buxn_jit_op_flag_2(ctx));
+	ctx->pc = insn->next_pc;
+
+	buxn_jit_prepare_jump(ctx, target, 0);
+	struct sljit_jump* skip_jump = sljit_emit_cmp(
+		ctx->compiler,
+		skip_type,
+		a.reg, 0,
+		b.reg, 0
+	);
+	buxn_jit_jump_unless(ctx, skip_jump, target);
+}
+
+static inline void
+buxn_jit_wrap_around(buxn_jit_ctx_t* ctx, buxn_jit_operand_t operand) {
+	sljit_emit_op2(
+		ctx->compiler,
+		SLJIT_AND,
+		operand.reg, 0,
+		operand.reg, 0,
+		SLJIT_IMM, buxn_jit_op_flag_2(ctx) ? 0xffff : 0x00ff
+	);
+}
+
+// }}}
+
+// Idioms {{{
+
+// Common opcode sequences which are compiled as a whole.
+// They are matched on the instruction list, the first instruction of a match
+// is compiled by the idiom and the rest are removed.
+
+typedef struct {
+	const char* name;
+	uint8_t length;
+	uint8_t opcodes[BUXN_JIT_MAX_IDIOM_LENGTH];
+	// Flags which may differ from the pattern but must be the same across the
+	// whole sequence
+	uint8_t flags;
+	// Extra condition on the matched instructions
+	bool (*check)(const buxn_jit_insn_t* const* insns);
+	void (*compile)(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn);
+} buxn_jit_idiom_t;
+
+static bool
+buxn_jit_check_widen(const buxn_jit_insn_t* const* insns) {
+	return insns[0]->exact && insns[0]->value == 0;
+}
+
+// #00 SWP: The byte is already zero extended in its register
+static void
+buxn_jit_compile_widen(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	bool flag_r = buxn_jit_op_flag_r(ctx);
+	buxn_jit_operand_t value = buxn_jit_pop_ex(ctx, false, flag_r);
+	value.semantics &= BUXN_JIT_SEM_CONST | BUXN_JIT_SEM_IMM;
+	value.is_short = true;
+	buxn_jit_push_ex(ctx, value, flag_r);
+}
+
+static bool
+buxn_jit_check_zero_page_inc(const buxn_jit_insn_t* const* insns) {
+	return insns[0]->exact
+		&& insns[3]->exact
+		&& insns[0]->value == insns[3]->value;
+}
+
+// LIT addr LDZ2 INC2 LIT addr STZ2: Increment a zero page counter in place
+static void
+buxn_jit_compile_zero_page_inc(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	uint8_t addr = (uint8_t)insn->value;
+	buxn_jit_reg_t value = buxn_jit_alloc_reg(ctx);
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; zero_page_inc(addr=0x%02x)\n", addr);
+#endif
+	buxn_jit_mem_values_forget(ctx, addr, false, false);
+	buxn_jit_mem_values_forget(ctx, (uint8_t)(addr + 1), false, false);
+
+	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+	if (addr < 0xff) {
+		buxn_jit_emit_load_u16(ctx, value, SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), addr);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			value, 0,
+			value, 0,
+			SLJIT_IMM, 1
+		);
+		buxn_jit_emit_store_u16(ctx, value, 0, SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), addr);
+	} else {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			value, 0,
+			SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), addr
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_SHL,
+			value, 0,
+			value, 0,
+			SLJIT_IMM, 8
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_TMP(), 0,
+			SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), (uint8_t)(addr + 1)
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_OR,
+			value, 0,
+			value, 0,
+			BUXN_JIT_TMP(), 0
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_ADD,
+			value, 0,
+			value, 0,
+			SLJIT_IMM, 1
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), (uint8_t)(addr + 1),
+			value, 0
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_LSHR,
+			value, 0,
+			value, 0,
+			SLJIT_IMM, 8
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			SLJIT_MEM1(SLJIT_R(BUXN_JIT_R_MEM_BASE)), addr,
+			value, 0
+		);
+	}
 
-#if BUXN_JIT_VERBOSE
-	fprintf(stderr, "  ; label%d:\n", label_id);
-#endif
-	sljit_set_label(skip_jump, sljit_emit_label(ctx->compiler));
+	// The counter may be part of code in the zero page
+	ctx->pc = insn->next_pc;
+	buxn_jit_guard_code_write(
+		ctx,
+		(buxn_jit_operand_t){ .semantics = BUXN_JIT_SEM_IMM, .const_value = addr },
+		true
+	);
 }
 
+// DUP ADD: Shift instead of adding the value to itself
 static void
-buxn_jit_finalize(buxn_jit_ctx_t* ctx) {
-	ctx->compiler = NULL;
+buxn_jit_compile_double(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	buxn_jit_operand_t a = buxn_jit_pop(ctx);
+	buxn_jit_operand_t c = {
+		.is_short = a.is_short,
+		.semantics = a.semantics & BUXN_JIT_SEM_CONST,
+		.const_value = a.const_value << 1,
+		.reg = buxn_jit_alloc_reg(ctx),
+	};
+	sljit_emit_op2(
+		ctx->compiler,
+		SLJIT_SHL,
+		c.reg, 0,
+		a.reg, 0,
+		SLJIT_IMM, 1
+	);
+	buxn_jit_wrap_around(ctx, c);
+	buxn_jit_push(ctx, c);
 }
 
-static buxn_jit_operand_t
-buxn_jit_immediate(buxn_jit_ctx_t* ctx, bool is_short) {
-	buxn_jit_operand_t imm = {
-		// We will assume that it is a constant, even if it can be overwritten.
-		// Jump opcodes will recheck the assumption so it is safe.
-		.semantics = BUXN_JIT_SEM_CONST,
-		.is_short = is_short,
+// INCk: Keep the operand in the stack cache instead of flushing it
+static void
+buxn_jit_compile_inck(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	buxn_jit_operand_t a = buxn_jit_pop(ctx);
+	buxn_jit_push(ctx, a);
+
+	buxn_jit_operand_t c = {
+		.is_short = a.is_short,
+		.semantics = a.semantics & (BUXN_JIT_SEM_CONST | BUXN_JIT_SEM_IMM),
+		.const_value = a.const_value + 1,
 		.reg = buxn_jit_alloc_reg(ctx),
 	};
-#if BUXN_JIT_VERBOSE
-	fprintf(
-		stderr,
-		"  ; r%d = rom(addr=0x%04x, flag_2=%d)\n",
-		imm.reg - SLJIT_R0,
-		ctx->pc,
-		imm.is_short
+	sljit_emit_op2(
+		ctx->compiler,
+		SLJIT_ADD,
+		c.reg, 0,
+		a.reg, 0,
+		SLJIT_IMM, 1
 	);
-#endif
+	buxn_jit_wrap_around(ctx, c);
+	buxn_jit_push(ctx, c);
+}
 
-	if (is_short) {
-		uint8_t hi = ctx->jit->vm->memory[(uint16_t)(ctx->pc + 0)];
-		uint8_t lo = ctx->jit->vm->memory[(uint16_t)(ctx->pc + 1)];
-		imm.const_value = (uint16_t)hi << 8 | (uint16_t)lo;
+// LDAk: Keep the address in the stack cache so that the INC2 which usually
+// follows does not have to reload it
+static void
+buxn_jit_compile_ldak(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, true, buxn_jit_op_flag_r(ctx));
+	buxn_jit_push_ex(ctx, addr, buxn_jit_op_flag_r(ctx));
+	buxn_jit_operand_t value = buxn_jit_load_var(ctx, addr);
+	buxn_jit_push(ctx, value);
+}
 
-		buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
+// Indexed by buxn_jit_stats_t.idiom_hits
+static const buxn_jit_idiom_t buxn_jit_idioms[BUXN_JIT_NUM_IDIOMS] = {
+	{
+		.name = "#00 SWP",
+		.length = 2,
+		.opcodes = { 0x80, 0x04 },
+		.flags = BUXN_JIT_OP_R,
+		.check = buxn_jit_check_widen,
+		.compile = buxn_jit_compile_widen,
+	},
+	{
+		.name = "LDZ2 INC2 STZ2",
+		.length = 5,
+		.opcodes = { 0x80, 0x30, 0x21, 0x80, 0x31 },
+		.flags = BUXN_JIT_OP_R,
+		.check = buxn_jit_check_zero_page_inc,
+		.compile = buxn_jit_compile_zero_page_inc,
+	},
+	{
+		.name = "DUP ADD",
+		.length = 2,
+		.opcodes = { 0x06, 0x18 },
+		.flags = BUXN_JIT_OP_R | BUXN_JIT_OP_2,
+		.compile = buxn_jit_compile_double,
+	},
+	{
+		.name = "INCk",
+		.length = 1,
+		.opcodes = { 0x81 },
+		.flags = BUXN_JIT_OP_R | BUXN_JIT_OP_2,
+		.compile = buxn_jit_compile_inck,
+	},
+	{
+		.name = "LDAk",
+		.length = 1,
+		.opcodes = { 0x94 },
+		.flags = BUXN_JIT_OP_R | BUXN_JIT_OP_2,
+		.compile = buxn_jit_compile_ldak,
+	},
+};
 
-		if (ctx->pc < 0xffff) {  // No wrap around
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_MOV_U16,
-				BUXN_JIT_MEM_OFFSET(), 0,
-				SLJIT_IMM, ctx->pc
-			);
-			sljit_emit_mem(
-				ctx->compiler,
-				SLJIT_MOV_U16 | SLJIT_MEM_LOAD | SLJIT_MEM_UNALIGNED,
-				imm.reg,
-				BUXN_JIT_MEM(), 0
-			);
-#if SLJIT_LITTLE_ENDIAN
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_REV_U16,
-				imm.reg, 0,
-				imm.reg, 0
-			);
-#endif
-		} else {
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_MOV_U16,
-				BUXN_JIT_MEM_OFFSET(), 0,
-				SLJIT_IMM, ctx->pc
-			);
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_MOV_U8,
-				imm.reg, 0,
-				BUXN_JIT_MEM(), 0
-			);
-			sljit_emit_op2(
-				ctx->compiler,
-				SLJIT_SHL,
-				imm.reg, 0,
-				imm.reg, 0,
-				SLJIT_IMM, 8
-			);
+const char*
+buxn_jit_idiom_name(int idiom) {
+	if (idiom < 0 || idiom >= BUXN_JIT_NUM_IDIOMS) { return NULL; }
+	return buxn_jit_idioms[idiom].name;
+}
 
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_MOV_U16,
-				BUXN_JIT_MEM_OFFSET(), 0,
-				SLJIT_IMM, ctx->pc + 1
-			);
-			sljit_emit_op1(
-				ctx->compiler,
-				SLJIT_MOV_U8,
-				BUXN_JIT_TMP(), 0,
-				BUXN_JIT_MEM(), 0
-			);
-			sljit_emit_op2(
-				ctx->compiler,
-				SLJIT_OR,
-				imm.reg, 0,
-				imm.reg, 0,
-				BUXN_JIT_TMP(), 0
-			);
+// Try to match an idiom which ends with the last live instruction.
+// Returns the new number of live instructions or -1 if nothing matched.
+static int
+buxn_jit_match_idiom(buxn_jit_ctx_t* ctx, const uint16_t* live, int num_live) {
+	for (int i = 0; i < BUXN_JIT_NUM_IDIOMS; ++i) {
+		const buxn_jit_idiom_t* idiom = &buxn_jit_idioms[i];
+		if (idiom->length > num_live) { continue; }
+
+		buxn_jit_insn_t* window[BUXN_JIT_MAX_IDIOM_LENGTH];
+		uint8_t flags = 0;
+		bool match = true;
+		for (int j = 0; j < idiom->length && match; ++j) {
+			buxn_jit_insn_t* insn = &ctx->insns[live[num_live - idiom->length + j]];
+			window[j] = insn;
+			if (j == 0) { flags = insn->opcode & idiom->flags; }
+			match = (
+				insn->type == BUXN_JIT_INSN_OPCODE
+				|| insn->type == BUXN_JIT_INSN_CONST
+			)
+				&& (insn->opcode & ~idiom->flags) == idiom->opcodes[j]
+				&& (insn->opcode & idiom->flags) == flags;
+		}
+		if (!match) { continue; }
+		if (idiom->check != NULL && !idiom->check((const buxn_jit_insn_t* const*)window)) {
+			continue;
 		}
 
-		ctx->pc += 2;
+		window[0]->type = BUXN_JIT_INSN_IDIOM;
+		window[0]->idiom = (uint8_t)i;
+		window[0]->next_pc = window[idiom->length - 1]->next_pc;
+		for (int j = 1; j < idiom->length; ++j) {
+			window[j]->type = BUXN_JIT_INSN_NOP;
+		}
+
+		return num_live - idiom->length + 1;
+	}
+
+	return -1;
+}
+
+// }}}
+
+// IR {{{
+
+// The opcodes of a block are decoded before any code is emitted so that short
+// sequences can be rewritten.
+// Copies need no propagation here since the stack cache already lets
+// duplicated values share a register.
+
+static bool
+buxn_jit_insn_is_lit(const buxn_jit_insn_t* insn) {
+	return insn->type == BUXN_JIT_INSN_CONST
+		|| (insn->type == BUXN_JIT_INSN_OPCODE && (insn->opcode & 0x9f) == 0x80);
+}
+
+static bool
+buxn_jit_insn_is_exact_lit(const buxn_jit_insn_t* insn) {
+	return buxn_jit_insn_is_lit(insn) && insn->exact;
+}
+
+// Whether both opcodes work on values of the same size on the same stack
+static bool
+buxn_jit_insn_same_stack(uint8_t a, uint8_t b) {
+	return (a & (BUXN_JIT_OP_R | BUXN_JIT_OP_2)) == (b & (BUXN_JIT_OP_R | BUXN_JIT_OP_2));
+}
+
+static bool
+buxn_jit_fold_binary(uint8_t opcode, uint16_t a, uint16_t b, uint16_t* result) {
+	uint16_t value;
+	switch (opcode & 0x1f) {
+		case 0x18:  // ADD
+			value = a + b;
+			break;
+		case 0x19:  // SUB
+			value = a - b;
+			break;
+		case 0x1a:  // MUL
+			value = a * b;
+			break;
+		case 0x1b:  // DIV
+			value = b != 0 ? a / b : 0;
+			break;
+		case 0x1c:  // AND
+			value = a & b;
+			break;
+		case 0x1d:  // ORA
+			value = a | b;
+			break;
+		case 0x1e:  // EOR
+			value = a ^ b;
+			break;
+		case 0x1f:  // SFT
+			value = (uint16_t)((a >> (b & 0x0f)) << ((b & 0xf0) >> 4));
+			break;
+		default:
+			return false;
+	}
+
+	*result = opcode & BUXN_JIT_OP_2 ? value : (value & 0xff);
+	return true;
+}
+
+// Whether the opcode leaves its first operand unchanged with the given second
+// operand
+static bool
+buxn_jit_is_identity(uint8_t opcode, uint16_t b) {
+	switch (opcode & 0x1f) {
+		case 0x18:  // ADD
+		case 0x19:  // SUB
+		case 0x1d:  // ORA
+		case 0x1e:  // EOR
+		case 0x1f:  // SFT
+			return b == 0;
+		case 0x1a:  // MUL
+		case 0x1b:  // DIV
+			return b == 1;
+		default:
+			return false;
+	}
+}
+
+// Indexed by buxn_jit_stats_t.rewrite_hits
+enum {
+	// Operations on literals computed at compile time
+	BUXN_JIT_REWRITE_FOLD,
+	// Operations which leave their operand unchanged
+	BUXN_JIT_REWRITE_IDENTITY,
+	// Values which are popped right after they are pushed
+	BUXN_JIT_REWRITE_DEAD_VALUE,
+	// A swap which undoes the one before it
+	BUXN_JIT_REWRITE_SWAP,
+};
+
+static const char* const buxn_jit_rewrite_names[BUXN_JIT_NUM_REWRITES] = {
+	[BUXN_JIT_REWRITE_FOLD] = "fold",
+	[BUXN_JIT_REWRITE_IDENTITY] = "identity",
+	[BUXN_JIT_REWRITE_DEAD_VALUE] = "dead value",
+	[BUXN_JIT_REWRITE_SWAP] = "SWP SWP",
+};
+
+const char*
+buxn_jit_rewrite_name(int rewrite) {
+	if (rewrite < 0 || rewrite >= BUXN_JIT_NUM_REWRITES) { return NULL; }
+	return buxn_jit_rewrite_names[rewrite];
+}
+
+// Try to rewrite the instruction together with the live instruction right
+// before it.
+// Returns the new number of live instructions or -1 if nothing changed.
+static int
+buxn_jit_rewrite_insn(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_insn_t* insn,
+	uint16_t* live,
+	int num_live
+) {
+	uint8_t opcode = insn->opcode;
+	if (num_live < 1 || opcode & BUXN_JIT_OP_K) { return -1; }
+
+	buxn_jit_insn_t* last = &ctx->insns[live[num_live - 1]];
+	buxn_jit_insn_t* prev = num_live >= 2 ? &ctx->insns[live[num_live - 2]] : NULL;
+	uint8_t base = opcode & 0x1f;
+
+	if (base >= 0x18) {
+		// The shift amount of SFT2 is still a byte
+		bool operand_match = base == 0x1f
+			? (last->opcode & (BUXN_JIT_OP_R | BUXN_JIT_OP_2)) == (opcode & BUXN_JIT_OP_R)
+			: buxn_jit_insn_same_stack(last->opcode, opcode);
+		if (!operand_match || !buxn_jit_insn_is_exact_lit(last)) { return -1; }
+
+		if (
+			prev != NULL
+			&& buxn_jit_insn_is_exact_lit(prev)
+			&& buxn_jit_insn_same_stack(prev->opcode, opcode)
+		) {
+			buxn_jit_fold_binary(opcode, prev->value, last->value, &prev->value);
+			prev->type = BUXN_JIT_INSN_CONST;
+			prev->next_pc = insn->next_pc;
+			last->type = BUXN_JIT_INSN_NOP;
+			insn->type = BUXN_JIT_INSN_NOP;
+			ctx->jit->stats.rewrite_hits[BUXN_JIT_REWRITE_FOLD] += 1;
+			return num_live - 1;
+		}
+
+		if (buxn_jit_is_identity(opcode, last->value)) {
+			last->type = BUXN_JIT_INSN_NOP;
+			last->next_pc = insn->next_pc;
+			insn->type = BUXN_JIT_INSN_NOP;
+			ctx->jit->stats.rewrite_hits[BUXN_JIT_REWRITE_IDENTITY] += 1;
+			return num_live - 1;
+		}
+
+		return -1;
+	}
+
+	switch (base) {
+		case 0x01:  // INC
+			if (
+				buxn_jit_insn_is_exact_lit(last)
+				&& buxn_jit_insn_same_stack(last->opcode, opcode)
+			) {
+				last->type = BUXN_JIT_INSN_CONST;
+				last->value = opcode & BUXN_JIT_OP_2
+					? (uint16_t)(last->value + 1)
+					: (uint8_t)(last->value + 1);
+				last->next_pc = insn->next_pc;
+				insn->type = BUXN_JIT_INSN_NOP;
+				ctx->jit->stats.rewrite_hits[BUXN_JIT_REWRITE_FOLD] += 1;
+				return num_live;
+			}
+			break;
+		case 0x02:  // POP
+			if (
+				(
+					buxn_jit_insn_is_lit(last)
+					&& buxn_jit_insn_same_stack(last->opcode, opcode)
+				)
+				|| (
+					last->type == BUXN_JIT_INSN_OPCODE
+					&& last->opcode == ((opcode & ~0x1f) | 0x06)  // DUP
+				)
+			) {
+				last->type = BUXN_JIT_INSN_NOP;
+				last->next_pc = insn->next_pc;
+				insn->type = BUXN_JIT_INSN_NOP;
+				ctx->jit->stats.rewrite_hits[BUXN_JIT_REWRITE_DEAD_VALUE] += 1;
+				return num_live - 1;
+			}
+			break;
+		case 0x04:  // SWP
+			if (last->type == BUXN_JIT_INSN_OPCODE && last->opcode == opcode) {
+				last->type = BUXN_JIT_INSN_NOP;
+				last->next_pc = insn->next_pc;
+				insn->type = BUXN_JIT_INSN_NOP;
+				ctx->jit->stats.rewrite_hits[BUXN_JIT_REWRITE_SWAP] += 1;
+				return num_live - 1;
+			}
+			break;
+	}
+
+	return -1;
+}
+
+// Fuse a comparison with the conditional jump which consumes its result.
+// Returns the new number of live instructions or -1 if nothing matched.
+static int
+buxn_jit_match_branch(buxn_jit_ctx_t* ctx, const uint16_t* live, int num_live) {
+	buxn_jit_insn_t* jump = &ctx->insns[live[num_live - 1]];
+	int length;
+	uint16_t target_pc;
+	uint8_t stack_flag;
+	if (jump->opcode == 0x20) {
+		// JCI
+		length = 2;
+		target_pc = jump->pc + 1;
+		stack_flag = 0;
+	} else if ((jump->opcode & 0x9f) == 0x0d && num_live >= 3) {
+		// LIT JCN, the literal must still be in memory to be read as the target
+		buxn_jit_insn_t* lit = &ctx->insns[live[num_live - 2]];
+		uint8_t lit_opcode = 0x80 | (jump->opcode & (BUXN_JIT_OP_R | BUXN_JIT_OP_2));
+		if (lit->type != BUXN_JIT_INSN_OPCODE || lit->opcode != lit_opcode) {
+			return -1;
+		}
+
+		length = 3;
+		target_pc = lit->pc + 1;
+		stack_flag = jump->opcode & BUXN_JIT_OP_R;
 	} else {
-		imm.const_value = ctx->jit->vm->memory[ctx->pc];
+		return -1;
+	}
+	if (num_live < length || jump->type != BUXN_JIT_INSN_OPCODE) { return -1; }
+
+	// EQU, NEQ, GTH, LTH on the stack of the condition
+	buxn_jit_insn_t* compare = &ctx->insns[live[num_live - length]];
+	if (
+		compare->type != BUXN_JIT_INSN_OPCODE
+		|| (compare->opcode & 0x9c) != 0x08
+		|| (compare->opcode & BUXN_JIT_OP_R) != stack_flag
+	) {
+		return -1;
+	}
 
-		buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, memory));
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U16,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			SLJIT_IMM, ctx->pc
-		);
-		sljit_emit_op1(
-			ctx->compiler,
-			SLJIT_MOV_U8,
-			imm.reg, 0,
-			BUXN_JIT_MEM(), 0
-		);
+	compare->type = BUXN_JIT_INSN_BRANCH;
+	compare->jump_opcode = jump->opcode;
+	compare->target_pc = target_pc;
+	compare->next_pc = jump->next_pc;
+	for (int i = num_live - length + 1; i < num_live; ++i) {
+		ctx->insns[live[i]].type = BUXN_JIT_INSN_NOP;
+	}
+
+	return num_live - length + 1;
+}
+
+// The target of a jump within the decoded instructions, if it is known at
+// compile time
+static int
+buxn_jit_backward_target(buxn_jit_ctx_t* ctx, int index) {
+	const buxn_jit_insn_t* insn = &ctx->insns[index];
+	uint16_t target;
+	if (insn->opcode == 0x20 || insn->opcode == 0x40) {
+		// JCI, JMI
+		uint16_t offset = (uint16_t)buxn_jit_peek(ctx, (uint16_t)(insn->pc + 1)) << 8
+			| (uint16_t)buxn_jit_peek(ctx, (uint16_t)(insn->pc + 2));
+		target = (uint16_t)(insn->next_pc + offset);
+	} else if ((insn->opcode & 0x9e) == 0x0c && index > 0) {
+		// LIT JMP, LIT JCN
+		const buxn_jit_insn_t* lit = &ctx->insns[index - 1];
+		uint8_t lit_opcode = 0x80 | (insn->opcode & (BUXN_JIT_OP_R | BUXN_JIT_OP_2));
+		if (lit->opcode != lit_opcode || !lit->exact) { return -1; }
+
+		target = insn->opcode & BUXN_JIT_OP_2
+			? lit->value
+			: (uint16_t)(insn->next_pc + (int8_t)lit->value);
+	} else {
+		return -1;
+	}
+
+	for (int i = index; i >= 0; --i) {
+		if (ctx->insns[i].pc == target) { return i; }
+	}
+
+	return -1;
+}
+
+static void
+buxn_jit_build_ir(buxn_jit_ctx_t* ctx) {
+	ctx->num_insns = 0;
+	ctx->insn_index = 0;
+
+	// Decode
+	const buxn_jit_t* jit = ctx->jit;
+	bool pin_next = false;
+	uint16_t pc = ctx->pc;
+	while (ctx->num_insns < BUXN_JIT_MAX_INSNS && pc <= ctx->memory_end) {
+		uint8_t opcode = buxn_jit_peek(ctx, pc);
+		int size = 1;
+		if (opcode == 0x20 || opcode == 0x40 || opcode == 0x60) {
+			// JCI, JMI, JSI
+			size = 3;
+		} else if ((opcode & 0x9f) == 0x80) {
+			// LIT
+			size = opcode & BUXN_JIT_OP_2 ? 3 : 2;
+		}
+		// Stop before wrapping around or running out of copied bytes
+		if ((int)pc + size > 0xffff || pc + size - 1 > ctx->memory_end) { break; }
+
+		buxn_jit_insn_t* insn = &ctx->insns[ctx->num_insns++];
+		*insn = (buxn_jit_insn_t){
+			.type = BUXN_JIT_INSN_OPCODE,
+			.pc = pc,
+			.next_pc = (uint16_t)(pc + size),
+			.opcode = opcode,
+			// The opcode after a byte jump may be skipped at runtime
+			.pinned = pin_next,
+		};
+		if ((opcode & 0x9f) == 0x80) {
+			uint16_t last = (uint16_t)(pc + size - 1);
+			insn->exact = jit->config.const_literals
+				&& !jit->volatile_literals[pc + 1]
+				&& !jit->volatile_literals[last];
+			insn->value = size == 3
+				? (uint16_t)buxn_jit_peek(ctx, (uint16_t)(pc + 1)) << 8 | (uint16_t)buxn_jit_peek(ctx, last)
+				: buxn_jit_peek(ctx, (uint16_t)(pc + 1));
+		}
+
+		uint8_t base = opcode & 0x1f;
+		// JMP, JCN, JSR
+		pin_next = (opcode & BUXN_JIT_OP_2) == 0 && base >= 0x0c && base <= 0x0e;
+
+		if (
+			opcode == 0x00  // BRK
+			|| opcode == 0x40  // JMI
+			|| (opcode & 0x3f) == 0x2c  // JMP2
+		) {
+			break;
+		}
+
+		pc = (uint16_t)(pc + size);
+	}
+
+	// Find loop headers
+	for (int i = 0; i < ctx->num_insns; ++i) {
+		int target = buxn_jit_backward_target(ctx, i);
+		if (target >= 0 && !ctx->insns[target].pinned) {
+			ctx->insns[target].loop_header = true;
+		}
+	}
+
+	// Rewrite
+	uint16_t live[BUXN_JIT_MAX_INSNS];
+	int num_live = 0;
+	for (int i = 0; i < ctx->num_insns; ++i) {
+		buxn_jit_insn_t* insn = &ctx->insns[i];
+		// Nothing can be combined across these
+		if (insn->pinned) {
+			num_live = 0;
+			continue;
+		} else if (insn->loop_header) {
+			num_live = 0;
+		}
+
+		int result = buxn_jit_rewrite_insn(ctx, insn, live, num_live);
+		if (result >= 0) {
+			num_live = result;
+		} else {
+			live[num_live++] = (uint16_t)i;
+			result = buxn_jit_match_idiom(ctx, live, num_live);
+			if (result < 0) {
+				result = buxn_jit_match_branch(ctx, live, num_live);
+			}
+			if (result >= 0) { num_live = result; }
+		}
+	}
+}
 
-		ctx->pc += 1;
+// Returns the instruction at the current pc if it was decoded
+static buxn_jit_insn_t*
+buxn_jit_find_insn(buxn_jit_ctx_t* ctx) {
+	while (
+		ctx->insn_index < ctx->num_insns
+		&& ctx->insns[ctx->insn_index].pc < ctx->pc
+	) {
+		ctx->insn_index += 1;
 	}
 
-	return imm;
+	if (
+		ctx->insn_index < ctx->num_insns
+		&& ctx->insns[ctx->insn_index].pc == ctx->pc
+	) {
+		return &ctx->insns[ctx->insn_index];
+	} else {
+		return NULL;
+	}
 }
 
-static buxn_jit_operand_t
-buxn_jit_immediate_jump_target(buxn_jit_ctx_t* ctx) {
-	// Immediate jump target should not be rewritten using door
-	buxn_jit_operand_t target = {
-		.semantics = BUXN_JIT_SEM_CONST | BUXN_JIT_SEM_IMM_JMP,
-		.is_short = true,
-		// A register is not needed as we will never use it
-		.reg = SLJIT_R(BUXN_JIT_R_TMP),
+static void
+buxn_jit_folded_const(buxn_jit_ctx_t* ctx, const buxn_jit_insn_t* insn) {
+	buxn_jit_operand_t value = {
+		.semantics = BUXN_JIT_SEM_CONST | BUXN_JIT_SEM_IMM,
+		.is_short = buxn_jit_op_flag_2(ctx),
+		.const_value = insn->value,
+		.reg = buxn_jit_alloc_reg(ctx),
 	};
-	uint8_t hi = ctx->jit->vm->memory[(uint16_t)(ctx->pc + 0)];
-	uint8_t lo = ctx->jit->vm->memory[(uint16_t)(ctx->pc + 1)];
-	target.const_value = (uint16_t)hi << 8 | (uint16_t)lo;
-	ctx->pc += 2;
-
-	target.const_value += ctx->pc;
-
-	// Assinging to an unused register makes the tak benchmark run faster.
-	// I have no idea why.
-	// There is some weird scheduling thing going on.
-	// How do CPUs even work?
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_U16,
-		target.reg, 0,
-		SLJIT_IMM, target.const_value
+#if BUXN_JIT_VERBOSE
+	fprintf(
+		stderr,
+		"  ; r%d = 0x%04x (folded 0x%04x..0x%04x)\n",
+		value.reg - SLJIT_R0,
+		value.const_value,
+		insn->pc,
+		insn->next_pc
 	);
-
-	return target;
-}
-
-static inline void
-buxn_jit_wrap_around(buxn_jit_ctx_t* ctx, buxn_jit_operand_t operand) {
-	sljit_emit_op2(
+#endif
+	sljit_emit_op1(
 		ctx->compiler,
-		SLJIT_AND,
-		operand.reg, 0,
-		operand.reg, 0,
-		SLJIT_IMM, buxn_jit_op_flag_2(ctx) ? 0xffff : 0x00ff
+		SLJIT_MOV,
+		value.reg, 0,
+		SLJIT_IMM, value.const_value
 	);
+	buxn_jit_push(ctx, value);
+	ctx->pc = insn->next_pc;
 }
 
 // }}}
@@ -1808,7 +5581,7 @@ buxn_jit_STH(buxn_jit_ctx_t* ctx) {
 static void
 buxn_jit_LDZ(buxn_jit_ctx_t* ctx) {
 	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, false, buxn_jit_op_flag_r(ctx));
-	buxn_jit_operand_t value = buxn_jit_load(ctx, buxn_jit_alloc_reg(ctx), addr);
+	buxn_jit_operand_t value = buxn_jit_load_var(ctx, addr);
 	buxn_jit_push(ctx, value);
 }
 
@@ -1816,7 +5589,7 @@ static void
 buxn_jit_STZ(buxn_jit_ctx_t* ctx) {
 	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, false, buxn_jit_op_flag_r(ctx));
 	buxn_jit_operand_t value = buxn_jit_pop(ctx);
-	buxn_jit_store(ctx, addr, value);
+	buxn_jit_store_var(ctx, addr, value);
 }
 
 static void
@@ -1836,6 +5609,7 @@ buxn_jit_LDR(buxn_jit_ctx_t* ctx) {
 		SLJIT_IMM, ctx->pc
 	);
 	addr.is_short = true;
+	buxn_jit_mem_values_clear(ctx);
 	buxn_jit_operand_t value = buxn_jit_load(ctx, buxn_jit_alloc_reg(ctx), addr);
 	buxn_jit_push(ctx, value);
 }
@@ -1858,13 +5632,14 @@ buxn_jit_STR(buxn_jit_ctx_t* ctx) {
 		SLJIT_IMM, ctx->pc
 	);
 	addr.is_short = true;
+	buxn_jit_mem_values_clear(ctx);
 	buxn_jit_store(ctx, addr, value);
 }
 
 static void
 buxn_jit_LDA(buxn_jit_ctx_t* ctx) {
 	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, true, buxn_jit_op_flag_r(ctx));
-	buxn_jit_operand_t value = buxn_jit_load(ctx, buxn_jit_alloc_reg(ctx), addr);
+	buxn_jit_operand_t value = buxn_jit_load_var(ctx, addr);
 	buxn_jit_push(ctx, value);
 }
 
@@ -1872,7 +5647,7 @@ static void
 buxn_jit_STA(buxn_jit_ctx_t* ctx) {
 	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, true, buxn_jit_op_flag_r(ctx));
 	buxn_jit_operand_t value = buxn_jit_pop(ctx);
-	buxn_jit_store(ctx, addr, value);
+	buxn_jit_store_var(ctx, addr, value);
 }
 
 static sljit_u32
@@ -1888,16 +5663,11 @@ buxn_jit_dei2_helper(sljit_up vm, sljit_u32 addr) {
 }
 
 static void
-buxn_jit_DEI(buxn_jit_ctx_t* ctx) {
-	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, false, buxn_jit_op_flag_r(ctx));
-	buxn_jit_operand_t result = {
-		.is_short = buxn_jit_op_flag_2(ctx),
-		.reg = buxn_jit_alloc_reg(ctx),
-	};
-
-	buxn_jit_clear_stack_caches(ctx);
-	buxn_jit_save_state(ctx);
-	ctx->mem_base = 0;
+buxn_jit_emit_dei_call(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	buxn_jit_operand_t result
+) {
 	sljit_emit_op1(
 		ctx->compiler,
 		SLJIT_MOV_P,
@@ -1910,13 +5680,16 @@ buxn_jit_DEI(buxn_jit_ctx_t* ctx) {
 		SLJIT_R1, 0,
 		addr.reg, 0
 	);
+	buxn_jit_emit_reloc(
+		ctx,
+		SLJIT_R2,
+		result.is_short ? BUXN_JIT_RELOC_DEI2 : BUXN_JIT_RELOC_DEI
+	);
 	sljit_emit_icall(
 		ctx->compiler,
 		SLJIT_CALL,
 		SLJIT_ARGS2(32, P, 32),
-		SLJIT_IMM, result.is_short
-			? SLJIT_FUNC_ADDR(buxn_jit_dei2_helper)
-			: SLJIT_FUNC_ADDR(buxn_jit_dei_helper)
+		SLJIT_R2, 0
 	);
 	sljit_emit_op1(
 		ctx->compiler,
@@ -1924,7 +5697,201 @@ buxn_jit_DEI(buxn_jit_ctx_t* ctx) {
 		result.reg, 0,
 		SLJIT_R0, 0
 	);
+}
+
+// Call buxn_vm_dei with the VM state written back
+static void
+buxn_jit_dei_full(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	buxn_jit_operand_t result
+) {
+	buxn_jit_clear_stack_caches(ctx);
+	buxn_jit_save_state(ctx);
+	ctx->mem_base = 0;
+	buxn_jit_emit_dei_call(ctx, addr, result);
 	buxn_jit_load_state(ctx);
+}
+
+// The port address is a literal and both ports of a short access have to
+// agree
+static buxn_jit_port_kind_t
+buxn_jit_port_kind(buxn_jit_ctx_t* ctx, buxn_jit_operand_t addr, bool is_short) {
+	if ((addr.semantics & BUXN_JIT_SEM_CONST) == 0) { return BUXN_JIT_PORT_FULL; }
+
+	buxn_jit_port_kind_t kind = BUXN_JIT_PORT_PASSIVE;
+	for (int i = 0; i < (is_short ? 2 : 1); ++i) {
+		const buxn_jit_port_t* port = &ctx->jit->ports[(uint8_t)(addr.const_value + i)];
+		if (port->kind == BUXN_JIT_PORT_FULL) {
+			return BUXN_JIT_PORT_FULL;
+		} else if (port->kind == BUXN_JIT_PORT_CALLBACK) {
+			kind = BUXN_JIT_PORT_CALLBACK;
+		}
+	}
+
+	return kind;
+}
+
+// Every port of the access promised to leave the stacks alone
+static bool
+buxn_jit_port_no_stack_access(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	bool is_short
+) {
+	if ((addr.semantics & BUXN_JIT_SEM_CONST) == 0) { return false; }
+
+	for (int i = 0; i < (is_short ? 2 : 1); ++i) {
+		const buxn_jit_port_t* port = &ctx->jit->ports[(uint8_t)(addr.const_value + i)];
+		if (!port->no_stack_access) { return false; }
+	}
+
+	return true;
+}
+
+// A literal which is not baked into code can still be overwritten, the port
+// is then accessed through a side exit.
+// The returned jump skips the side exit.
+static struct sljit_jump*
+buxn_jit_port_guard(buxn_jit_ctx_t* ctx, buxn_jit_operand_t addr) {
+	if (addr.semantics & BUXN_JIT_SEM_IMM) { return NULL; }
+
+	return sljit_emit_cmp(
+		ctx->compiler,
+		SLJIT_EQUAL,
+		addr.reg, 0,
+		SLJIT_IMM, (uint8_t)addr.const_value
+	);
+}
+
+// Only saved registers survive a call to a port callback or to a device
+// handler which does not access the stacks
+static void
+buxn_jit_prepare_port_call(buxn_jit_ctx_t* ctx) {
+	buxn_jit_mem_values_clear(ctx);
+	while (buxn_jit_stack_cache_park(ctx, &ctx->wst_cache)) { }
+	while (buxn_jit_stack_cache_park(ctx, &ctx->rst_cache)) { }
+	ctx->mem_base = 0;
+}
+
+// The callback is read from buxn_jit_t.ports so that the code does not depend
+// on the address of the host's functions
+static void
+buxn_jit_emit_port_call(buxn_jit_ctx_t* ctx, uint8_t port, bool is_dei) {
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_P,
+		SLJIT_R0, 0,
+		SLJIT_S(BUXN_JIT_S_VM), 0
+	);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV,
+		SLJIT_R1, 0,
+		SLJIT_IMM, port
+	);
+	buxn_jit_emit_reloc(ctx, SLJIT_R2, BUXN_JIT_RELOC_JIT);
+	sljit_emit_icall(
+		ctx->compiler,
+		SLJIT_CALL,
+		is_dei ? SLJIT_ARGS2(32, P, 32) : SLJIT_ARGS2V(P, 32),
+		SLJIT_MEM1(SLJIT_R2),
+		SLJIT_OFFSETOF(buxn_jit_t, ports)
+			+ port * (sljit_sw)sizeof(buxn_jit_port_t)
+			+ (is_dei ? SLJIT_OFFSETOF(buxn_jit_port_t, dei) : SLJIT_OFFSETOF(buxn_jit_port_t, deo))
+	);
+}
+
+static void
+buxn_jit_DEI(buxn_jit_ctx_t* ctx) {
+	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, false, buxn_jit_op_flag_r(ctx));
+	buxn_jit_operand_t result = {
+		.is_short = buxn_jit_op_flag_2(ctx),
+		.reg = buxn_jit_alloc_reg(ctx),
+	};
+
+	buxn_jit_port_kind_t kind = buxn_jit_port_kind(ctx, addr, result.is_short);
+	bool no_stack_access = buxn_jit_port_no_stack_access(ctx, addr, result.is_short);
+	uint8_t port = (uint8_t)addr.const_value;
+	// Only one value survives a callback
+	if (
+		(kind == BUXN_JIT_PORT_FULL && !no_stack_access)
+		||
+		(kind == BUXN_JIT_PORT_CALLBACK && result.is_short)
+	) {
+		buxn_jit_dei_full(ctx, addr, result);
+		buxn_jit_push(ctx, result);
+		return;
+	}
+
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; dei(port=0x%02x, kind=%d)\n", port, kind);
+#endif
+	struct sljit_jump* same_port = buxn_jit_port_guard(ctx, addr);
+	if (same_port != NULL) {
+		buxn_jit_snapshot_t snapshot;
+		buxn_jit_take_snapshot(ctx, &snapshot);
+		buxn_jit_dei_full(ctx, addr, result);
+		buxn_jit_do_push(ctx, result, result.reg, 0, buxn_jit_op_flag_r(ctx));
+		buxn_jit_save_state(ctx);
+		sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, ctx->pc);
+		buxn_jit_restore_snapshot(ctx, &snapshot);
+		sljit_set_label(same_port, sljit_emit_label(ctx->compiler));
+	}
+
+	sljit_sw device = SLJIT_OFFSETOF(buxn_vm_t, device);
+	if (kind == BUXN_JIT_PORT_FULL) {
+		// Only the stack pointers are synced
+		buxn_jit_prepare_port_call(ctx);
+		buxn_jit_save_state(ctx);
+		buxn_jit_emit_dei_call(ctx, addr, result);
+		buxn_jit_load_state(ctx);
+	} else if (kind == BUXN_JIT_PORT_CALLBACK && ctx->jit->ports[port].dei != NULL) {
+		buxn_jit_prepare_port_call(ctx);
+		buxn_jit_emit_port_call(ctx, port, true);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			result.reg, 0,
+			SLJIT_R0, 0
+		);
+	} else if (result.is_short && port < 0xff) {
+		buxn_jit_emit_load_u16(ctx, result.reg, SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device + port);
+	} else if (result.is_short) {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			result.reg, 0,
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device + port
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_SHL,
+			result.reg, 0,
+			result.reg, 0,
+			SLJIT_IMM, 8
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_TMP(), 0,
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_OR,
+			result.reg, 0,
+			result.reg, 0,
+			BUXN_JIT_TMP(), 0
+		);
+	} else {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			result.reg, 0,
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device + port
+		);
+	}
 
 	buxn_jit_push(ctx, result);
 }
@@ -1941,10 +5908,39 @@ buxn_jit_deo2_helper(sljit_up vm, sljit_u32 addr) {
 }
 
 static void
-buxn_jit_DEO(buxn_jit_ctx_t* ctx) {
-	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, false, buxn_jit_op_flag_r(ctx));
-	buxn_jit_operand_t value = buxn_jit_pop(ctx);
+buxn_jit_emit_deo_call(buxn_jit_ctx_t* ctx, buxn_jit_operand_t addr, bool is_short) {
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV_P,
+		SLJIT_R0, 0,
+		SLJIT_S(BUXN_JIT_S_VM), 0
+	);
+	sljit_emit_op1(
+		ctx->compiler,
+		SLJIT_MOV,
+		SLJIT_R1, 0,
+		addr.reg, 0
+	);
+	buxn_jit_emit_reloc(
+		ctx,
+		SLJIT_R2,
+		is_short ? BUXN_JIT_RELOC_DEO2 : BUXN_JIT_RELOC_DEO
+	);
+	sljit_emit_icall(
+		ctx->compiler,
+		SLJIT_CALL,
+		SLJIT_ARGS2V(P, 32),
+		SLJIT_R2, 0
+	);
+}
 
+// Write the device memory then call buxn_vm_deo with the VM state written back
+static void
+buxn_jit_deo_full(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t addr,
+	buxn_jit_operand_t value
+) {
 	buxn_jit_set_mem_base(ctx, SLJIT_OFFSETOF(buxn_vm_t, device));
 	if (value.is_short) {
 		sljit_emit_op1(
@@ -1987,45 +5983,105 @@ buxn_jit_DEO(buxn_jit_ctx_t* ctx) {
 			BUXN_JIT_MEM(), 0,
 			value.reg, 0
 		);
-	} else {
+	} else {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM_OFFSET(), 0,
+			addr.reg, 0
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			BUXN_JIT_MEM(), 0,
+			value.reg, 0
+		);
+	}
+
+	buxn_jit_clear_stack_caches(ctx);
+	buxn_jit_save_state(ctx);
+	ctx->mem_base = 0;
+	buxn_jit_emit_deo_call(ctx, addr, value.is_short);
+	buxn_jit_load_state(ctx);
+}
+
+static void
+buxn_jit_DEO(buxn_jit_ctx_t* ctx) {
+	buxn_jit_operand_t addr = buxn_jit_pop_ex(ctx, false, buxn_jit_op_flag_r(ctx));
+	buxn_jit_operand_t value = buxn_jit_pop(ctx);
+
+	buxn_jit_port_kind_t kind = buxn_jit_port_kind(ctx, addr, value.is_short);
+	bool no_stack_access = buxn_jit_port_no_stack_access(ctx, addr, value.is_short);
+	if (kind == BUXN_JIT_PORT_FULL && !no_stack_access) {
+		buxn_jit_deo_full(ctx, addr, value);
+		// A device may load code into memory
+		buxn_jit_resume_point(ctx);
+		return;
+	}
+
+	uint8_t port = (uint8_t)addr.const_value;
+#if BUXN_JIT_VERBOSE
+	fprintf(stderr, "  ; deo(port=0x%02x, kind=%d)\n", port, kind);
+#endif
+	struct sljit_jump* same_port = buxn_jit_port_guard(ctx, addr);
+	if (same_port != NULL) {
+		buxn_jit_snapshot_t snapshot;
+		buxn_jit_take_snapshot(ctx, &snapshot);
+		buxn_jit_deo_full(ctx, addr, value);
+		sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, ctx->pc);
+		buxn_jit_restore_snapshot(ctx, &snapshot);
+		sljit_set_label(same_port, sljit_emit_label(ctx->compiler));
+	}
+
+	sljit_sw device = SLJIT_OFFSETOF(buxn_vm_t, device);
+	if (value.is_short && port < 0xff) {
+		buxn_jit_emit_store_u16(ctx, value.reg, 0, SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device + port);
+	} else if (value.is_short) {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_LSHR,
+			BUXN_JIT_TMP(), 0,
+			value.reg, 0,
+			SLJIT_IMM, 8
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV_U8,
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device + port,
+			BUXN_JIT_TMP(), 0
+		);
 		sljit_emit_op1(
 			ctx->compiler,
 			SLJIT_MOV_U8,
-			BUXN_JIT_MEM_OFFSET(), 0,
-			addr.reg, 0
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device,
+			value.reg, 0
 		);
+	} else {
 		sljit_emit_op1(
 			ctx->compiler,
 			SLJIT_MOV_U8,
-			BUXN_JIT_MEM(), 0,
+			SLJIT_MEM1(SLJIT_S(BUXN_JIT_S_VM)), device + port,
 			value.reg, 0
 		);
 	}
 
-	buxn_jit_clear_stack_caches(ctx);
-	buxn_jit_save_state(ctx);
-	ctx->mem_base = 0;
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV_P,
-		SLJIT_R0, 0,
-		SLJIT_S(BUXN_JIT_S_VM), 0
-	);
-	sljit_emit_op1(
-		ctx->compiler,
-		SLJIT_MOV,
-		SLJIT_R1, 0,
-		addr.reg, 0
-	);
-	sljit_emit_icall(
-		ctx->compiler,
-		SLJIT_CALL,
-		SLJIT_ARGS2V(P, 32),
-		SLJIT_IMM, value.is_short
-			? SLJIT_FUNC_ADDR(buxn_jit_deo2_helper)
-			: SLJIT_FUNC_ADDR(buxn_jit_deo_helper)
-	);
-	buxn_jit_load_state(ctx);
+	if (kind == BUXN_JIT_PORT_FULL) {
+		// Only the stack pointers are synced
+		buxn_jit_prepare_port_call(ctx);
+		buxn_jit_save_state(ctx);
+		buxn_jit_emit_deo_call(ctx, addr, value.is_short);
+		buxn_jit_load_state(ctx);
+		// Cached stack values are written back only if code was overwritten
+		buxn_jit_resume_point(ctx);
+	} else if (kind == BUXN_JIT_PORT_CALLBACK) {
+		buxn_jit_prepare_port_call(ctx);
+		for (int i = 0; i < (value.is_short ? 2 : 1); ++i) {
+			uint8_t target = (uint8_t)(port + i);
+			if (ctx->jit->ports[target].deo != NULL) {
+				buxn_jit_emit_port_call(ctx, target, false);
+			}
+		}
+	}
 }
 
 static void
@@ -2091,18 +6147,124 @@ buxn_jit_MUL(buxn_jit_ctx_t* ctx) {
 		.const_value = a.const_value * b.const_value,
 		.reg = buxn_jit_alloc_reg(ctx),
 	};
-	sljit_emit_op2(
-		ctx->compiler,
-		SLJIT_MUL,
-		c.reg, 0,
-		a.reg, 0,
-		b.reg, 0
-	);
+	// Multiplying by a literal power of two is a shift
+	int exponent = -1;
+	buxn_jit_reg_t src = a.reg;
+	if (b.semantics & BUXN_JIT_SEM_IMM) {
+		exponent = buxn_jit_log2(b.const_value);
+	}
+	if (exponent < 0 && (a.semantics & BUXN_JIT_SEM_IMM)) {
+		exponent = buxn_jit_log2(a.const_value);
+		src = b.reg;
+	}
+	if (exponent >= 0) {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_SHL,
+			c.reg, 0,
+			src, 0,
+			SLJIT_IMM, exponent
+		);
+	} else {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_MUL,
+			c.reg, 0,
+			a.reg, 0,
+			b.reg, 0
+		);
+	}
 	buxn_jit_wrap_around(ctx, c);
 
 	buxn_jit_push(ctx, c);
 }
 
+// The divisor is a literal: no zero check and no hardware division
+static void
+buxn_jit_div_const(
+	buxn_jit_ctx_t* ctx,
+	buxn_jit_operand_t a,
+	uint16_t divisor,
+	buxn_jit_operand_t c
+) {
+	int exponent = buxn_jit_log2(divisor);
+	uint64_t multiplier;
+	int shift;
+	if (divisor == 0) {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			c.reg, 0,
+			SLJIT_IMM, 0
+		);
+	} else if (exponent >= 0) {
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_LSHR,
+			c.reg, 0,
+			a.reg, 0,
+			SLJIT_IMM, exponent
+		);
+	} else if (buxn_jit_div_magic(divisor, a.is_short ? 16 : 8, &multiplier, &shift)) {
+#if BUXN_JIT_VERBOSE
+		fprintf(
+			stderr,
+			"  ; r%d = (r%d * %llu) >> %d\n",
+			c.reg - SLJIT_R0,
+			a.reg - SLJIT_R0,
+			(unsigned long long)multiplier,
+			shift
+		);
+#endif
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_MUL,
+			c.reg, 0,
+			a.reg, 0,
+			SLJIT_IMM, (sljit_sw)multiplier
+		);
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_LSHR,
+			c.reg, 0,
+			c.reg, 0,
+			SLJIT_IMM, shift
+		);
+	} else {
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			BUXN_JIT_TMP(), 0,
+			SLJIT_R0, 0
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			SLJIT_R0, 0,
+			a.reg, 0
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			SLJIT_R1, 0,
+			SLJIT_IMM, divisor
+		);
+		sljit_emit_op0(ctx->compiler, SLJIT_DIV_UW);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			c.reg, 0,
+			SLJIT_R0, 0
+		);
+		sljit_emit_op1(
+			ctx->compiler,
+			SLJIT_MOV,
+			SLJIT_R0, 0,
+			BUXN_JIT_TMP(), 0
+		);
+	}
+}
+
 static void
 buxn_jit_DIV(buxn_jit_ctx_t* ctx) {
 	buxn_jit_operand_t b = buxn_jit_pop(ctx);
@@ -2119,6 +6281,12 @@ buxn_jit_DIV(buxn_jit_ctx_t* ctx) {
 		c.const_value = a.const_value / b.const_value;
 	}
 
+	if (b.semantics & BUXN_JIT_SEM_IMM) {
+		buxn_jit_div_const(ctx, a, b.const_value, c);
+		buxn_jit_push(ctx, c);
+		return;
+	}
+
 	struct sljit_jump* set_zero = sljit_emit_cmp(
 		ctx->compiler,
 		SLJIT_EQUAL,
@@ -2271,6 +6439,32 @@ buxn_jit_SFT(buxn_jit_ctx_t* ctx) {
 		.const_value = (a.const_value >> (b.const_value & 0x0f)) << ((b.const_value & 0xf0) >> 4),
 		.reg = buxn_jit_alloc_reg(ctx),
 	};
+	if (b.semantics & BUXN_JIT_SEM_IMM) {
+		// Both shift amounts are known
+		uint8_t right = b.const_value & 0x0f;
+		uint8_t left = (b.const_value & 0xf0) >> 4;
+		sljit_emit_op2(
+			ctx->compiler,
+			SLJIT_LSHR,
+			c.reg, 0,
+			a.reg, 0,
+			SLJIT_IMM, right
+		);
+		if (left > 0) {
+			sljit_emit_op2(
+				ctx->compiler,
+				SLJIT_SHL,
+				c.reg, 0,
+				c.reg, 0,
+				SLJIT_IMM, left
+			);
+			buxn_jit_wrap_around(ctx, c);
+		}
+
+		buxn_jit_push(ctx, c);
+		return;
+	}
+
 	sljit_emit_op2(
 		ctx->compiler,
 		SLJIT_AND,
@@ -2343,22 +6537,121 @@ buxn_jit_LIT(buxn_jit_ctx_t* ctx) {
 
 // }}}
 
+// Returns 0 if the target has to be interpreted
 static sljit_uw
-buxn_jit_translate_jump_addr(sljit_up jit, sljit_u32 target) {
-	buxn_jit_block_t* block = buxn_jit((buxn_jit_t*)jit, target);
-	return block->head_addr;
+buxn_jit_translate_jump_addr(sljit_up jit_ptr, sljit_u32 target) {
+	buxn_jit_t* jit = (buxn_jit_t*)jit_ptr;
+	if (!buxn_jit_try_lock(jit)) {
+		// The worker is busy compiling, only code which is ready is used
+		buxn_jit_block_t* block = buxn_jit_load_block(jit, (uint16_t)target);
+		return block != NULL ? block->head_addr : 0;
+	}
+
+	sljit_uw head_addr = buxn_jit(jit, (uint16_t)target)->head_addr;
+	buxn_jit_unlock(jit);
+	return head_addr;
+}
+
+// Called when none of the entries of an inline cache matched.
+// `site` identifies the cache by the key of its block and its index within
+// the block.
+// Returns the body of the target to jump to, or the target itself if the
+// jump has to go through the trampoline.
+static sljit_uw
+buxn_jit_ic_miss(sljit_up jit_ptr, sljit_u32 site, sljit_u32 target) {
+	buxn_jit_t* jit = (buxn_jit_t*)jit_ptr;
+	uint16_t pc = (uint16_t)target;
+	if (!buxn_jit_try_lock(jit)) {
+		// The worker is busy compiling, the cache is filled on a later miss
+		buxn_jit_block_t* block = buxn_jit_load_block(jit, pc);
+		return block != NULL && block->fn != NULL ? block->body_addr : pc;
+	}
+
+	buxn_jit_block_t* block = buxn_jit(jit, pc);
+	if (block->fn == NULL) {
+		buxn_jit_unlock(jit);
+		return pc;
+	}
+	BUXN_JIT_ASSERT(block->body_addr > 0xffff, "Code address collides with uxn address");
+
+	// The source may have been discarded or replaced while it was running.
+	// Filling the cache of its replacement is still correct.
+	buxn_jit_block_t* source = buxn_jit_find_variant(
+		jit,
+		(uint16_t)site,
+		(uint8_t)((site >> 16) & 0x1f)
+	);
+	uint16_t ic_site = (uint16_t)(site >> 21);
+	uint8_t ic_slot = (uint8_t)((pc ^ (pc >> 8)) % BUXN_JIT_IC_SIZE);
+	for (buxn_jit_link_t* itr = source->outgoing; itr != NULL; itr = itr->next_out) {
+		if (
+			itr->type == BUXN_JIT_LINK_IC
+			&& itr->ic_site == ic_site
+			&& itr->ic_slot == ic_slot
+		) {
+			buxn_jit_fill_ic(itr, block, pc);
+			break;
+		}
+	}
+
+	sljit_uw body_addr = block->body_addr;
+	buxn_jit_unlock(jit);
+	return body_addr;
+}
+
+static sljit_sw
+buxn_jit_reloc_value(buxn_jit_t* jit, buxn_jit_reloc_type_t type) {
+	switch (type) {
+		case BUXN_JIT_RELOC_JIT:
+			return (sljit_sw)jit;
+		case BUXN_JIT_RELOC_CODE_MAP:
+			return (sljit_sw)jit->code_map;
+		case BUXN_JIT_RELOC_BLOCK_TABLE:
+			return (sljit_sw)jit->blocks.table;
+		case BUXN_JIT_RELOC_TRANSLATE_JUMP_ADDR:
+			return SLJIT_FUNC_ADDR(buxn_jit_translate_jump_addr);
+		case BUXN_JIT_RELOC_IC_MISS:
+			return SLJIT_FUNC_ADDR(buxn_jit_ic_miss);
+		case BUXN_JIT_RELOC_DEI:
+			return SLJIT_FUNC_ADDR(buxn_jit_dei_helper);
+		case BUXN_JIT_RELOC_DEI2:
+			return SLJIT_FUNC_ADDR(buxn_jit_dei2_helper);
+		case BUXN_JIT_RELOC_DEO:
+			return SLJIT_FUNC_ADDR(buxn_jit_deo_helper);
+		case BUXN_JIT_RELOC_DEO2:
+			return SLJIT_FUNC_ADDR(buxn_jit_deo2_helper);
+		case BUXN_JIT_RELOC_CODE_WRITE:
+			return SLJIT_FUNC_ADDR(buxn_jit_code_write_helper);
+		case BUXN_JIT_RELOC_COUNT:
+			break;
+	}
+
+	BUXN_JIT_ASSERT(false, "Invalid relocation");
+	return 0;
 }
 
 static void
 buxn_jit_compile(buxn_jit_t* jit, const buxn_jit_entry_t* entry) {
+	uint64_t start_time = buxn_jit_time_ns();
 	buxn_jit_ctx_t ctx = {
 		.jit = jit,
+		.memory = jit->vm->memory,
+		.memory_base = 0,
+		.memory_end = 0xffff,
 		.entry_pc = entry->pc,
 		.pc = entry->pc,
 		.block = entry->block,
 		.compiler = entry->compiler,
+		.cache_size = jit->config.stack_cache_size,
 	};
 
+	if (entry->code_copy != NULL) {
+		uint32_t end = (uint32_t)entry->pc + BUXN_JIT_CODE_COPY_SIZE - 1;
+		ctx.memory = entry->code_copy->bytes;
+		ctx.memory_base = entry->pc;
+		ctx.memory_end = end > 0xffff ? 0xffff : (uint16_t)end;
+	}
+
 #if BUXN_JIT_VERBOSE
 	sljit_compiler_verbose(ctx.compiler, stderr);
 	fprintf(stderr, "  ; 0x%04x {{{\n", entry->pc);
@@ -2373,7 +6666,7 @@ buxn_jit_compile(buxn_jit_t* jit, const buxn_jit_entry_t* entry) {
 		SLJIT_ARGS1(32, P),
 		BUXN_JIT_R_COUNT,
 		BUXN_JIT_S_COUNT,
-		0
+		sizeof(sljit_sw)
 	);
 	buxn_jit_load_state(&ctx);
 
@@ -2391,30 +6684,79 @@ buxn_jit_compile(buxn_jit_t* jit, const buxn_jit_entry_t* entry) {
 		SLJIT_R0, 0,
 		SLJIT_IMM, 0xffff
 	);
-	struct sljit_jump* jmp_zero_page = sljit_emit_cmp(
-		ctx.compiler,
-		SLJIT_LESS,
-		SLJIT_R0, 0,
-		SLJIT_IMM, BUXN_RESET_VECTOR
-	);
 
+	// Keep the target in case it has to be interpreted
 	sljit_emit_op1(
 		ctx.compiler,
 		SLJIT_MOV32,
-		SLJIT_R1, 0,
+		SLJIT_MEM1(SLJIT_SP), 0,
 		SLJIT_R0, 0
 	);
+
+	// Fast path: the target is already compiled
+	buxn_jit_emit_reloc(&ctx, SLJIT_R2, BUXN_JIT_RELOC_BLOCK_TABLE);
 	sljit_emit_op1(
 		ctx.compiler,
 		SLJIT_MOV_P,
-		SLJIT_R0, 0,
-		SLJIT_IMM, (sljit_sw)jit
+		SLJIT_R2, 0,
+		SLJIT_MEM2(SLJIT_R2, SLJIT_R0), SLJIT_WORD_SHIFT
+	);
+	struct sljit_jump* jmp_no_block = sljit_emit_cmp(
+		ctx.compiler,
+		SLJIT_EQUAL,
+		SLJIT_R2, 0,
+		SLJIT_IMM, 0
+	);
+	sljit_emit_op1(
+		ctx.compiler,
+		SLJIT_MOV,
+		SLJIT_R1, 0,
+		SLJIT_MEM1(SLJIT_R2), SLJIT_OFFSETOF(buxn_jit_block_t, head_addr)
+	);
+	struct sljit_jump* jmp_no_code = sljit_emit_cmp(
+		ctx.compiler,
+		SLJIT_EQUAL,
+		SLJIT_R1, 0,
+		SLJIT_IMM, 0
+	);
+	// For the clock sweep
+	sljit_emit_op1(
+		ctx.compiler,
+		SLJIT_MOV_U8,
+		SLJIT_MEM1(SLJIT_R2), SLJIT_OFFSETOF(buxn_jit_block_t, referenced),
+		SLJIT_IMM, 1
+	);
+	sljit_emit_icall(
+		ctx.compiler,
+		SLJIT_CALL_REG_ARG,
+		SLJIT_ARGS0(32),
+		SLJIT_R1, 0
+	);
+	sljit_set_label(sljit_emit_jump(ctx.compiler, SLJIT_JUMP), lbl_trampoline);
+
+	// Slow path: find or compile the target
+	struct sljit_label* lbl_translate = sljit_emit_label(ctx.compiler);
+	sljit_set_label(jmp_no_block, lbl_translate);
+	sljit_set_label(jmp_no_code, lbl_translate);
+	sljit_emit_op1(
+		ctx.compiler,
+		SLJIT_MOV32,
+		SLJIT_R1, 0,
+		SLJIT_R0, 0
 	);
+	buxn_jit_emit_reloc(&ctx, SLJIT_R0, BUXN_JIT_RELOC_JIT);
+	buxn_jit_emit_reloc(&ctx, SLJIT_R2, BUXN_JIT_RELOC_TRANSLATE_JUMP_ADDR);
 	sljit_emit_icall(
 		ctx.compiler,
 		SLJIT_CALL,
 		SLJIT_ARGS2(W, P, 32),
-		SLJIT_IMM, SLJIT_FUNC_ADDR(buxn_jit_translate_jump_addr)
+		SLJIT_R2, 0
+	);
+	struct sljit_jump* jmp_interpret = sljit_emit_cmp(
+		ctx.compiler,
+		SLJIT_EQUAL,
+		SLJIT_R0, 0,
+		SLJIT_IMM, 0
 	);
 	sljit_emit_icall(
 		ctx.compiler,
@@ -2425,42 +6767,37 @@ buxn_jit_compile(buxn_jit_t* jit, const buxn_jit_entry_t* entry) {
 
 	sljit_set_label(sljit_emit_jump(ctx.compiler, SLJIT_JUMP), lbl_trampoline);
 
+	// The target is still being compiled in the background
+	sljit_set_label(jmp_interpret, sljit_emit_label(ctx.compiler));
+	sljit_emit_op1(
+		ctx.compiler,
+		SLJIT_MOV32,
+		SLJIT_R0, 0,
+		SLJIT_MEM1(SLJIT_SP), 0
+	);
+	sljit_emit_op2(
+		ctx.compiler,
+		SLJIT_OR32,
+		SLJIT_R0, 0,
+		SLJIT_R0, 0,
+		SLJIT_IMM, BUXN_JIT_INTERPRET
+	);
+
 	struct sljit_label* lbl_return = sljit_emit_label(ctx.compiler);
 	sljit_set_label(jmp_brk, lbl_return);
-	sljit_set_label(jmp_zero_page, lbl_return);
 
 	buxn_jit_save_state(&ctx);
 	sljit_emit_return(ctx.compiler, SLJIT_MOV32, SLJIT_R0, 0);
 
-	// Fallback call stub for JSR/JSI in case we can't call for whatever reason
-	ctx.call_fallback = sljit_emit_label(ctx.compiler);
-	sljit_emit_enter(
-		ctx.compiler,
-		SLJIT_ENTER_KEEP(BUXN_JIT_S_COUNT) | SLJIT_ENTER_REG_ARG,
-		SLJIT_ARGS0(32),
-		BUXN_JIT_R_COUNT,
-		BUXN_JIT_S_COUNT,
-		0
-	);
-	// Break because something's wrong
-	sljit_emit_return(ctx.compiler, SLJIT_MOV32, SLJIT_IMM, 0x10000);
-
 #if BUXN_JIT_VERBOSE
 	fprintf(stderr, "  ; }}}\n");
 #endif
 
-	// sljit-specific fast calling convention
 	ctx.head_label = sljit_emit_label(ctx.compiler);
 	sljit_set_label(call, ctx.head_label);
-	sljit_emit_enter(
-		ctx.compiler,
-		SLJIT_ENTER_KEEP(BUXN_JIT_S_COUNT) | SLJIT_ENTER_REG_ARG,
-		SLJIT_ARGS0(32),
-		BUXN_JIT_R_COUNT,
-		BUXN_JIT_S_COUNT,
-		0
-	);
+	buxn_jit_fast_enter(&ctx);
 	ctx.body_label = sljit_emit_label(ctx.compiler);
+	buxn_jit_enter_variant(&ctx, entry->block->shape);
 
 	buxn_jit_hook_t* hook = jit->config.hook;
 	if (hook && hook->begin_block) {
@@ -2470,6 +6807,7 @@ buxn_jit_compile(buxn_jit_t* jit, const buxn_jit_entry_t* entry) {
 		);
 	}
 
+	buxn_jit_build_ir(&ctx);
 	while (ctx.compiler != NULL) {
 		buxn_jit_next_opcode(&ctx);
 	}
@@ -2478,62 +6816,160 @@ buxn_jit_compile(buxn_jit_t* jit, const buxn_jit_entry_t* entry) {
 	fprintf(stderr, "  ; }}}\n");
 #endif
 
+	// The code is not reachable until it is published by the VM thread
 	buxn_jit_block_t* block = entry->block;
-	block->fn = (buxn_jit_fn_t)sljit_generate_code(entry->compiler, 0, NULL);
-	block->head_addr = sljit_get_label_addr(ctx.head_label);
+	void* code = sljit_generate_code(
+		entry->compiler,
+		0,
+		BUXN_JIT_EXEC_ALLOCATOR(jit)
+	);
 	block->body_addr = sljit_get_label_addr(ctx.body_label);
 	block->executable_offset = sljit_get_executable_offset(entry->compiler);
+	for (buxn_jit_reloc_t* itr = block->relocs; itr != NULL; itr = itr->next) {
+		itr->addr = sljit_get_const_addr(itr->value);
+	}
+	block->last_pc = ctx.pc > entry->pc ? ctx.pc - 1 : 0xffff;
 
 	size_t code_size = sljit_get_generated_code_size(entry->compiler);
-	jit->stats.code_size += code_size;
+	block->code_size = code_size;
+
+	buxn_jit_entry_t* ready_entry = buxn_jit_alloc_entry(jit);
+	ready_entry->block = block;
+	ready_entry->code = code;
+	ready_entry->head_addr = sljit_get_label_addr(ctx.head_label);
+	ready_entry->checksum = buxn_jit_scan_code(
+		jit, ctx.memory, ctx.memory_base, block, 0
+	);
+	buxn_jit_enqueue(&jit->ready_queue, ready_entry);
+
+	// Variants are never reached through the trampoline, bring back the
+	// evicted ones which are still linked to
+	if (block->shape == 0) {
+		for (buxn_jit_block_t* itr = block->variants; itr != NULL; itr = itr->variants) {
+			if (itr->incoming != NULL) {
+				buxn_jit_queue_compile(jit, itr);
+			}
+		}
+	}
 
 	if (hook && hook->end_block) {
 		hook->end_block(
 			hook->userdata,
 			&(buxn_jit_hook_ctx_t){ .jit_ctx = &ctx },
-			(uintptr_t)block->fn, code_size
+			(uintptr_t)code, code_size
 		);
 	}
-}
-
-static buxn_jit_block_t*
-buxn_jit(buxn_jit_t* jit, uint16_t pc) {
-	buxn_jit_block_t* block = buxn_jit_queue_block(jit, pc);
-	if (block->fn != NULL) { return block; }
 
-	buxn_jit_entry_t* entry;
+	jit->stats.compile_time_ns += buxn_jit_time_ns() - start_time;
+}
 
-	while ((entry = buxn_jit_dequeue(&jit->compile_queue)) != NULL) {
-		buxn_jit_compile(jit, entry);
-		buxn_jit_enqueue(&jit->entry_pool, entry);
+static void
+buxn_jit_process_entry(buxn_jit_t* jit, buxn_jit_entry_t* entry) {
+	struct sljit_compiler* compiler = entry->compiler;
+	buxn_jit_compile(jit, entry);
+#if BUXN_JIT_THREADS
+	if (entry->code_copy != NULL) {
+		entry->code_copy->next = jit->code_copy_pool;
+		jit->code_copy_pool = entry->code_copy;
 	}
+#endif
+	buxn_jit_enqueue(&jit->entry_pool, entry);
 
+	// Only the code of the new block is patched here, it is not reachable yet
 	while ((entry = buxn_jit_dequeue(&jit->link_queue)) != NULL) {
-		sljit_uw target = entry->link_type == BUXN_JIT_LINK_TO_HEAD
-			? entry->block->head_addr
-			: entry->block->body_addr;
-		if (target != 0) {
-			sljit_set_jump_addr(
-				sljit_get_jump_addr(entry->jump),
-				target,
-				entry->block->executable_offset
-			);
+		buxn_jit_link_t* link = buxn_jit_alloc_link(jit);
+		*link = (buxn_jit_link_t){
+			.type = entry->link_type,
+			.source = entry->source,
+			.target = entry->block,
+			.jump_addr = sljit_get_jump_addr(entry->jump),
+			.fallback_addr = sljit_get_label_addr(entry->fallback),
+			.resume_addr = entry->link_type == BUXN_JIT_LINK_RESUME
+				? sljit_get_label_addr(entry->resume)
+				: 0,
+			.key_addr = entry->link_type == BUXN_JIT_LINK_IC
+				? sljit_get_const_addr(entry->key)
+				: 0,
+			.ic_site = entry->ic_site,
+			.ic_slot = entry->ic_slot,
+			.next_out = entry->source->outgoing,
+		};
+		entry->source->outgoing = link;
+
+		if (link->target != NULL) {
+			link->next_in = entry->block->incoming;
+			entry->block->incoming = link;
+
+			if (entry->block->fn != NULL) {
+				buxn_jit_patch_link(link);
+			}
 		}
 
 		buxn_jit_enqueue(&jit->entry_pool, entry);
 	}
 
-	while ((entry = buxn_jit_dequeue(&jit->cleanup_queue)) != NULL) {
-		sljit_free_compiler(entry->compiler);
-		buxn_jit_enqueue(&jit->entry_pool, entry);
+	sljit_free_compiler(compiler);
+}
+
+static void
+buxn_jit_process_queues(buxn_jit_t* jit) {
+	buxn_jit_entry_t* entry;
+	while ((entry = buxn_jit_dequeue(&jit->compile_queue)) != NULL) {
+		buxn_jit_process_entry(jit, entry);
+	}
+}
+
+// Find the block for the given address.
+// The block may not have any code yet if it is not hot enough or it is being
+// compiled by the worker.
+static buxn_jit_block_t*
+buxn_jit(buxn_jit_t* jit, uint16_t pc) {
+	buxn_jit_publish(jit);
+
+	buxn_jit_block_t* block = buxn_jit_find_block(jit, pc);
+	block->referenced = true;
+	if (block->fn != NULL) { return block; }
+
+	// Tier 0: interpret until the block is hot
+	if (block->hotness < jit->config.hot_threshold) {
+		block->hotness += 1;
+		return block;
 	}
 
+	buxn_jit_queue_compile(jit, block);
+
+#if BUXN_JIT_THREADS
+	if (jit->has_worker) {
+		buxn_jit_capture(jit);
+		return block;
+	}
+#endif
+
+	buxn_jit_process_queues(jit);
+	buxn_jit_publish(jit);
 	return block;
 }
 
 static void
 buxn_jit_next_opcode(buxn_jit_ctx_t* ctx) {
-	if (ctx->pc < 256) {
+	buxn_jit_insn_t* insn = buxn_jit_find_insn(ctx);
+	while (insn != NULL) {
+		if (insn->loop_header && insn->label == NULL) {
+			buxn_jit_loop_header(ctx, insn);
+		}
+
+		if (insn->type != BUXN_JIT_INSN_NOP) { break; }
+		ctx->pc = insn->next_pc;
+		insn = buxn_jit_find_insn(ctx);
+	}
+
+	// A block covers a single range of memory, execution which wraps around
+	// to the zero page continues in another block.
+	// So does execution past the bytes copied for the worker.
+	if (
+		ctx->pc < ctx->entry_pc
+		|| (ctx->memory_end != 0xffff && (uint32_t)ctx->pc + 2 > ctx->memory_end)
+	) {
 		buxn_jit_clear_stack_caches(ctx);
 		sljit_emit_return(ctx->compiler, SLJIT_MOV32, SLJIT_IMM, ctx->pc);
 		buxn_jit_finalize(ctx);
@@ -2543,14 +6979,17 @@ buxn_jit_next_opcode(buxn_jit_ctx_t* ctx) {
 	memset(ctx->reg_ref_counts, 0, sizeof(ctx->reg_ref_counts));
 	buxn_jit_stack_cache_retain(ctx, &ctx->wst_cache);
 	buxn_jit_stack_cache_retain(ctx, &ctx->rst_cache);
+	for (uint8_t i = 0; i < ctx->num_mem_values; ++i) {
+		buxn_jit_retain_reg(ctx, ctx->mem_values[i].reg);
+	}
 #if BUXN_JIT_VERBOSE
 	if (ctx->wst_cache.len > 0) {
 		fprintf(stderr, "  ; WST:");
 		for (uint8_t i = 0; i < ctx->wst_cache.len; ++i) {
-			buxn_jit_stack_cache_cell_t* cell = &ctx->wst_cache.cells[i];
+			buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, &ctx->wst_cache, i);
 			fprintf(
 				stderr,
-				" r%d%s",
+				cell->in_slot ? " [r%d]%s" : " r%d%s",
 				cell->value.reg - SLJIT_R0,
 				cell->value.is_short ? "*" : ""
 			);
@@ -2561,10 +7000,10 @@ buxn_jit_next_opcode(buxn_jit_ctx_t* ctx) {
 	if (ctx->rst_cache.len > 0) {
 		fprintf(stderr, "  ; RST:");
 		for (uint8_t i = 0; i < ctx->rst_cache.len; ++i) {
-			buxn_jit_stack_cache_cell_t* cell = &ctx->rst_cache.cells[i];
+			buxn_jit_stack_cache_cell_t* cell = buxn_jit_stack_cache_at(ctx, &ctx->rst_cache, i);
 			fprintf(
 				stderr,
-				" r%d%s",
+				cell->in_slot ? " [r%d]%s" : " r%d%s",
 				cell->value.reg - SLJIT_R0,
 				cell->value.is_short ? "*" : ""
 			);
@@ -2575,7 +7014,7 @@ buxn_jit_next_opcode(buxn_jit_ctx_t* ctx) {
 
 	uint8_t shadow_wsp;
 	uint8_t shadow_rsp;
-	ctx->current_opcode = ctx->jit->vm->memory[ctx->pc++];
+	ctx->current_opcode = buxn_jit_peek(ctx, ctx->pc++);
 
 	buxn_jit_hook_t* hook = ctx->jit->config.hook;
 	if (hook && hook->jit_opcode) {
@@ -2586,7 +7025,9 @@ buxn_jit_next_opcode(buxn_jit_ctx_t* ctx) {
 		);
 	}
 
-	if (buxn_jit_op_flag_k(ctx)) {
+	// Idioms handle keep mode themselves
+	bool is_idiom = insn != NULL && insn->type == BUXN_JIT_INSN_IDIOM;
+	if (buxn_jit_op_flag_k(ctx) && !is_idiom) {
 #if BUXN_JIT_VERBOSE
 		fprintf(stderr, "  ; Shadow stack {{{\n");
 #endif
@@ -2630,6 +7071,30 @@ buxn_jit_next_opcode(buxn_jit_ctx_t* ctx) {
 		ctx->rsp_reg = SLJIT_S(BUXN_JIT_S_RSP);
 	}
 
+	if (insn != NULL && insn->type == BUXN_JIT_INSN_CONST) {
+		buxn_jit_folded_const(ctx, insn);
+		return;
+	}
+
+	if (insn != NULL && insn->type == BUXN_JIT_INSN_BRANCH) {
+		buxn_jit_compare_and_branch(ctx, insn);
+		return;
+	}
+
+	if (is_idiom) {
+		const buxn_jit_idiom_t* idiom = &buxn_jit_idioms[insn->idiom];
+#if BUXN_JIT_VERBOSE
+		fprintf(stderr, "  ; %s {{{\n", idiom->name);
+#endif
+		idiom->compile(ctx, insn);
+#if BUXN_JIT_VERBOSE
+		fprintf(stderr, "  ; }}}\n");
+#endif
+		ctx->jit->stats.idiom_hits[insn->idiom] += 1;
+		ctx->pc = insn->next_pc;
+		return;
+	}
+
 	switch (ctx->current_opcode) {
 		BUXN_OPCODE_DISPATCH(BUXN_JIT_DISPATCH)
 	}
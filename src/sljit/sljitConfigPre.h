@@ -0,0 +1,26 @@
+#ifndef BUXN_JIT_SLJIT_CONFIG_PRE_H
+#define BUXN_JIT_SLJIT_CONFIG_PRE_H
+
+// Executable memory is provided by the code arena in jit.c.
+// The allocator is passed as `exec_allocator_data` to sljit_generate_code and
+// sljit_free_code.
+
+#include <stddef.h>
+
+typedef struct buxn_jit_exec_allocator_s {
+	void* (*alloc)(struct buxn_jit_exec_allocator_s* allocator, size_t size);
+	void (*free)(struct buxn_jit_exec_allocator_s* allocator, void* ptr);
+} buxn_jit_exec_allocator_t;
+
+#define SLJIT_EXECUTABLE_ALLOCATOR 0
+
+#define SLJIT_MALLOC_EXEC(size, exec_allocator_data) \
+	((buxn_jit_exec_allocator_t*)(exec_allocator_data))->alloc( \
+		(buxn_jit_exec_allocator_t*)(exec_allocator_data), (size) \
+	)
+#define SLJIT_FREE_EXEC(ptr, exec_allocator_data) \
+	((buxn_jit_exec_allocator_t*)(exec_allocator_data))->free( \
+		(buxn_jit_exec_allocator_t*)(exec_allocator_data), (ptr) \
+	)
+
+#endif
@@ -0,0 +1,108 @@
+#include <btest.h>
+#include <barena.h>
+#include <buxn/vm/vm.h>
+#include <buxn/jit.h>
+#include "common.h"
+
+static struct {
+	barena_pool_t pool;
+	barena_t arena;
+	buxn_jit_t* jit;
+	buxn_vm_t* vm;
+} fixture;
+
+static void
+init_per_suite(void) {
+	barena_pool_init(&fixture.pool, 1);
+}
+
+static void
+cleanup_per_suite(void) {
+	barena_pool_cleanup(&fixture.pool);
+}
+
+static void
+init_per_test(void) {
+	barena_init(&fixture.arena, &fixture.pool);
+	fixture.vm = barena_memalign(
+		&fixture.arena,
+		sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE,
+		_Alignof(buxn_vm_t)
+	);
+	fixture.vm->config = (buxn_vm_config_t){
+		.memory_size = BUXN_MEMORY_BANK_SIZE,
+	};
+	buxn_vm_reset(fixture.vm, BUXN_VM_RESET_ALL);
+
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.background_compile = true,
+	});
+}
+
+static void
+cleanup_per_test(void) {
+	buxn_jit_cleanup(fixture.jit);
+	barena_reset(&fixture.arena);
+}
+
+static btest_suite_t background = {
+	.name = "background",
+
+	.init_per_suite = init_per_suite,
+	.cleanup_per_suite = cleanup_per_suite,
+
+	.init_per_test = init_per_test,
+	.cleanup_per_test = cleanup_per_test,
+};
+
+BTEST(background, interpret_until_compiled) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#07 #04 modulo BRK        ( 03 )\n"
+		"@modulo ( a mod -- res )\n"
+		"DIVk MUL SUB JMP2r"
+	));
+
+	// Results must be the same whether the code is ready or not
+	for (int i = 0; i < 1000; ++i) {
+		fixture.vm->wsp = 0;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x03);
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->rsp, 0);
+	}
+
+	// The first execution never has compiled code
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT(stats->num_interpreted >= 1);
+}
+
+BTEST(background, write_while_compiling) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.background_compile = true,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#00 BRK"
+	));
+
+	// The literal may change while the worker compiles from an older copy
+	for (int i = 0; i < 1000; ++i) {
+		fixture.vm->memory[BUXN_RESET_VECTOR + 1] = (uint8_t)i;
+		buxn_jit_invalidate_range(fixture.jit, BUXN_RESET_VECTOR + 1, BUXN_RESET_VECTOR + 1);
+
+		fixture.vm->wsp = 0;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], (uint8_t)i);
+	}
+}
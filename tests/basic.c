@@ -126,6 +126,21 @@ BTEST(basic, stack_wrap_around_2) {
 	BTEST_EXPECT_EQUAL("%d", fixture.vm->ws[255], 2);
 }
 
+BTEST(basic, stack_wrap_around_flush) {
+	fixture.vm->memory[BUXN_RESET_VECTOR + 0] = 0x80; // LIT
+	fixture.vm->memory[BUXN_RESET_VECTOR + 1] = 0x01;
+	fixture.vm->memory[BUXN_RESET_VECTOR + 2] = 0xa0; // LIT2
+	fixture.vm->memory[BUXN_RESET_VECTOR + 3] = 0x02;
+	fixture.vm->memory[BUXN_RESET_VECTOR + 4] = 0x03;
+	fixture.vm->wsp = 0xfe;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->ws[254], 1);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->ws[255], 2);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->ws[0], 3);
+}
+
 BTEST(basic, div) {
 	fixture.vm->memory[BUXN_RESET_VECTOR] = 0x1b; // DIV
 	fixture.vm->ws[0] = 6;
@@ -0,0 +1,123 @@
+#include <btest.h>
+#include <barena.h>
+#include <buxn/vm/vm.h>
+#include <buxn/jit.h>
+#include "common.h"
+
+static struct {
+	barena_pool_t pool;
+	barena_t arena;
+	buxn_jit_t* jit;
+	buxn_vm_t* vm;
+} fixture;
+
+static void
+init_per_suite(void) {
+	barena_pool_init(&fixture.pool, 1);
+}
+
+static void
+cleanup_per_suite(void) {
+	barena_pool_cleanup(&fixture.pool);
+}
+
+static void
+init_per_test(void) {
+	barena_init(&fixture.arena, &fixture.pool);
+	fixture.vm = barena_memalign(
+		&fixture.arena,
+		sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE,
+		_Alignof(buxn_vm_t)
+	);
+	fixture.vm->config = (buxn_vm_config_t){
+		.memory_size = BUXN_MEMORY_BANK_SIZE,
+	};
+	buxn_vm_reset(fixture.vm, BUXN_VM_RESET_ALL);
+
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		// Evict everything before each execution
+		.max_code_size = 1,
+	});
+}
+
+static void
+cleanup_per_test(void) {
+	buxn_jit_cleanup(fixture.jit);
+	barena_reset(&fixture.arena);
+}
+
+static btest_suite_t cache = {
+	.name = "cache",
+
+	.init_per_suite = init_per_suite,
+	.cleanup_per_suite = cleanup_per_suite,
+
+	.init_per_test = init_per_test,
+	.cleanup_per_test = cleanup_per_test,
+};
+
+BTEST(cache, evict) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 INC BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x02);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 1);
+	BTEST_EXPECT_EQUAL("%d", stats->num_evictions, 1);
+}
+
+BTEST(cache, relink) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 add-one BRK\n"
+		"@add-one INC JMP2r\n"
+		"|0200 #10 add-one BRK"
+	));
+	buxn_jit_execute(fixture.jit, 0x0100);
+	buxn_jit_execute(fixture.jit, 0x0200);
+	buxn_jit_execute(fixture.jit, 0x0100);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 3);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x11);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[2], 0x02);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->rsp, 0);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 3);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+	BTEST_EXPECT(stats->num_evictions > 0);
+}
+
+BTEST(cache, arena_reuse) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 INC BRK"
+	));
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	size_t used = stats->code_arena_used;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	BTEST_EXPECT_EQUAL("%d", stats->num_evictions, 1);
+
+	// The arena is not available on all platforms
+	if (stats->code_arena_capacity > 0) {
+		BTEST_EXPECT(used > 0);
+		BTEST_EXPECT_EQUAL("%zu", stats->code_arena_used, used);
+		BTEST_EXPECT_EQUAL("%zu", stats->code_arena_free, (size_t)0);
+		BTEST_EXPECT_EQUAL("%d", stats->num_arena_overflows, 0);
+	}
+}
@@ -130,3 +130,161 @@ BTEST(device, deo2) {
 	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 0);
 	BTEST_EXPECT_EQUAL("0x%04x", fixture.deo, 0xcafe);
 }
+
+static void
+port_deo(buxn_vm_t* vm, uint8_t addr) {
+	fixture.deo = (uint16_t)(fixture.deo << 8) | vm->device[addr];
+}
+
+static uint8_t
+port_dei(buxn_vm_t* vm, uint8_t addr) {
+	return (uint8_t)(addr + 1);
+}
+
+BTEST(device, passive_port) {
+	buxn_jit_port_t ports[256] = { 0 };
+	ports[0xd0].kind = BUXN_JIT_PORT_PASSIVE;
+	ports[0xd1].kind = BUXN_JIT_PORT_PASSIVE;
+	ports[0xd2].kind = BUXN_JIT_PORT_PASSIVE;
+	ports[0xd3].kind = BUXN_JIT_PORT_PASSIVE;
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.ports = ports,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|d0 @Test &deo $2 &dei $2 |0100 #cafe .Test/deo DEO2 .Test/dei DEI2"
+	));
+	fixture.dei = 0xbeef;
+	fixture.vm->device[0xd2] = 0x12;
+	fixture.vm->device[0xd3] = 0x34;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	// The device handler is bypassed
+	BTEST_EXPECT_EQUAL("0x%04x", fixture.deo, 0x0000);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->device[0xd0], 0xca);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->device[0xd1], 0xfe);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x12);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x34);
+}
+
+BTEST(device, callback_port) {
+	buxn_jit_port_t ports[256] = { 0 };
+	ports[0xd0] = (buxn_jit_port_t){ .kind = BUXN_JIT_PORT_CALLBACK, .deo = port_deo };
+	ports[0xd1] = (buxn_jit_port_t){ .kind = BUXN_JIT_PORT_CALLBACK, .deo = port_deo };
+	ports[0xd2] = (buxn_jit_port_t){ .kind = BUXN_JIT_PORT_CALLBACK, .dei = port_dei };
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.ports = ports,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|d0 @Test &deo $2 &dei $2 |0100 #01 #02 #cafe .Test/deo DEO2 .Test/dei DEI ADD ADD"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	// Both ports of the short were called, stack values survive the calls
+	BTEST_EXPECT_EQUAL("0x%04x", fixture.deo, 0xcafe);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0xd6);
+}
+
+BTEST(device, no_stack_access_port) {
+	buxn_jit_port_t ports[256] = { 0 };
+	ports[0xd0].no_stack_access = true;
+	ports[0xd1].no_stack_access = true;
+	ports[0xd2].no_stack_access = true;
+	ports[0xd3].no_stack_access = true;
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.ports = ports,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|d0 @Test &deo $2 &dei $2 |0100 #01 #02 #cafe .Test/deo DEO2 .Test/dei DEI2 ADD2"
+	));
+	fixture.dei = 0xbeef;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	// The device handler is still called, stack values survive the calls
+	BTEST_EXPECT_EQUAL("0x%04x", fixture.deo, 0xcafe);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0xbf);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0xf1);
+}
+
+static bool
+setup_event(buxn_vm_t* vm, void* events, size_t index) {
+	uint8_t event = ((uint8_t*)events)[index];
+	if (event == 0xff) { return false; }
+
+	vm->device[0xd4] = event;
+	return true;
+}
+
+BTEST(device, batch) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|d0 @Test &deo $2 &dei $2 &event $1 "
+		"|0100 .Test/event DEI #00 SWP .Test/deo DEI2 ADD2 .Test/deo DEO2 BRK"
+	));
+	buxn_jit_vector_t vector = { .addr = BUXN_RESET_VECTOR };
+	uint8_t events[] = { 1, 2, 3, 0xff, 5 };
+
+	// The batch stops at the rejected event
+	size_t num_handled = buxn_jit_execute_batch(fixture.jit, &vector, events, sizeof(events), setup_event);
+	BTEST_EXPECT_EQUAL("%zu", num_handled, 3);
+	BTEST_EXPECT_EQUAL("%d", fixture.deo, 6);
+	BTEST_EXPECT(vector.block != NULL);
+
+	// The cached code is reused
+	num_handled = buxn_jit_execute_batch(fixture.jit, &vector, &events[4], 1, setup_event);
+	BTEST_EXPECT_EQUAL("%zu", num_handled, 1);
+	BTEST_EXPECT_EQUAL("%d", fixture.deo, 11);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 0);
+}
+
+BTEST(device, batch_bookkeeping) {
+	// Code is evicted before every execution
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.max_code_size = 1,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|d0 @Test &deo $2 &dei $2 &event $1 "
+		"|0100 .Test/event DEI #00 SWP .Test/deo DEI2 ADD2 .Test/deo DEO2 BRK"
+	));
+	buxn_jit_vector_t vector = { .addr = BUXN_RESET_VECTOR };
+	uint8_t events[] = { 1, 2, 3, 4, 5 };
+
+	// Within a batch, the code is compiled once and kept
+	size_t num_handled = buxn_jit_execute_batch(fixture.jit, &vector, events, sizeof(events), setup_event);
+	BTEST_EXPECT_EQUAL("%zu", num_handled, sizeof(events));
+	BTEST_EXPECT_EQUAL("%d", fixture.deo, 15);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_evictions, 0);
+
+	// Executing the events one by one evicts every time
+	for (size_t i = 0; i < sizeof(events); ++i) {
+		setup_event(fixture.vm, events, i);
+		buxn_jit_execute_vector(fixture.jit, &vector);
+	}
+	BTEST_EXPECT_EQUAL("%d", fixture.deo, 30);
+	BTEST_EXPECT_EQUAL("%d", stats->num_evictions, (int)sizeof(events));
+}
@@ -0,0 +1,168 @@
+#include <btest.h>
+#include <barena.h>
+#include <buxn/vm/vm.h>
+#include <buxn/jit.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+
+#define IMAGE_PATH "buxn-jit-test.jit"
+#define ROM_SIZE 0x100
+
+static struct {
+	barena_pool_t pool;
+	barena_t arena;
+	buxn_jit_t* jit;
+	buxn_vm_t* vm;
+	buxn_jit_hook_t hook;
+	int num_compiled;
+	uint8_t rom[ROM_SIZE];
+} fixture;
+
+static void
+count_compiled(void* userdata, buxn_jit_hook_ctx_t* ctx, uintptr_t start, size_t size) {
+	fixture.num_compiled += 1;
+}
+
+static void
+restart(void) {
+	if (fixture.jit != NULL) {
+		buxn_jit_cleanup(fixture.jit);
+	}
+
+	buxn_vm_reset(fixture.vm, BUXN_VM_RESET_ALL);
+	memcpy(&fixture.vm->memory[BUXN_RESET_VECTOR], fixture.rom, ROM_SIZE);
+	fixture.num_compiled = 0;
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.hook = &fixture.hook,
+	});
+}
+
+static void
+init_per_suite(void) {
+	barena_pool_init(&fixture.pool, 1);
+}
+
+static void
+cleanup_per_suite(void) {
+	barena_pool_cleanup(&fixture.pool);
+}
+
+static void
+init_per_test(void) {
+	barena_init(&fixture.arena, &fixture.pool);
+	fixture.vm = barena_memalign(
+		&fixture.arena,
+		sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE,
+		_Alignof(buxn_vm_t)
+	);
+	fixture.vm->config = (buxn_vm_config_t){
+		.memory_size = BUXN_MEMORY_BANK_SIZE,
+	};
+	buxn_vm_reset(fixture.vm, BUXN_VM_RESET_ALL);
+
+	fixture.hook = (buxn_jit_hook_t){ .end_block = count_compiled };
+	fixture.jit = NULL;
+}
+
+static void
+cleanup_per_test(void) {
+	if (fixture.jit != NULL) {
+		buxn_jit_cleanup(fixture.jit);
+	}
+	barena_reset(&fixture.arena);
+	remove(IMAGE_PATH);
+}
+
+static btest_suite_t image = {
+	.name = "image",
+
+	.init_per_suite = init_per_suite,
+	.cleanup_per_suite = cleanup_per_suite,
+
+	.init_per_test = init_per_test,
+	.cleanup_per_test = cleanup_per_test,
+};
+
+BTEST(image, warm_start) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 add-one #02 ADD BRK\n"
+		"@add-one INC JMP2r"
+	));
+	memcpy(fixture.rom, &fixture.vm->memory[BUXN_RESET_VECTOR], ROM_SIZE);
+
+	restart();
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	BTEST_EXPECT(fixture.num_compiled > 0);
+	BTEST_ASSERT(buxn_jit_save_image(fixture.jit, IMAGE_PATH, fixture.rom, ROM_SIZE));
+
+	restart();
+	BTEST_ASSERT(buxn_jit_load_image(fixture.jit, IMAGE_PATH, fixture.rom, ROM_SIZE));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x04);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->rsp, 0);
+	BTEST_EXPECT_EQUAL("%d", fixture.num_compiled, 0);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+	BTEST_EXPECT(stats->code_size > 0);
+}
+
+BTEST(image, other_rom) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 INC BRK"
+	));
+	memcpy(fixture.rom, &fixture.vm->memory[BUXN_RESET_VECTOR], ROM_SIZE);
+
+	restart();
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	BTEST_ASSERT(buxn_jit_save_image(fixture.jit, IMAGE_PATH, fixture.rom, ROM_SIZE));
+
+	fixture.rom[1] = 0x02;
+	restart();
+	BTEST_EXPECT(!buxn_jit_load_image(fixture.jit, IMAGE_PATH, fixture.rom, ROM_SIZE));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x03);
+	BTEST_EXPECT(fixture.num_compiled > 0);
+}
+
+BTEST(image, corrupted) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 INC BRK"
+	));
+	memcpy(fixture.rom, &fixture.vm->memory[BUXN_RESET_VECTOR], ROM_SIZE);
+
+	restart();
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	BTEST_ASSERT(buxn_jit_save_image(fixture.jit, IMAGE_PATH, fixture.rom, ROM_SIZE));
+
+	// Flip the last byte of code
+	FILE* file = fopen(IMAGE_PATH, "r+b");
+	BTEST_ASSERT(file != NULL);
+	BTEST_ASSERT(fseek(file, -1, SEEK_END) == 0);
+	int byte = fgetc(file);
+	BTEST_ASSERT(byte != EOF);
+	BTEST_ASSERT(fseek(file, -1, SEEK_END) == 0);
+	fputc(byte ^ 0xff, file);
+	fclose(file);
+
+	restart();
+	BTEST_EXPECT(!buxn_jit_load_image(fixture.jit, IMAGE_PATH, fixture.rom, ROM_SIZE));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+	BTEST_EXPECT(fixture.num_compiled > 0);
+}
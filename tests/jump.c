@@ -68,6 +68,7 @@ BTEST(jump, jmp) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jcn_true) {
@@ -83,6 +84,7 @@ BTEST(jump, jcn_true) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jcn_false) {
@@ -98,6 +100,7 @@ BTEST(jump, jcn_false) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jsr) {
@@ -119,6 +122,7 @@ BTEST(jump, jsr) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jci_true) {
@@ -135,6 +139,7 @@ BTEST(jump, jci_true) {
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 2);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jci_false) {
@@ -151,6 +156,7 @@ BTEST(jump, jci_false) {
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 2);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jmi) {
@@ -167,6 +173,7 @@ BTEST(jump, jmi) {
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 2);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, jsi) {
@@ -186,6 +193,7 @@ BTEST(jump, jsi) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(jump, redirect) {
@@ -202,6 +210,7 @@ BTEST(jump, redirect) {
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 2);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 
 	// Rewrite jump target
 	fixture.vm->memory[0x0101] = 0x03;
@@ -213,6 +222,85 @@ BTEST(jump, redirect) {
 
 	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 3);  // New block
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+}
+
+BTEST(jump, indirect) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|0100 ;table LDA2 JMP2\n"
+		"|0200 @a #0a BRK\n"
+		"|0300 @b #0b BRK\n"
+		"|0400 @table =a"
+	));
+	// Switch between two targets so that both are cached and then hit
+	const uint8_t targets[] = { 0x02, 0x03, 0x02, 0x03 };
+	for (int i = 0; i < 4; ++i) {
+		fixture.vm->memory[0x0400] = targets[i];
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, i + 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[i], targets[i] == 0x02 ? 0x0a : 0x0b);
+	}
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 3);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+}
+
+BTEST(jump, handoff) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#000f #01 !next @next ADD BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x00);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x10);
+
+	// The values stay in registers across the jump
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_variants, 1);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+}
+
+BTEST(jump, loop) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#0000 @loop INC2 DUP2 #0010 NEQ2 ?loop BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x00);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x10);
+
+	// The counter stays in a register across iterations
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_loops, 1);
+	BTEST_EXPECT_EQUAL("%d", stats->num_variants, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+}
+
+BTEST(jump, compare_and_branch) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#00 @loop INC DUP #05 LTH ,loop JCN "
+		"DUP #05 GTH ,fail JCN #2a BRK @fail #ff BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x05);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x2a);
 }
 
 BTEST(jump, boolean_not_taken) {
@@ -276,6 +364,29 @@ BTEST(jump, zero_page_trampoline) {
 	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
 	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x03);
 
+	// The zero page is compiled too
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 2);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+}
+
+BTEST(jump, zero_page_rewrite) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"[ LIT JMP2r ] #02 STZ "
+		"#02 [ LIT INC ] #01 STZ #0001 JSR2 "
+		"[ LIT DUP ] #01 STZ #0001 JSR2"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	// The routine is compiled again after it was overwritten
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x03);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x03);
+
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
-	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 1);
+	BTEST_EXPECT(stats->num_invalidations > 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
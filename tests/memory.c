@@ -154,3 +154,128 @@ BTEST(memory, sta) {
 	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x0800], 0xab);
 	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x0801], 0xcd);
 }
+
+BTEST(memory, wrap_around) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#abcd #ffff STA2 #1234 #ff STZ2 #ffff LDA2 #ff LDZ2 BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0xffff], 0xab);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x00ff], 0x12);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x0000], 0x34);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 4);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0xab);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x34);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[2], 0x12);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[3], 0x34);
+}
+
+BTEST(memory, self_modify) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"[ LIT INC ] ;patch STA #05 @patch POP  ( 06 )"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x06);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_invalidations, 1);
+}
+
+BTEST(memory, self_modify_caller) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#05 patch @after INC BRK\n"
+		"@patch [ LIT POP ] ;after STA JMP2r"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 0);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->rsp, 0);
+}
+
+BTEST(memory, const_literal) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#2a ;lit INC2 STA @lit [ LIT 00 ] BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x2a);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_invalidations, 1);
+
+	// The overwritten literal is loaded from memory from now on
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x2a);
+	BTEST_EXPECT_EQUAL("%d", stats->num_invalidations, 1);
+}
+
+BTEST(memory, forward) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#1234 #10 STZ2 #5678 #10 STZ2 #10 LDZ2 #10 LDZ2 ADD2 BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0xac);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0xf0);
+	// The last store is still written back when the block exits
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x10], 0x56);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x11], 0x78);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_forwarded_loads, 2);
+	BTEST_EXPECT_EQUAL("%d", stats->num_dead_stores, 1);
+}
+
+BTEST(memory, invalidate_range) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 INC BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+
+	// Replace INC with DUP
+	fixture.vm->memory[0x0102] = 0x06;
+	buxn_jit_invalidate_range(fixture.jit, 0x0102, 0x0102);
+	fixture.vm->wsp = 0;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x01);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x01);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_invalidations, 1);
+}
@@ -103,3 +103,21 @@ BTEST(opctest, test) {
 	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
 	BTEST_EXPECT(buxn_system_exit_code(fixture.vm) <= 0);
 }
+
+BTEST(opctest, const_literals) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.const_literals = true,
+	});
+
+	xincbin_data_t opctest = XINCBIN_GET(opctest_tal);
+	BTEST_ASSERT(buxn_asm_str_len(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		(char*)opctest.data, opctest.size, "opctest.tal", 0
+	));
+
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	BTEST_EXPECT(buxn_system_exit_code(fixture.vm) <= 0);
+}
@@ -1,5 +1,6 @@
 #include <btest.h>
 #include <barena.h>
+#include <string.h>
 #include <buxn/vm/vm.h>
 #include <buxn/jit.h>
 #include "common.h"
@@ -68,6 +69,7 @@ BTEST(optimization, add) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(optimization, inc) {
@@ -83,6 +85,7 @@ BTEST(optimization, inc) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(optimization, INCk) {
@@ -99,6 +102,7 @@ BTEST(optimization, INCk) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(optimization, ORAk) {
@@ -116,6 +120,7 @@ BTEST(optimization, ORAk) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(optimization, ORAk_2) {
@@ -133,6 +138,7 @@ BTEST(optimization, ORAk_2) {
 
 	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
 	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
 }
 
 BTEST(optimization, deep_stack) {
@@ -162,3 +168,124 @@ BTEST(optimization, half_stack) {
 	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x0800], 0xca);
 	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x0801], 0xfe);
 }
+
+BTEST(optimization, deep_stack_cache) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.stack_cache_size = 16,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 #02 #03 #04 #05 #06 #07 #08 #09 #0a "
+		"ADD ADD ADD ADD ADD ADD ADD ADD ADD BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x37);
+
+	// Everything fits in the cache even though there are not enough registers
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_spills, 0);
+}
+
+BTEST(optimization, fold) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#1234 #0002 ADD2 #01 SFT2 #02 POP INC2 BRK"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x09);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x1c);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	for (int i = 0; i < BUXN_JIT_NUM_REWRITES; ++i) {
+		const char* name = buxn_jit_rewrite_name(i);
+		int expected = 0;
+		if (strcmp(name, "fold") == 0) {
+			// ADD2, SFT2 and INC2
+			expected = 3;
+		} else if (strcmp(name, "dead value") == 0) {
+			// #02 POP
+			expected = 1;
+		}
+		BTEST_EXPECT_EQUAL("%d", stats->rewrite_hits[i], expected);
+	}
+}
+
+BTEST(optimization, idioms) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"|00 @counter $2 |0100 "
+		"#12ff .counter STZ2 .counter LDZ2 INC2 .counter STZ2 "
+		"#21 DUP ADD #00 SWP ;data LDAk BRK @data 2a"
+	));
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x00], 0x13);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->memory[0x01], 0x00);
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 5);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x00);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x42);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[4], 0x2a);
+
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	for (int i = 0; i < BUXN_JIT_NUM_IDIOMS; ++i) {
+		BTEST_EXPECT_EQUAL(
+			"%d",
+			stats->idiom_hits[i],
+			strcmp(buxn_jit_idiom_name(i), "INCk") == 0 ? 0 : 1
+		);
+	}
+}
+
+BTEST(optimization, const_operand) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#10 LDZ2 #0007 DIV2 #10 LDZ2 #0010 DIV2 #10 LDZ2 #0000 DIV2 "
+		"#12 LDZ #03 DIV #10 LDZ2 #0004 MUL2 #12 LDZ #31 SFT BRK"
+	));
+	fixture.vm->memory[0x10] = 0x12;
+	fixture.vm->memory[0x11] = 0x34;
+	fixture.vm->memory[0x12] = 0xab;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	const uint8_t expected[] = {
+		0x02, 0x99,  // 0x1234 / 7
+		0x01, 0x23,  // 0x1234 / 16
+		0x00, 0x00,  // 0x1234 / 0
+		0x39,        // 0xab / 3
+		0x48, 0xd0,  // 0x1234 * 4
+		0xa8,        // (0xab >> 1) << 3
+	};
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, (int)sizeof(expected));
+	for (int i = 0; i < (int)sizeof(expected); ++i) {
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[i], expected[i]);
+	}
+}
@@ -0,0 +1,198 @@
+#include <btest.h>
+#include <barena.h>
+#include <buxn/vm/vm.h>
+#include <buxn/jit.h>
+#include "common.h"
+
+static struct {
+	barena_pool_t pool;
+	barena_t arena;
+	buxn_jit_t* jit;
+	buxn_vm_t* vm;
+} fixture;
+
+static void
+init_per_suite(void) {
+	barena_pool_init(&fixture.pool, 1);
+}
+
+static void
+cleanup_per_suite(void) {
+	barena_pool_cleanup(&fixture.pool);
+}
+
+static void
+init_per_test(void) {
+	barena_init(&fixture.arena, &fixture.pool);
+	fixture.vm = barena_memalign(
+		&fixture.arena,
+		sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE,
+		_Alignof(buxn_vm_t)
+	);
+	fixture.vm->config = (buxn_vm_config_t){
+		.memory_size = BUXN_MEMORY_BANK_SIZE,
+	};
+	buxn_vm_reset(fixture.vm, BUXN_VM_RESET_ALL);
+
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.hot_threshold = 2,
+	});
+}
+
+static void
+cleanup_per_test(void) {
+	buxn_jit_cleanup(fixture.jit);
+	barena_reset(&fixture.arena);
+}
+
+static btest_suite_t tier = {
+	.name = "tier",
+
+	.init_per_suite = init_per_suite,
+	.cleanup_per_suite = cleanup_per_suite,
+
+	.init_per_test = init_per_test,
+	.cleanup_per_test = cleanup_per_test,
+};
+
+BTEST(tier, compile_when_hot) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 INC BRK"
+	));
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+
+	for (int i = 0; i < 2; ++i) {
+		fixture.vm->wsp = 0;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+		BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, i + 1);
+		BTEST_EXPECT_EQUAL("%zu", stats->code_size, (size_t)0);
+	}
+
+	fixture.vm->wsp = 0;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 2);
+	BTEST_EXPECT(stats->code_size > 0);
+}
+
+BTEST(tier, cold_target) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"DUP ?on-error INC BRK\n"
+		"@on-error #ff BRK"
+	));
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+
+	for (int i = 0; i < 3; ++i) {
+		fixture.vm->wsp = 1;
+		fixture.vm->ws[0] = 0x00;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x01);
+	}
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 2);
+
+	// The error handler runs in the interpreter until it is hot as well
+	fixture.vm->wsp = 1;
+	fixture.vm->ws[0] = 0x01;
+	buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0xff);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 3);
+}
+
+BTEST(tier, interpreted_store) {
+	buxn_jit_cleanup(fixture.jit);
+	fixture.jit = buxn_jit_init(fixture.vm, &(buxn_jit_config_t){
+		.mem_ctx = &fixture.arena,
+		.hot_threshold = 2,
+		.const_literals = true,
+	});
+
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"@get [ LIT &count 00 ] BRK\n"
+		"|0200 ;get/count LDA INC ;get/count STA BRK"
+	));
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+
+	// Compile the literal into the code
+	for (int i = 0; i < 3; ++i) {
+		fixture.vm->wsp = 0;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+	}
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x00);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 2);
+	BTEST_EXPECT(stats->code_size > 0);
+
+	// The increment is still cold so the interpreter overwrites the literal
+	for (int i = 1; i <= 2; ++i) {
+		buxn_jit_execute(fixture.jit, 0x0200);
+		fixture.vm->wsp = 0;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], i);
+	}
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 4);
+	// The literal is loaded from memory after the first store
+	BTEST_EXPECT_EQUAL("%d", stats->num_invalidations, 1);
+}
+
+BTEST(tier, call_next) {
+	// The code after the call is the callee so it runs twice
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#00 ,&next JSR\n"
+		"&next INC DUP #02 EQU ,&done JCN JMP2r\n"
+		"&done BRK"
+	));
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+
+	// Until the callee is hot, the call is not linked
+	for (int i = 0; i < 5; ++i) {
+		fixture.vm->wsp = 0;
+		fixture.vm->rsp = 0;
+		buxn_jit_execute(fixture.jit, BUXN_RESET_VECTOR);
+
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 1);
+		BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+		BTEST_EXPECT_EQUAL("%d", fixture.vm->rsp, 0);
+	}
+	BTEST_EXPECT(stats->code_size > 0);
+}
+
+BTEST(tier, precompile) {
+	BTEST_ASSERT(buxn_asm_str(
+		&fixture.arena,
+		&fixture.vm->memory[BUXN_RESET_VECTOR],
+		"#01 add-one BRK\n"
+		"@add-one INC JMP2r\n"
+		"|0200 #10 add-one BRK"
+	));
+	buxn_jit_precompile(fixture.jit, (uint16_t[]){ 0x0200 }, 1);
+	buxn_jit_stats_t* stats = buxn_jit_stats(fixture.jit);
+	BTEST_EXPECT_EQUAL("%d", stats->num_blocks, 3);
+
+	buxn_jit_execute(fixture.jit, 0x0100);
+	buxn_jit_execute(fixture.jit, 0x0200);
+
+	BTEST_EXPECT_EQUAL("%d", fixture.vm->wsp, 2);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[0], 0x02);
+	BTEST_EXPECT_EQUAL("0x%02x", fixture.vm->ws[1], 0x11);
+	BTEST_EXPECT_EQUAL("%d", stats->num_interpreted, 0);
+	BTEST_EXPECT_EQUAL("%d", stats->num_bounces, 0);
+}